@@ -0,0 +1,313 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "merkle.h"
+#include "pool.h"
+#include "visitor.h"
+
+
+enum async_state {
+	ASYNC_QUEUED,
+	ASYNC_RUNNING,
+	ASYNC_CANCELED,
+	ASYNC_DONE
+};
+
+/* submitted request, from submit until its callback returns */
+struct merkle_async_handle {
+	struct merkle_async *async;
+	struct merkle_async_request request;
+	merkle_async_fn callback;
+	void *user;
+	enum async_state state;
+	int status;
+	struct merkle_async_handle *next; /* in the completed list */
+};
+
+/* buffers reused by every request on the same worker thread */
+struct async_buffers {
+	unsigned char *block_buffer;
+	unsigned char *node_buffer;
+	struct merkle_stack stack;
+};
+
+struct merkle_async {
+	struct merkle_context context; /* settings for all requests */
+	struct pool *pool;
+	struct async_buffers *buffers; /* one for each worker */
+	unsigned threads;
+	int event_fd; /* counts completions not yet collected */
+	pthread_mutex_t lock; /* for handle states and the list */
+	struct merkle_async_handle *head, *tail; /* completed requests */
+};
+
+
+static const char* operation_name(enum merkle_async_operation operation)
+{
+	switch (operation) {
+	case MERKLE_ASYNC_UPDATE: return "update";
+	case MERKLE_ASYNC_VERIFY: return "verify";
+	default: return "truncate";
+	}
+}
+
+/* move a finished request to the completed list, and wake the event
+ * loop through the eventfd */
+static void async_finish(struct merkle_async_handle *handle, int status)
+{
+	struct merkle_async *async = handle->async;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&async->lock);
+	handle->state = ASYNC_DONE;
+	handle->status = status;
+	handle->next = NULL;
+	if (async->tail)
+		async->tail->next = handle;
+	else
+		async->head = handle;
+	async->tail = handle;
+	pthread_mutex_unlock(&async->lock);
+
+	/* the counter only overflows after 2^64 completions nobody read */
+	if (write(async->event_fd, &one, sizeof(one)) == -1)
+		fprintf(stderr, "async: write() of eventfd failed "
+				"with error %d\n", errno);
+}
+
+/* run a request on a worker thread, with the worker's buffers */
+static void async_run(void *arg, unsigned worker)
+{
+	struct merkle_async_handle *handle = (struct merkle_async_handle*)arg;
+	struct merkle_async *async = handle->async;
+	const struct merkle_async_request *request = &handle->request;
+	struct merkle_context context = async->context;
+	char path[32];
+	int status;
+
+	pthread_mutex_lock(&async->lock);
+	if (handle->state == ASYNC_CANCELED) {
+		pthread_mutex_unlock(&async->lock);
+		async_finish(handle, ECANCELED);
+		return;
+	}
+	handle->state = ASYNC_RUNNING;
+	pthread_mutex_unlock(&async->lock);
+
+	context.block_buffer = async->buffers[worker].block_buffer;
+	context.node_buffer = async->buffers[worker].node_buffer;
+	context.stack = &async->buffers[worker].stack;
+	context.fd_in = request->fd_in;
+	context.fd_out = request->fd_out;
+
+	if (context.verbose)
+		printf("async %s of blocks %lu-%lu started on worker %u\n",
+				operation_name(request->operation),
+				request->from_block, request->to_block, worker);
+
+	switch (request->operation) {
+	case MERKLE_ASYNC_UPDATE:
+		/* requests may share the caller's descriptor, so each update
+		 * opens the hash file again for node locks of its own */
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", request->fd_out);
+		context.fd_out = open(path, O_RDWR);
+		if (context.fd_out == -1) {
+			status = errno;
+			fprintf(stderr, "Failed to reopen hash file descriptor "
+					"%d with error %d.\n", request->fd_out, status);
+			break;
+		}
+		context.concurrent = 1;
+		status = merkle_update(&context, request->from_block,
+				request->to_block, request->total_blocks);
+		close(context.fd_out);
+		break;
+	case MERKLE_ASYNC_VERIFY:
+		status = merkle_verify(&context, request->from_block,
+				request->to_block, request->total_blocks);
+		break;
+	default:
+		status = merkle_resize(&context, request->total_blocks,
+				request->to_block + 1);
+		break;
+	}
+
+	async_finish(handle, status);
+}
+
+int merkle_async_create(const struct merkle_context *context,
+		unsigned threads, struct merkle_async **result)
+{
+	struct merkle_async *async;
+	unsigned i;
+	int status;
+
+	async = (struct merkle_async*)calloc(1, sizeof(*async));
+	if (async == NULL)
+		return errno;
+
+	async->context = *context;
+	merkle_context_detach(&async->context);
+	async->threads = threads;
+
+	async->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (async->event_fd == -1) {
+		status = errno;
+		fprintf(stderr, "async: eventfd() failed with error %d\n",
+				status);
+		goto out_free;
+	}
+
+	async->buffers = (struct async_buffers*)calloc(threads,
+			sizeof(struct async_buffers));
+	if (async->buffers == NULL) {
+		status = errno;
+		goto out_close;
+	}
+	for (i = 0; i < threads; i++) {
+		async->buffers[i].block_buffer = (unsigned char*)malloc(
+				context->k_leaf * context->block_size);
+		async->buffers[i].node_buffer = (unsigned char*)malloc(
+				context->node_size);
+		if (async->buffers[i].block_buffer == NULL ||
+				async->buffers[i].node_buffer == NULL) {
+			status = ENOMEM;
+			goto out_free_buffers;
+		}
+	}
+
+	pthread_mutex_init(&async->lock, NULL);
+	status = pool_create(&async->pool, threads);
+	if (status)
+		goto out_destroy_lock;
+
+	*result = async;
+	return 0;
+
+out_destroy_lock:
+	pthread_mutex_destroy(&async->lock);
+out_free_buffers:
+	for (i = 0; i < threads; i++) {
+		free(async->buffers[i].block_buffer);
+		free(async->buffers[i].node_buffer);
+	}
+	free(async->buffers);
+out_close:
+	close(async->event_fd);
+out_free:
+	free(async);
+	return status;
+}
+
+int merkle_async_fd(const struct merkle_async *async)
+{
+	return async->event_fd;
+}
+
+int merkle_async_submit(struct merkle_async *async,
+		const struct merkle_async_request *request,
+		merkle_async_fn callback, void *user,
+		struct merkle_async_handle **result)
+{
+	const struct merkle_context *context = &async->context;
+	struct merkle_async_handle *handle;
+	int status;
+
+	if (request->operation != MERKLE_ASYNC_TRUNCATE &&
+			(request->from_block > request->to_block ||
+			 request->to_block >= request->total_blocks))
+		return ERANGE;
+
+	handle = (struct merkle_async_handle*)calloc(1, sizeof(*handle));
+	if (handle == NULL)
+		return errno;
+	handle->async = async;
+	handle->request = *request;
+	handle->callback = callback;
+	handle->user = user;
+	handle->state = ASYNC_QUEUED;
+
+	/* start reading the input blocks now, so the worker that takes
+	 * the request finds them in the page cache instead of waiting */
+	if (request->operation != MERKLE_ASYNC_TRUNCATE)
+		posix_fadvise(request->fd_in,
+				request->from_block * context->block_size,
+				(request->to_block - request->from_block + 1) *
+				context->block_size, POSIX_FADV_WILLNEED);
+
+	/* another thread may collect the completion before
+	 * pool_submit() returns */
+	if (result)
+		*result = handle;
+	status = pool_submit(async->pool, async_run, handle);
+	if (status)
+		free(handle);
+	return status;
+}
+
+int merkle_async_cancel(struct merkle_async *async,
+		struct merkle_async_handle *handle)
+{
+	int status = 0;
+
+	pthread_mutex_lock(&async->lock);
+	if (handle->state == ASYNC_QUEUED)
+		handle->state = ASYNC_CANCELED;
+	else
+		status = EBUSY;
+	pthread_mutex_unlock(&async->lock);
+	return status;
+}
+
+unsigned merkle_async_complete(struct merkle_async *async)
+{
+	struct merkle_async_handle *handle, *next;
+	unsigned count = 0;
+	uint64_t value;
+
+	/* reset the counter before taking the list, so a completion
+	 * after this point wakes the event loop again */
+	if (read(async->event_fd, &value, sizeof(value)) == -1 &&
+			errno != EAGAIN)
+		fprintf(stderr, "async: read() of eventfd failed "
+				"with error %d\n", errno);
+
+	pthread_mutex_lock(&async->lock);
+	handle = async->head;
+	async->head = async->tail = NULL;
+	pthread_mutex_unlock(&async->lock);
+
+	for (; handle; handle = next, count++) {
+		next = handle->next;
+		if (handle->callback)
+			handle->callback(&handle->request, handle->status,
+					handle->user);
+		free(handle);
+	}
+	return count;
+}
+
+void merkle_async_destroy(struct merkle_async *async)
+{
+	unsigned i;
+
+	/* finish every queued request, then deliver their callbacks */
+	pool_destroy(async->pool);
+	merkle_async_complete(async);
+
+	for (i = 0; i < async->threads; i++) {
+		free(async->buffers[i].block_buffer);
+		free(async->buffers[i].node_buffer);
+		merkle_stack_free(&async->buffers[i].stack);
+	}
+	free(async->buffers);
+	close(async->event_fd);
+	pthread_mutex_destroy(&async->lock);
+	free(async);
+}
@@ -0,0 +1,415 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "merkle.h"
+#include "pool.h"
+#include "visitor.h"
+
+
+/* blocks hashed by each task. the chunks of a file are updated
+ * concurrently, so they lock the nodes they share */
+#define BATCH_CHUNK (1 << 14)
+
+enum batch_operation {
+	BATCH_WRITE,
+	BATCH_VERIFY
+};
+
+/* manifest entry, and the results of its chunks */
+struct batch_entry {
+	enum batch_operation operation;
+	char *source;
+	char *hash;
+	uint64_t from_block, to_block;
+	uint64_t total_blocks;
+	uint64_t chunks; /* number of chunks in the range */
+	uint64_t pending; /* chunks that haven't finished */
+	/* number of entries before this one that name the same hash
+	 * file, which must finish before it starts */
+	uint64_t wave;
+	int status; /* first error from any chunk */
+};
+
+/* buffers reused by every task on the same worker thread */
+struct batch_buffers {
+	unsigned char *block_buffer;
+	unsigned char *node_buffer;
+	struct merkle_stack stack;
+};
+
+struct batch_state {
+	const struct merkle_context *context; /* settings for all entries */
+	struct batch_entry *entries;
+	uint64_t count, capacity;
+	struct batch_buffers *buffers; /* one for each worker */
+	pthread_mutex_t lock; /* for entry results and output */
+	uint64_t failed;
+};
+
+/* chunk of an entry, run as a single task */
+struct batch_task {
+	struct batch_state *batch;
+	struct batch_entry *entry;
+	uint64_t from_block, to_block;
+};
+
+
+static const char* operation_name(enum batch_operation operation)
+{
+	return operation == BATCH_WRITE ? "write" : "verify";
+}
+
+/* record the result of a chunk, and print the entry's result once
+ * its last chunk finishes */
+static void batch_finish(struct batch_state *batch,
+		struct batch_entry *entry, int status)
+{
+	pthread_mutex_lock(&batch->lock);
+	if (status && entry->status == 0)
+		entry->status = status;
+
+	if (--entry->pending == 0) {
+		if (entry->status) {
+			batch->failed++;
+			printf("%s %s %s failed with error %d\n",
+					operation_name(entry->operation),
+					entry->source, entry->hash, entry->status);
+		} else
+			printf("%s %s %s successful\n",
+					operation_name(entry->operation),
+					entry->source, entry->hash);
+		fflush(stdout);
+	}
+	pthread_mutex_unlock(&batch->lock);
+}
+
+/* update or verify a chunk of an entry, with the worker's buffers */
+static void batch_run(void *arg, unsigned worker)
+{
+	struct batch_task *task = (struct batch_task*)arg;
+	struct batch_entry *entry = task->entry;
+	struct merkle_context context = *task->batch->context;
+	int status, failed;
+
+	merkle_context_detach(&context);
+	context.block_buffer = task->batch->buffers[worker].block_buffer;
+	context.node_buffer = task->batch->buffers[worker].node_buffer;
+	context.stack = &task->batch->buffers[worker].stack;
+	context.levels = 0;
+	/* each chunk has its own open file, so its node locks exclude
+	 * the other chunks of the same file */
+	context.concurrent = entry->chunks > 1;
+
+	/* skip the rest of an entry that already failed */
+	pthread_mutex_lock(&task->batch->lock);
+	failed = entry->status;
+	pthread_mutex_unlock(&task->batch->lock);
+	if (failed) {
+		status = 0;
+		goto out;
+	}
+
+	context.fd_in = open(entry->source, O_RDONLY);
+	if (context.fd_in == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open input file "
+				"'%s' with error %d.\n", entry->source, status);
+		goto out;
+	}
+
+	if (entry->operation == BATCH_WRITE)
+		context.fd_out = open(entry->hash, O_RDWR | O_CREAT, 0600);
+	else
+		context.fd_out = open(entry->hash, O_RDONLY);
+	if (context.fd_out == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open hash file "
+				"'%s' with error %d.\n", entry->hash, status);
+		goto out_close_in;
+	}
+
+	if (entry->operation == BATCH_WRITE)
+		status = merkle_update(&context, task->from_block,
+				task->to_block, entry->total_blocks);
+	else
+		status = merkle_verify(&context, task->from_block,
+				task->to_block, entry->total_blocks);
+
+	close(context.fd_out);
+out_close_in:
+	close(context.fd_in);
+out:
+	batch_finish(task->batch, entry, status);
+	free(task);
+}
+
+/* parse a manifest line into a new entry. returns EINVAL for lines
+ * that aren't valid, and ENOENT for blank lines and comments */
+static int batch_parse(struct batch_state *batch, char *line)
+{
+	const struct merkle_context *context = batch->context;
+	struct batch_entry *entry;
+	char *fields[5], *save = NULL, *extra;
+	unsigned count = 0;
+	struct stat source;
+	void *entries;
+
+	while (count < 5 && (fields[count] = strtok_r(count ? NULL : line,
+					" \t\r\n", &save)) != NULL)
+		count++;
+	if (count == 0 || fields[0][0] == '#')
+		return ENOENT;
+	extra = count == 5 ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+	if ((count != 3 && count != 5) || extra)
+		return EINVAL;
+
+	if (batch->count == batch->capacity) {
+		batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+		entries = realloc(batch->entries,
+				batch->capacity * sizeof(struct batch_entry));
+		if (entries == NULL)
+			return errno;
+		batch->entries = (struct batch_entry*)entries;
+	}
+	entry = &batch->entries[batch->count];
+	memset(entry, 0, sizeof(*entry));
+
+	if (strcmp(fields[0], "write") == 0)
+		entry->operation = BATCH_WRITE;
+	else if (strcmp(fields[0], "verify") == 0)
+		entry->operation = BATCH_VERIFY;
+	else
+		return EINVAL;
+
+	entry->source = strdup(fields[1]);
+	entry->hash = strdup(fields[2]);
+	if (entry->source == NULL || entry->hash == NULL) {
+		free(entry->source);
+		free(entry->hash);
+		return ENOMEM;
+	}
+	batch->count++;
+
+	/* size the file that open() will read, through any symlink. an
+	 * entry that fails here is reported with the rest */
+	if (stat(entry->source, &source) == -1) {
+		entry->status = errno;
+		return 0;
+	}
+	entry->total_blocks = source.st_size / context->block_size +
+		(source.st_size % context->block_size ? 1 : 0);
+
+	if (count == 5) {
+		entry->from_block = strtoull(fields[3], NULL, 10);
+		entry->to_block = strtoull(fields[4], NULL, 10);
+	} else
+		entry->to_block = entry->total_blocks - 1;
+
+	if (entry->total_blocks == 0 || entry->from_block > entry->to_block ||
+			entry->to_block >= entry->total_blocks)
+		entry->status = ERANGE;
+	else
+		entry->chunks = (entry->to_block - entry->from_block) /
+			BATCH_CHUNK + 1;
+	return 0;
+}
+
+/* order the entries by hash file, then by their place in the manifest */
+static int entry_compare(const void *a, const void *b)
+{
+	const struct batch_entry *lhs = *(const struct batch_entry**)a;
+	const struct batch_entry *rhs = *(const struct batch_entry**)b;
+	int order = strcmp(lhs->hash, rhs->hash);
+
+	if (order)
+		return order;
+	return lhs < rhs ? -1 : lhs > rhs;
+}
+
+/* number each entry's wave by the entries before it that write or
+ * verify the same hash file, and return the number of waves. a verify
+ * that ran along with a write of its tree would read nodes the write
+ * hasn't finished */
+static int batch_waves(struct batch_state *batch, uint64_t *waves)
+{
+	struct batch_entry **sorted;
+	uint64_t i;
+
+	*waves = 0;
+	if (batch->count == 0)
+		return 0;
+
+	sorted = (struct batch_entry**)malloc(batch->count *
+			sizeof(struct batch_entry*));
+	if (sorted == NULL)
+		return errno;
+	for (i = 0; i < batch->count; i++)
+		sorted[i] = &batch->entries[i];
+	qsort(sorted, batch->count, sizeof(struct batch_entry*),
+			entry_compare);
+
+	for (i = 0; i < batch->count; i++) {
+		sorted[i]->wave = i && strcmp(sorted[i]->hash,
+				sorted[i-1]->hash) == 0 ? sorted[i-1]->wave + 1 : 0;
+		if (*waves <= sorted[i]->wave)
+			*waves = sorted[i]->wave + 1;
+	}
+	free(sorted);
+	return 0;
+}
+
+/* read every entry of the manifest */
+static int batch_read(struct batch_state *batch, const char *manifest)
+{
+	char *line = NULL;
+	size_t length = 0;
+	uint64_t number = 0;
+	FILE *file;
+	int status = 0;
+
+	file = fopen(manifest, "r");
+	if (file == NULL) {
+		status = errno;
+		fprintf(stderr, "Failed to open manifest file "
+				"'%s' with error %d.\n", manifest, status);
+		return status;
+	}
+
+	while (getline(&line, &length, file) != -1) {
+		number++;
+		status = batch_parse(batch, line);
+		if (status == ENOENT) {
+			status = 0;
+		} else if (status) {
+			fprintf(stderr, "Invalid manifest entry on line %lu "
+					"of '%s'.\n", number, manifest);
+			break;
+		}
+	}
+
+	free(line);
+	fclose(file);
+	return status;
+}
+
+/* run the entries of the manifest on a pool of worker threads */
+int merkle_batch(const struct merkle_context *context,
+		const char *manifest, unsigned threads)
+{
+	struct batch_state batch;
+	struct batch_task *task;
+	struct batch_entry *entry;
+	struct pool *pool;
+	uint64_t i, round, submitted, wave, waves;
+	unsigned j;
+	int status;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.context = context;
+	pthread_mutex_init(&batch.lock, NULL);
+
+	status = batch_read(&batch, manifest);
+	if (status == 0)
+		status = batch_waves(&batch, &waves);
+	if (status)
+		goto out_free_entries;
+
+	batch.buffers = (struct batch_buffers*)calloc(threads,
+			sizeof(struct batch_buffers));
+	if (batch.buffers == NULL) {
+		status = errno;
+		goto out_free_entries;
+	}
+	for (j = 0; j < threads; j++) {
+		batch.buffers[j].block_buffer = (unsigned char*)malloc(
+				context->k_leaf * context->block_size);
+		batch.buffers[j].node_buffer = (unsigned char*)malloc(
+				context->node_size);
+		if (batch.buffers[j].block_buffer == NULL ||
+				batch.buffers[j].node_buffer == NULL) {
+			status = ENOMEM;
+			goto out_free_buffers;
+		}
+	}
+
+	status = pool_create(&pool, threads);
+	if (status)
+		goto out_free_buffers;
+
+	/* report the entries that failed before they started */
+	for (i = 0; i < batch.count; i++) {
+		entry = &batch.entries[i];
+		entry->pending = entry->chunks;
+		if (entry->status) {
+			entry->pending = 1;
+			batch_finish(&batch, entry, entry->status);
+		}
+	}
+
+	/* entries that share a hash file run one after another, in the
+	 * order of the manifest. within each wave, queue the first chunk
+	 * of every entry, then the second, and so on, so that the small
+	 * files finish early */
+	for (wave = 0; wave < waves; wave++) {
+		for (round = 0, submitted = 1; submitted; round++) {
+			submitted = 0;
+			for (i = 0; i < batch.count; i++) {
+				entry = &batch.entries[i];
+				if (entry->status || entry->wave != wave ||
+						round >= entry->chunks)
+					continue;
+
+				task = (struct batch_task*)malloc(sizeof(*task));
+				if (task == NULL) {
+					status = errno;
+					goto out_destroy;
+				}
+				task->batch = &batch;
+				task->entry = entry;
+				task->from_block = entry->from_block +
+					round * BATCH_CHUNK;
+				task->to_block = task->from_block + BATCH_CHUNK - 1;
+				if (task->to_block > entry->to_block)
+					task->to_block = entry->to_block;
+
+				status = pool_submit(pool, batch_run, task);
+				if (status) {
+					free(task);
+					goto out_destroy;
+				}
+				submitted++;
+			}
+		}
+		pool_wait(pool);
+	}
+
+out_destroy:
+	pool_destroy(pool);
+
+	if (context->verbose)
+		printf("batch of %lu entries finished with %lu failures\n",
+				batch.count, batch.failed);
+	if (status == 0 && batch.failed)
+		status = -1;
+out_free_buffers:
+	for (j = 0; batch.buffers && j < threads; j++) {
+		free(batch.buffers[j].block_buffer);
+		free(batch.buffers[j].node_buffer);
+		merkle_stack_free(&batch.buffers[j].stack);
+	}
+	free(batch.buffers);
+out_free_entries:
+	for (i = 0; i < batch.count; i++) {
+		free(batch.entries[i].source);
+		free(batch.entries[i].hash);
+	}
+	free(batch.entries);
+	pthread_mutex_destroy(&batch.lock);
+	return status;
+}
@@ -0,0 +1,230 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "merkle.h"
+#include "journal.h"
+#include "update.h"
+#include "visitor.h"
+
+
+#define CHECKPOINT_MAGIC 0x434b524d /* "MRKC" */
+
+/* seconds between checkpoints. updates that finish sooner
+ * never write a checkpoint at all */
+#define CHECKPOINT_INTERVAL 60
+
+/* progress of an update, as stored in the checkpoint file */
+struct checkpoint_record {
+	uint32_t magic;
+	uint32_t block_size;
+	uint8_t k;
+	uint8_t k_leaf;
+	uint8_t hash_size;
+	uint8_t blocked; /* blocked layout of the tree */
+	uint64_t total_blocks;
+	uint64_t from_block, to_block; /* range of the original update */
+	uint64_t next_block; /* all blocks before this one are complete */
+};
+
+/* state for the checkpointing update visitor */
+struct checkpoint_state {
+	struct merkle_context *context;
+	const char *path;
+	struct checkpoint_record record;
+	time_t last; /* time of the last checkpoint */
+};
+
+
+/* write the checkpoint record to a temporary file, then rename it
+ * over the checkpoint so that a crash leaves one or the other */
+static int checkpoint_write(struct checkpoint_state *checkpoint)
+{
+	struct merkle_context *context = checkpoint->context;
+	size_t length = strlen(checkpoint->path);
+	char *temp;
+	int fd, status;
+
+	/* all blocks before next_block must be durable first */
+	if (context->journal) {
+		status = journal_finish(context, 0);
+		if (status)
+			return status;
+	} else if (fdatasync(context->fd_out) == -1) {
+		status = errno;
+		fprintf(stderr, "checkpoint: fdatasync() of hash file "
+				"failed with %d\n", status);
+		return status;
+	}
+
+	temp = (char*)malloc(length + 5);
+	if (temp == NULL)
+		return errno;
+	memcpy(temp, checkpoint->path, length);
+	memcpy(temp + length, ".tmp", 5);
+
+	fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open checkpoint file "
+				"'%s' with error %d.\n", temp, status);
+		goto out_free;
+	}
+
+	status = write_at(fd, 0, (unsigned char*)&checkpoint->record,
+			sizeof(checkpoint->record));
+	if (status)
+		goto out_close;
+
+	if (fdatasync(fd) == -1 || rename(temp, checkpoint->path) == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to write checkpoint file "
+				"'%s' with error %d.\n", checkpoint->path, status);
+		goto out_close;
+	}
+
+	if (context->verbose)
+		printf("checkpoint at block %lu\n",
+				checkpoint->record.next_block);
+out_close:
+	close(fd);
+out_free:
+	free(temp);
+	return status;
+}
+
+/* read the checkpoint record, returning nonzero if it's missing or
+ * does not match the parameters of the given record */
+static int checkpoint_read(const char *path,
+		struct checkpoint_record *record)
+{
+	struct checkpoint_record saved;
+	ssize_t bytes;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return errno;
+	bytes = pread(fd, &saved, sizeof(saved), 0);
+	close(fd);
+
+	if (bytes != sizeof(saved) ||
+			saved.magic != record->magic ||
+			saved.block_size != record->block_size ||
+			saved.k != record->k ||
+			saved.k_leaf != record->k_leaf ||
+			saved.hash_size != record->hash_size ||
+			saved.blocked != record->blocked ||
+			saved.total_blocks != record->total_blocks ||
+			saved.from_block != record->from_block ||
+			saved.to_block != record->to_block)
+		return EINVAL;
+
+	record->next_block = saved.next_block;
+	return 0;
+}
+
+/* rehash the nodes, and checkpoint at the start of the last completed
+ * subtree once the interval has passed. each subtree is visited as
+ * soon as it completes, so every subtree to the left of this one has
+ * already been written into its parent, and the ancestors it shares
+ * with the remaining blocks will be rehashed on resume. that is not
+ * yet true of the ancestors that end along with this subtree, so the
+ * subtree itself is redone on resume */
+static int checkpoint_node_range(const struct merkle_state *nodes,
+		uint8_t count, uint8_t depth, void *user)
+{
+	struct checkpoint_state *checkpoint = (struct checkpoint_state*)user;
+	const struct merkle_state *node = &nodes[count-1];
+	time_t now;
+	int status;
+
+	status = update_node_range(nodes, count, depth, checkpoint->context);
+	if (status)
+		return status;
+
+	now = time(NULL);
+	if (now - checkpoint->last < CHECKPOINT_INTERVAL ||
+			node->bstart <= checkpoint->record.next_block)
+		return 0;
+
+	checkpoint->last = now;
+	checkpoint->record.next_block = node->bstart;
+	return checkpoint_write(checkpoint);
+}
+
+static int checkpoint_leaf_range(const struct merkle_state *node,
+		uint64_t first_block, uint8_t count, void *user)
+{
+	const struct checkpoint_state *checkpoint =
+		(const struct checkpoint_state*)user;
+	return update_leaf_range(node, first_block, count,
+			checkpoint->context);
+}
+
+static int checkpoint_root(const struct merkle_state *node,
+		uint8_t depth, void *user)
+{
+	const struct checkpoint_state *checkpoint =
+		(const struct checkpoint_state*)user;
+	return update_root(node, depth, checkpoint->context);
+}
+
+/* update the hashes in the given range, checkpointing periodically so
+ * that an interrupted update can resume where it left off */
+int merkle_update_resumable(struct merkle_context *context,
+		const char *path, int resume, uint64_t from_block,
+		uint64_t to_block, uint64_t total_blocks)
+{
+	struct checkpoint_state checkpoint;
+	struct merkle_range_visitor visitor = {
+		checkpoint_leaf_range,
+		checkpoint_node_range,
+		checkpoint_root,
+		&checkpoint
+	};
+	int status;
+
+	memset(&checkpoint.record, 0, sizeof(checkpoint.record));
+	checkpoint.context = context;
+	checkpoint.path = path;
+	checkpoint.record.magic = CHECKPOINT_MAGIC;
+	checkpoint.record.block_size = context->block_size;
+	checkpoint.record.k = context->k;
+	checkpoint.record.k_leaf = context->k_leaf;
+	checkpoint.record.hash_size = context->hash_size;
+	checkpoint.record.blocked = context->blocked;
+	checkpoint.record.total_blocks = total_blocks;
+	checkpoint.record.from_block = from_block;
+	checkpoint.record.to_block = to_block;
+	checkpoint.record.next_block = from_block;
+	checkpoint.last = time(NULL);
+
+	if (resume) {
+		status = checkpoint_read(path, &checkpoint.record);
+		if (status == 0) {
+			from_block = checkpoint.record.next_block;
+			if (context->verbose)
+				printf("resuming from block %lu\n", from_block);
+		} else if (context->verbose)
+			printf("no matching checkpoint in '%s', "
+					"starting from block %lu\n", path, from_block);
+	}
+
+	status = merkle_visit_ranges(&visitor, context,
+			from_block, to_block, total_blocks);
+	status = journal_finish(context, status);
+
+	/* the checkpoint is no longer needed once the root is written,
+	 * whether or not this update wrote it */
+	if (status == 0 && unlink(path) == -1 && errno != ENOENT) {
+		status = errno;
+		fprintf(stderr, "Failed to remove checkpoint file "
+				"'%s' with error %d.\n", path, status);
+	}
+	return status;
+}
@@ -0,0 +1,362 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "merkle.h"
+#include "chunk.h"
+#include "update.h"
+
+
+#define CHUNKS_MAGIC 0x4e4b524d /* "MRKN" */
+
+/* size of each read while chunking the input file */
+#define CHUNK_READ (1 << 20)
+
+/* chunk index, as stored in the chunk file before the chunk ends */
+struct chunks_header {
+	uint32_t magic;
+	uint32_t min_size, avg_size, max_size;
+	uint64_t count;
+};
+
+/* content-defined chunks of the input file */
+struct merkle_chunks {
+	uint64_t *ends; /* offset of the end of each chunk */
+	uint64_t count, capacity;
+	uint32_t min_size, avg_size, max_size;
+};
+
+
+/* mask with the top n bits set. the gear hash shifts left by one bit
+ * per byte, so its high bits depend on the most bytes */
+static inline uint64_t chunk_mask(unsigned n)
+{
+	return n ? ~0ULL << (64 - n) : 0;
+}
+
+static int chunks_add(struct merkle_chunks *chunks, uint64_t end)
+{
+	void *ends;
+
+	if (chunks->count == chunks->capacity) {
+		chunks->capacity = chunks->capacity ? chunks->capacity * 2 : 1024;
+		ends = realloc(chunks->ends, chunks->capacity * sizeof(uint64_t));
+		if (ends == NULL)
+			return errno;
+		chunks->ends = (uint64_t*)ends;
+	}
+	chunks->ends[chunks->count++] = end;
+	return 0;
+}
+
+static struct merkle_chunks* chunks_alloc(uint32_t avg_size)
+{
+	struct merkle_chunks *chunks;
+
+	chunks = (struct merkle_chunks*)calloc(1, sizeof(*chunks));
+	if (chunks) {
+		chunks->min_size = MERKLE_CHUNK_MIN(avg_size);
+		chunks->avg_size = avg_size;
+		chunks->max_size = MERKLE_CHUNK_MAX(avg_size);
+	}
+	return chunks;
+}
+
+/* find chunk boundaries with a gear hash, fastcdc-style. no boundary
+ * is considered in the first min_size bytes of a chunk, a stricter mask
+ * applies until avg_size bytes, and a looser one after, which keeps
+ * chunk sizes close to avg_size. a boundary is forced at max_size */
+static int chunks_scan(const struct merkle_context *context,
+		struct merkle_chunks *chunks)
+{
+	uint64_t gear[256], seed = 0x9E3779B97F4A7C15ULL, value;
+	uint64_t offset = 0, start = 0, length, hash = 0;
+	uint64_t mask_small, mask_large;
+	unsigned char *buffer;
+	unsigned bits = 0, i;
+	ssize_t bytes, j;
+	int status = 0;
+
+	/* fill the gear table with splitmix64, so that every build
+	 * finds the same boundaries */
+	for (i = 0; i < 256; i++) {
+		value = (seed += 0x9E3779B97F4A7C15ULL);
+		value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+		gear[i] = value ^ (value >> 31);
+	}
+
+	while ((1U << bits) < chunks->avg_size)
+		bits++;
+	mask_small = chunk_mask(bits + 1);
+	mask_large = chunk_mask(bits - 1);
+
+	buffer = (unsigned char*)malloc(CHUNK_READ);
+	if (buffer == NULL)
+		return errno;
+
+	for (;;) {
+		bytes = pread(context->fd_in, buffer, CHUNK_READ, offset);
+		if (bytes == -1) {
+			status = errno;
+			fprintf(stderr, "chunk: pread(%lu) failed with error %d\n",
+					offset, status);
+			goto out_free;
+		}
+		if (bytes == 0)
+			break;
+
+		for (j = 0; j < bytes; j++) {
+			length = offset + j + 1 - start;
+			if (length <= chunks->min_size)
+				continue;
+
+			hash = (hash << 1) + gear[buffer[j]];
+			if ((hash & (length < chunks->avg_size ?
+							mask_small : mask_large)) &&
+					length < chunks->max_size)
+				continue;
+
+			start = offset + j + 1;
+			hash = 0;
+			status = chunks_add(chunks, start);
+			if (status)
+				goto out_free;
+		}
+		offset += bytes;
+	}
+
+	/* the last chunk ends with the file */
+	if (start < offset)
+		status = chunks_add(chunks, offset);
+out_free:
+	free(buffer);
+	return status;
+}
+
+/* split the input file into content-defined chunks */
+int merkle_chunk(struct merkle_context *context, uint32_t avg_size,
+		uint64_t *total_chunks)
+{
+	struct merkle_chunks *chunks;
+	int status;
+
+	chunks = chunks_alloc(avg_size);
+	if (chunks == NULL)
+		return errno;
+
+	status = chunks_scan(context, chunks);
+	if (status) {
+		free(chunks->ends);
+		free(chunks);
+		return status;
+	}
+
+	context->chunks = chunks;
+	*total_chunks = chunks->count;
+	if (context->verbose)
+		printf("input split into %lu chunks\n", chunks->count);
+	return 0;
+}
+
+/* free the chunks from merkle_chunk() or merkle_chunks_load() */
+void merkle_chunks_free(struct merkle_context *context)
+{
+	struct merkle_chunks *chunks = context->chunks;
+
+	if (chunks == NULL)
+		return;
+
+	free(chunks->ends);
+	free(chunks);
+	context->chunks = NULL;
+}
+
+/* write the chunk index to a temporary file, then rename it over the
+ * index, like a checkpoint */
+int merkle_chunks_save(const struct merkle_context *context,
+		const char *path)
+{
+	const struct merkle_chunks *chunks = context->chunks;
+	struct chunks_header header;
+	size_t length = strlen(path);
+	char *temp;
+	int fd, status;
+
+	temp = (char*)malloc(length + 5);
+	if (temp == NULL)
+		return errno;
+	memcpy(temp, path, length);
+	memcpy(temp + length, ".tmp", 5);
+
+	fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open chunk file "
+				"'%s' with error %d.\n", temp, status);
+		goto out_free;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = CHUNKS_MAGIC;
+	header.min_size = chunks->min_size;
+	header.avg_size = chunks->avg_size;
+	header.max_size = chunks->max_size;
+	header.count = chunks->count;
+
+	status = write_at(fd, 0, (unsigned char*)&header, sizeof(header));
+	if (status)
+		goto out_close;
+	status = write_at(fd, sizeof(header), (unsigned char*)chunks->ends,
+			chunks->count * sizeof(uint64_t));
+	if (status)
+		goto out_close;
+
+	if (fdatasync(fd) == -1 || rename(temp, path) == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to write chunk file "
+				"'%s' with error %d.\n", path, status);
+	}
+out_close:
+	close(fd);
+out_free:
+	free(temp);
+	return status;
+}
+
+/* read the chunk index written by merkle_chunks_save(), which must
+ * cover the whole input file */
+int merkle_chunks_load(struct merkle_context *context, const char *path,
+		uint32_t avg_size, uint64_t *total_chunks)
+{
+	struct merkle_chunks *chunks;
+	struct chunks_header header;
+	struct stat stat;
+	uint64_t i, start;
+	int fd, status;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open chunk file "
+				"'%s' with error %d.\n", path, status);
+		return status;
+	}
+
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+			header.magic != CHUNKS_MAGIC || header.count == 0) {
+		fprintf(stderr, "Chunk file '%s' is not valid.\n", path);
+		status = EINVAL;
+		goto out_close;
+	}
+
+	/* the block buffer only holds the largest chunk of avg_size */
+	if (header.avg_size != avg_size ||
+			header.max_size != MERKLE_CHUNK_MAX(avg_size)) {
+		fprintf(stderr, "Chunk file '%s' has chunks of %u bytes on "
+				"average, not %u.\n", path, header.avg_size, avg_size);
+		status = EINVAL;
+		goto out_close;
+	}
+
+	chunks = chunks_alloc(header.avg_size);
+	if (chunks == NULL) {
+		status = errno;
+		goto out_close;
+	}
+	chunks->min_size = header.min_size;
+	chunks->max_size = header.max_size;
+	chunks->count = chunks->capacity = header.count;
+	chunks->ends = (uint64_t*)malloc(header.count * sizeof(uint64_t));
+	if (chunks->ends == NULL) {
+		status = errno;
+		goto out_free;
+	}
+
+	if (pread(fd, chunks->ends, header.count * sizeof(uint64_t),
+				sizeof(header)) !=
+			(ssize_t)(header.count * sizeof(uint64_t))) {
+		fprintf(stderr, "Chunk file '%s' is truncated.\n", path);
+		status = EINVAL;
+		goto out_free;
+	}
+
+	/* and no chunk may be larger, whatever the file holds */
+	for (i = 0, start = 0; i < chunks->count; start = chunks->ends[i++])
+		if (chunks->ends[i] <= start ||
+				chunks->ends[i] - start > chunks->max_size) {
+			fprintf(stderr, "Chunk %lu in chunk file '%s' is not "
+					"valid.\n", i, path);
+			status = EINVAL;
+			goto out_free;
+		}
+
+	/* a file that changed size can't match its chunks */
+	if (fstat(context->fd_in, &stat) == -1) {
+		status = errno;
+		goto out_free;
+	}
+	if ((uint64_t)stat.st_size != chunks->ends[chunks->count - 1]) {
+		fprintf(stderr, "Input file size %lu does not match the %lu "
+				"bytes in chunk file '%s'.\n", stat.st_size,
+				chunks->ends[chunks->count - 1], path);
+		status = EINVAL;
+		goto out_free;
+	}
+
+	context->chunks = chunks;
+	*total_chunks = chunks->count;
+	close(fd);
+	return 0;
+
+out_free:
+	free(chunks->ends);
+	free(chunks);
+out_close:
+	close(fd);
+	return status;
+}
+
+/* find the chunks that hold the given range of bytes */
+void merkle_chunk_range(const struct merkle_context *context,
+		uint64_t from_offset, uint64_t to_offset,
+		struct merkle_range *range)
+{
+	const struct merkle_chunks *chunks = context->chunks;
+	uint64_t low, high, middle, offset;
+	uint8_t i;
+
+	for (i = 0; i < 2; i++) {
+		offset = i ? to_offset : from_offset;
+
+		/* find the first chunk that ends after offset */
+		low = 0;
+		high = chunks->count - 1;
+		while (low < high) {
+			middle = low + (high - low) / 2;
+			if (chunks->ends[middle] <= offset)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		if (i)
+			range->to_block = low;
+		else
+			range->from_block = low;
+	}
+}
+
+/* read the given chunk into the block buffer */
+int chunk_read(const struct merkle_context *context, uint64_t chunk,
+		size_t *length)
+{
+	const struct merkle_chunks *chunks = context->chunks;
+	uint64_t start = chunk ? chunks->ends[chunk - 1] : 0;
+
+	*length = chunks->ends[chunk] - start;
+	return read_at(context->fd_in, start, context->block_buffer, *length);
+}
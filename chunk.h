@@ -0,0 +1,16 @@
+#ifndef COHORT_MERKLE_CHUNK_H
+#define COHORT_MERKLE_CHUNK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* from merkle.h */
+struct merkle_context;
+
+/* read the given chunk of the input file into the block buffer, and
+ * return its length, for internal use by update.c */
+int chunk_read(const struct merkle_context *context, uint64_t chunk,
+		size_t *length);
+
+#endif /* COHORT_MERKLE_CHUNK_H */
@@ -0,0 +1,252 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <openssl/sha.h>
+
+#include "merkle.h"
+#include "diff.h"
+#include "update.h"
+#include "visitor.h"
+#include "tree.h"
+
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+
+/* state shared by each level of the diff traversal */
+struct diff_state {
+	const struct merkle_context *context;
+	int fd_other;
+	struct merkle_state *stack;
+	const struct merkle_layout *layout;
+	/* two node buffers for each level of the tree */
+	unsigned char *buffers;
+	uint64_t from_block, to_block;
+	/* range of differing blocks not yet reported */
+	uint64_t run_from, run_to;
+	uint8_t run_pending;
+	const struct diff_visitor *visitor;
+};
+
+
+/* report a differing block, coalescing adjacent blocks into ranges */
+static int diff_block(struct diff_state *diff, uint64_t block)
+{
+	int status;
+
+	if (diff->run_pending && diff->run_to + 1 == block) {
+		diff->run_to = block;
+		return 0;
+	}
+	if (diff->run_pending) {
+		status = diff->visitor->visit_blocks(diff->run_from,
+				diff->run_to, diff->visitor->user);
+		if (status)
+			return status;
+	}
+	diff->run_from = diff->run_to = block;
+	diff->run_pending = 1;
+	return 0;
+}
+
+/* compare the node at the given depth in both trees, and descend
+ * into each child whose hashes differ */
+static int diff_node(struct diff_state *diff, uint8_t depth)
+{
+	const struct merkle_context *context = diff->context;
+	struct merkle_state *node = &diff->stack[depth-1];
+	struct merkle_state *child;
+	uint64_t read_offset = context->hash_size * node->offset;
+	uint8_t width = merkle_width(node, context->k_leaf, context->k);
+	unsigned char *ours = diff->buffers +
+		2 * (depth-1) * context->node_size;
+	unsigned char *theirs = ours + context->node_size;
+	uint8_t position;
+	int status;
+
+	status = read_hash(context, read_offset,
+			ours, width * context->hash_size);
+	if (status)
+		return status;
+	status = read_at(diff->fd_other, read_offset,
+			theirs, width * context->hash_size);
+	if (status)
+		return status;
+
+	if (diff->visitor->visit_node) {
+		status = diff->visitor->visit_node(node, depth,
+				ours, theirs, diff->visitor->user);
+		if (status)
+			return status;
+	}
+
+	for (position = 0; position < width; position++) {
+		uint64_t bstart = node->bstart + position * node->cleaves;
+		uint64_t bend = min(bstart + node->cleaves, node->bend);
+
+		/* skip children outside of the requested range */
+		if (max(bstart, diff->from_block) >=
+				min(bend, diff->to_block + 1))
+			continue;
+
+		if (memcmp(ours + position * context->hash_size,
+					theirs + position * context->hash_size,
+					context->hash_size) == 0)
+			continue;
+
+		/* base case: the block under this leaf differs */
+		if (depth == 1) {
+			if (context->verbose)
+				printf("block %lu hash differs at node %lu.%u\n",
+						bstart, node->node, position);
+			status = diff_block(diff, bstart);
+			if (status)
+				return status;
+			continue;
+		}
+
+		if (context->verbose)
+			printf("%*snode %lu.%u differs\n", 2*depth, "",
+					node->node, position);
+
+		/* descend into the child whose hashes differ */
+		child = &diff->stack[depth-2];
+		child->parent = node->node;
+		child->position = position;
+		child->bstart = bstart;
+		child->bend = bend;
+		child->node = merkle_child(child->parent,
+				child->position, node->cnodes, child->cnodes);
+		merkle_set_offset(child, diff->layout, depth - 1);
+		child->parent_offset = node->offset;
+
+		status = diff_node(diff, depth - 1);
+		if (status)
+			return status;
+	}
+	return 0;
+}
+
+/* traverse two hash trees in lockstep, visiting the nodes
+ * and blocks whose hashes differ */
+int diff_visit(const struct merkle_context *context, int fd_other,
+		const struct diff_visitor *visitor, uint64_t from_block,
+		uint64_t to_block, uint64_t total_blocks)
+{
+	struct merkle_stack local, *cache = context->stack;
+	struct diff_state diff;
+	uint8_t maxdepth;
+	int status;
+
+	/* without a stack to reuse, this traversal gets its own */
+	if (cache == NULL) {
+		memset(&local, 0, sizeof(local));
+		cache = &local;
+	}
+
+	/* the stack's table of cnodes and cleaves, and its root node */
+	status = merkle_stack_init(cache, context, total_blocks, 0);
+	if (status)
+		goto out_free_stack;
+	maxdepth = cache->maxdepth;
+
+	diff.context = context;
+	diff.fd_other = fd_other;
+	diff.from_block = from_block;
+	diff.to_block = to_block;
+	diff.run_pending = 0;
+	diff.visitor = visitor;
+	diff.stack = cache->states;
+	diff.layout = &cache->layout;
+
+	diff.buffers = (unsigned char*)malloc(2 * maxdepth *
+			context->node_size);
+	if (diff.buffers == NULL) {
+		status = errno;
+		goto out_free_stack;
+	}
+
+	status = diff_node(&diff, maxdepth);
+
+	/* report the last range of differing blocks */
+	if (status == 0 && diff.run_pending)
+		status = visitor->visit_blocks(diff.run_from,
+				diff.run_to, visitor->user);
+
+	free(diff.buffers);
+out_free_stack:
+	if (cache == &local)
+		merkle_stack_free(&local);
+	return status;
+}
+
+/* compare two hash trees, reporting each range of differing blocks */
+int merkle_diff(struct merkle_context *context, int fd_other,
+		uint64_t from_block, uint64_t to_block,
+		uint64_t total_blocks, merkle_diff_fn callback, void *user)
+{
+	struct diff_visitor visitor = {
+		NULL,
+		callback,
+		user
+	};
+	unsigned char digests[2][SHA_DIGEST_LENGTH];
+	uint64_t leaves, root_offset;
+	int status;
+
+	/* compare the root checksums before anything else */
+	leaves = total_blocks / context->k_leaf +
+		(total_blocks % context->k_leaf ? 1 : 0);
+	root_offset = context->hash_size *
+		merkle_root_offset(context->k_leaf, context->k, leaves);
+	status = read_hash(context, root_offset,
+			digests[0], context->hash_size);
+	if (status)
+		return status;
+	status = read_at(fd_other, root_offset,
+			digests[1], context->hash_size);
+	if (status)
+		return status;
+
+	if (memcmp(digests[0], digests[1], context->hash_size) == 0) {
+		if (context->verbose)
+			printf("root checksums match at offset %lu\n",
+					root_offset);
+		return 0;
+	}
+
+	return diff_visit(context, fd_other, &visitor,
+			from_block, to_block, total_blocks);
+}
+
+/* return the number of blocks covered by a hash file of the given size */
+uint64_t merkle_hash_blocks(uint8_t k_leaf, uint8_t k, uint8_t hash_size,
+		uint64_t file_size)
+{
+	uint64_t digests = file_size / hash_size;
+	uint64_t lo, hi, mid;
+
+	/* the hash file holds the digests of each node, then the root
+	 * checksum */
+	if (file_size % hash_size || digests == 0)
+		return 0;
+	digests--;
+
+	/* the digest count grows strictly with the number of leaves,
+	 * so binary search for the leaf count that produces it */
+	lo = 1;
+	hi = digests / k_leaf;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (merkle_root_offset(k_leaf, k, mid) < digests)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (merkle_root_offset(k_leaf, k, lo) != digests)
+		return 0;
+	return lo * k_leaf;
+}
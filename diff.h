@@ -0,0 +1,33 @@
+#ifndef COHORT_MERKLE_DIFF_H
+#define COHORT_MERKLE_DIFF_H
+
+#include <stdint.h>
+
+#include "merkle.h"
+
+
+/* from visitor.h */
+struct merkle_state;
+
+/* callbacks for diff_visit(), for internal use by diff and repair */
+struct diff_visitor
+{
+	/* called for each node before descending into its children
+	 * whose hashes differ, with the node contents from both trees */
+	int (*visit_node)(const struct merkle_state *node, uint8_t depth,
+			const unsigned char *ours, const unsigned char *theirs,
+			void *user);
+	/* called in ascending order with each range of differing blocks */
+	merkle_diff_fn visit_blocks;
+
+	void *user; /* user data passed to each callback */
+};
+
+/* traverse the hash trees in context.fd_out and fd_other in lockstep,
+ * starting at the root node and descending only into children whose
+ * hashes differ */
+int diff_visit(const struct merkle_context *context, int fd_other,
+		const struct diff_visitor *visitor, uint64_t from_block,
+		uint64_t to_block, uint64_t total_blocks);
+
+#endif /* COHORT_MERKLE_DIFF_H */
@@ -0,0 +1,241 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "merkle.h"
+#include "update.h"
+
+
+/* log of dirty blocks, stored as an array of 64-bit block numbers.
+ * other processes may mark blocks in the same log, so marks hold a
+ * shared flock() on it, and a flush holds an exclusive one */
+struct merkle_dirty {
+	int fd; /* log file, opened for append */
+	uint64_t count; /* number of blocks in the log, when last seen */
+	uint64_t max_count; /* flush when count reaches this, or 0 */
+	uint32_t max_age; /* flush this many seconds after first, or 0 */
+	time_t first; /* time of the first mark since the last flush */
+};
+
+
+static int compare_blocks(const void *a, const void *b)
+{
+	uint64_t lhs = *(const uint64_t*)a;
+	uint64_t rhs = *(const uint64_t*)b;
+	return lhs < rhs ? -1 : lhs > rhs;
+}
+
+/* take or release a lock on the log, waiting for other processes */
+static int dirty_lock(const struct merkle_dirty *dirty, int operation)
+{
+	int status;
+
+	if (flock(dirty->fd, operation) == -1) {
+		status = errno;
+		fprintf(stderr, "dirty: flock() failed with error %d\n", status);
+		return status;
+	}
+	return 0;
+}
+
+/* return the number of whole blocks in the log */
+static int dirty_count(const struct merkle_dirty *dirty, uint64_t *count,
+		off_t *size)
+{
+	struct stat stat;
+	int status;
+
+	if (fstat(dirty->fd, &stat) == -1) {
+		status = errno;
+		fprintf(stderr, "dirty: fstat() failed with error %d\n", status);
+		return status;
+	}
+	*count = stat.st_size / sizeof(uint64_t);
+	*size = stat.st_size;
+	return 0;
+}
+
+/* open the dirty block log, picking up any blocks left in it */
+int merkle_dirty_open(struct merkle_context *context, const char *path,
+		uint64_t max_count, uint32_t max_age)
+{
+	struct merkle_dirty *dirty;
+	off_t size;
+	int status;
+
+	dirty = (struct merkle_dirty*)calloc(1, sizeof(*dirty));
+	if (dirty == NULL)
+		return errno;
+
+	dirty->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (dirty->fd == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open dirty block log "
+				"'%s' with error %d.\n", path, status);
+		free(dirty);
+		return status;
+	}
+
+	/* a crash during a mark can leave a torn record at the end. cut
+	 * it off, or every later mark would be appended out of line */
+	status = dirty_lock(dirty, LOCK_EX);
+	if (status)
+		goto out_close;
+	status = dirty_count(dirty, &dirty->count, &size);
+	if (status == 0 && size % sizeof(uint64_t) &&
+			ftruncate(dirty->fd, dirty->count * sizeof(uint64_t)) == -1) {
+		status = errno;
+		fprintf(stderr, "dirty: ftruncate() of torn record failed "
+				"with %d\n", status);
+	}
+	dirty_lock(dirty, LOCK_UN);
+	if (status)
+		goto out_close;
+
+	dirty->max_count = max_count;
+	dirty->max_age = max_age;
+	dirty->first = time(NULL);
+
+	if (context->verbose && dirty->count)
+		printf("dirty block log holds %lu blocks\n", dirty->count);
+
+	context->dirty = dirty;
+	return 0;
+
+out_close:
+	close(dirty->fd);
+	free(dirty);
+	return status;
+}
+
+/* close the dirty block log */
+void merkle_dirty_close(struct merkle_context *context)
+{
+	struct merkle_dirty *dirty = context->dirty;
+
+	if (dirty == NULL)
+		return;
+
+	close(dirty->fd);
+	free(dirty);
+	context->dirty = NULL;
+}
+
+/* append a dirty block to the log with a single write */
+int merkle_mark_dirty(struct merkle_context *context, uint64_t block,
+		uint64_t total_blocks)
+{
+	struct merkle_dirty *dirty = context->dirty;
+	time_t now = time(NULL);
+	ssize_t bytes;
+	int status;
+
+	/* a flush in another process can't empty the log between its
+	 * read and its truncate while we hold the shared lock */
+	status = dirty_lock(dirty, LOCK_SH);
+	if (status)
+		return status;
+	bytes = write(dirty->fd, &block, sizeof(block));
+	status = bytes == sizeof(block) ? 0 : errno ? errno : EIO;
+	dirty_lock(dirty, LOCK_UN);
+	if (status) {
+		fprintf(stderr, "dirty: write() failed with error %d\n", status);
+		return status;
+	}
+	if (dirty->count++ == 0)
+		dirty->first = now;
+
+	if ((dirty->max_count && dirty->count >= dirty->max_count) ||
+			(dirty->max_age && now - dirty->first >= dirty->max_age))
+		return merkle_flush(context, total_blocks);
+	return 0;
+}
+
+/* sort the logged blocks, merge them into ranges, and update them.
+ * the log is locked from the read until it's emptied, so the blocks
+ * other processes mark meanwhile wait for the next flush */
+int merkle_flush(struct merkle_context *context, uint64_t total_blocks)
+{
+	struct merkle_dirty *dirty = context->dirty;
+	struct merkle_range *ranges = NULL;
+	uint64_t *blocks = NULL, i, count = 0;
+	off_t size;
+	int status;
+
+	status = dirty_lock(dirty, LOCK_EX);
+	if (status)
+		return status;
+
+	/* the log holds the blocks of every process that marked them */
+	status = dirty_count(dirty, &dirty->count, &size);
+	if (status || dirty->count == 0)
+		goto out_unlock;
+
+	blocks = (uint64_t*)malloc(dirty->count * sizeof(uint64_t));
+	if (blocks == NULL) {
+		status = errno;
+		goto out_unlock;
+	}
+
+	status = read_at(dirty->fd, 0, (unsigned char*)blocks,
+			dirty->count * sizeof(uint64_t));
+	if (status)
+		goto out_free;
+
+	qsort(blocks, dirty->count, sizeof(uint64_t), compare_blocks);
+
+	ranges = (struct merkle_range*)malloc(dirty->count *
+			sizeof(struct merkle_range));
+	if (ranges == NULL) {
+		status = errno;
+		goto out_free;
+	}
+
+	/* merge duplicate and adjacent blocks */
+	for (i = 0; i < dirty->count && blocks[i] < total_blocks; i++) {
+		if (count && blocks[i] <= ranges[count-1].to_block + 1) {
+			ranges[count-1].to_block = blocks[i];
+			continue;
+		}
+		ranges[count].from_block = ranges[count].to_block = blocks[i];
+		count++;
+	}
+
+	if (context->verbose)
+		printf("flushing %lu dirty blocks in %lu ranges\n",
+				dirty->count, count);
+
+	if (count) {
+		status = merkle_update_ranges(context, ranges, count,
+				total_blocks);
+		if (status)
+			goto out_free;
+
+		/* the hashes must be durable before the log is emptied.
+		 * a journal commit is synced already */
+		if (context->journal == NULL && fdatasync(context->fd_out) == -1) {
+			status = errno;
+			fprintf(stderr, "dirty: fdatasync() of hash file "
+					"failed with %d\n", status);
+			goto out_free;
+		}
+	}
+
+	if (ftruncate(dirty->fd, 0) == -1) {
+		status = errno;
+		fprintf(stderr, "dirty: ftruncate() failed with %d\n", status);
+		goto out_free;
+	}
+	dirty->count = 0;
+out_free:
+	free(ranges);
+	free(blocks);
+out_unlock:
+	dirty_lock(dirty, LOCK_UN);
+	return status;
+}
@@ -0,0 +1,247 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <openssl/sha.h>
+
+#include "merkle.h"
+#include "fingerprint.h"
+#include "tree.h"
+#include "update.h"
+#include "journal.h"
+#include "map.h"
+
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+
+#define FINGERPRINT_MAGIC 0x504b524d /* "MRKP" */
+
+/* bytes of input fingerprinted at a time */
+#define FINGERPRINT_BUFFER (1 << 20)
+
+/* most changed ranges collected before their hashes are updated */
+#define FINGERPRINT_RANGES (1 << 16)
+
+/* header of the fingerprint file, which is followed by the
+ * fingerprint of each block */
+struct fingerprint_header {
+	uint32_t magic;
+	uint32_t block_size;
+	uint8_t k;
+	uint8_t k_leaf;
+	uint8_t hash_size;
+	uint8_t blocked; /* blocked layout of the tree */
+	uint64_t total_blocks;
+	unsigned char root[SHA_DIGEST_LENGTH]; /* of the tree it matches */
+};
+
+static inline uint64_t rotl(uint64_t value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+/* mix each 64-bit word into the state, then avalanche the result */
+uint64_t fingerprint(const unsigned char *data, size_t length)
+{
+	uint64_t hash = PRIME2 ^ length;
+	uint64_t word;
+	size_t i;
+
+	for (i = 0; i + sizeof(word) <= length; i += sizeof(word)) {
+		memcpy(&word, data + i, sizeof(word));
+		hash = rotl(hash ^ (word * PRIME2), 31) * PRIME1;
+	}
+	for (; i < length; i++)
+		hash = rotl(hash ^ (data[i] * PRIME1), 11) * PRIME2;
+
+	hash ^= hash >> 33;
+	hash *= PRIME2;
+	hash ^= hash >> 29;
+	hash *= PRIME1;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+/* fill in the header for the tree as it is now. the root checksum
+ * ties the fingerprints to the tree, so that fingerprints saved before
+ * any other update to the tree never match */
+static int fingerprint_header(const struct merkle_context *context,
+		uint64_t total_blocks, struct fingerprint_header *header)
+{
+	uint64_t leaves = total_blocks / context->k_leaf +
+		(total_blocks % context->k_leaf ? 1 : 0);
+
+	memset(header, 0, sizeof(*header));
+	header->magic = FINGERPRINT_MAGIC;
+	header->block_size = context->block_size;
+	header->k = context->k;
+	header->k_leaf = context->k_leaf;
+	header->hash_size = context->hash_size;
+	header->blocked = context->blocked;
+	header->total_blocks = total_blocks;
+	return read_hash(context, context->hash_size *
+			merkle_root_offset(context->k_leaf, context->k, leaves),
+			header->root, context->hash_size);
+}
+
+/* update the hashes of the changed ranges, and start a new list */
+static int fingerprint_flush(struct merkle_context *context,
+		const struct merkle_range *ranges, uint64_t *count,
+		uint64_t total_blocks)
+{
+	int status;
+
+	if (*count == 0)
+		return 0;
+	status = merkle_update_ranges(context, ranges, *count, total_blocks);
+	*count = 0;
+	return status;
+}
+
+/* fingerprint every block of the input file, and update the hashes of
+ * the blocks whose fingerprints differ from those saved at path */
+int merkle_update_fingerprinted(struct merkle_context *context,
+		const char *path, uint64_t total_blocks)
+{
+	struct fingerprint_header header, saved;
+	struct merkle_range *ranges;
+	uint64_t *old, *new;
+	unsigned char *buffer;
+	uint64_t batch, block, count = 0, changed = 0, i, n;
+	off_t offset;
+	int fd, valid, status;
+
+	batch = FINGERPRINT_BUFFER / context->block_size;
+	if (batch == 0)
+		batch = 1;
+
+	status = fingerprint_header(context, total_blocks, &header);
+	if (status)
+		return status;
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open fingerprint file "
+				"'%s' with error %d.\n", path, status);
+		return status;
+	}
+
+	valid = pread(fd, &saved, sizeof(saved), 0) == sizeof(saved) &&
+		memcmp(&saved, &header, sizeof(header)) == 0;
+	if (context->verbose)
+		printf(valid ? "comparing with saved fingerprints\n" :
+				"no matching fingerprints in '%s', updating "
+				"every block\n", path);
+
+	/* the fingerprints are rewritten as the scan goes, so they can't
+	 * be trusted again until the update finishes */
+	saved.magic = 0;
+	status = write_at(fd, 0, (unsigned char*)&saved, sizeof(saved));
+	if (status)
+		goto out_close;
+	if (fdatasync(fd) == -1) {
+		status = errno;
+		fprintf(stderr, "fingerprint: fdatasync() failed with %d\n",
+				status);
+		goto out_close;
+	}
+
+	/* every block is rehashed without them, over an empty hash file,
+	 * so that no digests of a tree written with other parameters are
+	 * left in the slots this one keeps as zeroes */
+	if (!valid) {
+		status = context->map ? map_clear(context) :
+			journal_finish(context, truncate_hash(context, 0));
+		if (status)
+			goto out_close;
+	}
+
+	buffer = (unsigned char*)malloc(batch * context->block_size);
+	old = (uint64_t*)malloc(2 * batch * sizeof(uint64_t));
+	ranges = (struct merkle_range*)malloc(FINGERPRINT_RANGES *
+			sizeof(struct merkle_range));
+	if (buffer == NULL || old == NULL || ranges == NULL) {
+		status = ENOMEM;
+		goto out_free;
+	}
+	new = old + batch;
+
+	for (block = 0; block < total_blocks; block += n) {
+		n = total_blocks - block;
+		if (n > batch)
+			n = batch;
+		offset = sizeof(header) + block * sizeof(uint64_t);
+
+		status = read_at(context->fd_in, block * context->block_size,
+				buffer, n * context->block_size);
+		if (status)
+			goto out_free;
+		if (valid) {
+			status = read_at(fd, offset, (unsigned char*)old,
+					n * sizeof(uint64_t));
+			if (status)
+				goto out_free;
+		}
+
+		for (i = 0; i < n; i++) {
+			new[i] = fingerprint(buffer + i * context->block_size,
+					context->block_size);
+			if (!valid || new[i] == old[i])
+				continue;
+			changed++;
+
+			/* merge adjacent changed blocks */
+			if (count && ranges[count-1].to_block + 1 == block + i) {
+				ranges[count-1].to_block++;
+				continue;
+			}
+			if (count == FINGERPRINT_RANGES) {
+				status = fingerprint_flush(context, ranges, &count,
+						total_blocks);
+				if (status)
+					goto out_free;
+			}
+			ranges[count].from_block = ranges[count].to_block =
+				block + i;
+			count++;
+		}
+
+		status = write_at(fd, offset, (unsigned char*)new,
+				n * sizeof(uint64_t));
+		if (status)
+			goto out_free;
+	}
+
+	/* without fingerprints to compare, every block is rehashed */
+	if (valid)
+		status = fingerprint_flush(context, ranges, &count, total_blocks);
+	else
+		status = merkle_update(context, 0, total_blocks - 1, total_blocks);
+	if (status)
+		goto out_free;
+
+	if (context->verbose && valid)
+		printf("updated %lu changed blocks of %lu\n",
+				changed, total_blocks);
+
+	/* the fingerprints now match the tree */
+	status = fingerprint_header(context, total_blocks, &header);
+	if (status)
+		goto out_free;
+	status = write_at(fd, 0, (unsigned char*)&header, sizeof(header));
+	if (status == 0 && ftruncate(fd, sizeof(header) +
+				total_blocks * sizeof(uint64_t)) == -1)
+		status = errno;
+out_free:
+	free(ranges);
+	free(old);
+	free(buffer);
+out_close:
+	close(fd);
+	return status;
+}
@@ -0,0 +1,13 @@
+#ifndef COHORT_MERKLE_FINGERPRINT_H
+#define COHORT_MERKLE_FINGERPRINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* fast 64-bit fingerprint of a buffer, for finding regions of a file
+ * that changed without hashing them with sha. this is not a
+ * cryptographic hash, and a deliberate change can keep it the same */
+uint64_t fingerprint(const unsigned char *data, size_t length);
+
+#endif /* COHORT_MERKLE_FINGERPRINT_H */
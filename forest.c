@@ -0,0 +1,749 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <openssl/sha.h>
+
+#include "merkle.h"
+#include "pool.h"
+#include "update.h"
+#include "tree.h"
+
+
+#define FOREST_MAGIC 0x464b524d /* "MRKF" */
+
+/* header of the forest index */
+struct forest_header {
+	uint32_t magic;
+	uint32_t block_size;
+	uint8_t k;
+	uint8_t k_leaf;
+	uint8_t hash_size;
+	uint8_t blocked; /* blocked layout of the tree */
+	uint64_t count; /* number of records that follow */
+};
+
+/* index record for each file, followed by path_length bytes of its
+ * path relative to the directory */
+struct forest_record {
+	uint64_t size;
+	int64_t mtime_sec, mtime_nsec;
+	unsigned char root[SHA_DIGEST_LENGTH]; /* root checksum of its tree */
+	uint32_t path_length;
+};
+
+/* a file in the forest */
+struct forest_entry {
+	char *path; /* relative to the directory */
+	struct forest_record record;
+	uint8_t changed; /* tree must be rewritten */
+};
+
+/* a list of entries, sorted by path once complete */
+struct forest_list {
+	struct forest_entry *entries;
+	uint64_t count, capacity;
+};
+
+/* buffers reused by every file on the same worker thread */
+struct forest_buffers {
+	unsigned char *block_buffer;
+	unsigned char *node_buffer;
+};
+
+struct forest_state {
+	const struct merkle_context *context;
+	const char *directory;
+	char *trees; /* directory that holds the tree of each file */
+	struct forest_list files; /* current contents of the directory */
+	struct forest_list index; /* contents at the last update */
+	/* the forest's own files, which are skipped if they're in the
+	 * directory */
+	struct stat excluded[4];
+	struct forest_buffers *buffers; /* one for each worker */
+	pthread_mutex_t lock; /* for the failure count and output */
+	uint64_t failed;
+};
+
+/* a changed file, whose tree is rewritten as a single task */
+struct forest_task {
+	struct forest_state *forest;
+	struct forest_entry *entry;
+};
+
+
+/* return the concatenation of a, b and c. the caller must free() it */
+static char* forest_join(const char *a, const char *b, const char *c)
+{
+	size_t la = strlen(a), lb = strlen(b), lc = strlen(c);
+	char *path = (char*)malloc(la + lb + lc + 1);
+	if (path) {
+		memcpy(path, a, la);
+		memcpy(path + la, b, lb);
+		memcpy(path + la + lb, c, lc + 1);
+	}
+	return path;
+}
+
+/* return the path of the tree file for the given entry, named for a
+ * digest of its path so that the trees directory stays flat */
+static char* forest_tree(const struct forest_state *forest,
+		const char *path)
+{
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	char name[2 * SHA_DIGEST_LENGTH + 1];
+	SHA_CTX hash;
+	unsigned i;
+
+	SHA1_Init(&hash);
+	SHA1_Update(&hash, path, strlen(path));
+	SHA1_Final(digest, &hash);
+
+	for (i = 0; i < SHA_DIGEST_LENGTH; i++)
+		sprintf(name + 2 * i, "%02x", digest[i]);
+	return forest_join(forest->trees, "/", name);
+}
+
+static int entry_compare(const void *a, const void *b)
+{
+	return strcmp(((const struct forest_entry*)a)->path,
+			((const struct forest_entry*)b)->path);
+}
+
+/* append an entry to the list, taking ownership of path */
+static int forest_add(struct forest_list *list, char *path,
+		const struct forest_record *record)
+{
+	struct forest_entry *entry;
+	void *entries;
+
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		entries = realloc(list->entries,
+				list->capacity * sizeof(struct forest_entry));
+		if (entries == NULL)
+			return errno;
+		list->entries = (struct forest_entry*)entries;
+	}
+	entry = &list->entries[list->count++];
+	entry->path = path;
+	entry->record = *record;
+	entry->record.path_length = strlen(path);
+	entry->changed = 0;
+	return 0;
+}
+
+static void forest_free(struct forest_list *list)
+{
+	uint64_t i;
+	for (i = 0; i < list->count; i++)
+		free(list->entries[i].path);
+	free(list->entries);
+}
+
+/* return nonzero if the file is one of the forest's own files */
+static int forest_excluded(const struct forest_state *forest,
+		const struct stat *stat)
+{
+	unsigned i;
+	for (i = 0; i < 4; i++)
+		if (forest->excluded[i].st_ino == stat->st_ino &&
+				forest->excluded[i].st_dev == stat->st_dev)
+			return 1;
+	return 0;
+}
+
+/* add every regular file under the given subdirectory to the list.
+ * symbolic links are not followed */
+static int forest_walk(struct forest_state *forest, const char *relative)
+{
+	struct forest_record record;
+	struct dirent *dirent;
+	struct stat stat;
+	char *full, *path, *file;
+	DIR *dir;
+	int status = 0;
+
+	full = relative[0] ? forest_join(forest->directory, "/", relative) :
+		strdup(forest->directory);
+	if (full == NULL)
+		return errno;
+
+	dir = opendir(full);
+	if (dir == NULL) {
+		status = errno;
+		fprintf(stderr, "Failed to open directory '%s' with error %d.\n",
+				full, status);
+		goto out_free;
+	}
+
+	while ((dirent = readdir(dir)) != NULL) {
+		if (strcmp(dirent->d_name, ".") == 0 ||
+				strcmp(dirent->d_name, "..") == 0)
+			continue;
+
+		path = relative[0] ? forest_join(relative, "/", dirent->d_name) :
+			strdup(dirent->d_name);
+		file = forest_join(full, "/", dirent->d_name);
+		if (path == NULL || file == NULL) {
+			status = ENOMEM;
+			free(path);
+			free(file);
+			break;
+		}
+
+		if (lstat(file, &stat) == -1) {
+			status = errno;
+			fprintf(stderr, "Failed to stat '%s' with error %d.\n",
+					file, status);
+		} else if (forest_excluded(forest, &stat)) {
+			/* not part of the dataset */
+		} else if (S_ISDIR(stat.st_mode)) {
+			status = forest_walk(forest, path);
+		} else if (S_ISREG(stat.st_mode)) {
+			memset(&record, 0, sizeof(record));
+			record.size = stat.st_size;
+			record.mtime_sec = stat.st_mtim.tv_sec;
+			record.mtime_nsec = stat.st_mtim.tv_nsec;
+			status = forest_add(&forest->files, path, &record);
+			if (status == 0)
+				path = NULL;
+		}
+		free(path);
+		free(file);
+		if (status)
+			break;
+	}
+	closedir(dir);
+out_free:
+	free(full);
+	return status;
+}
+
+/* read the index written by the last update. a missing index, or one
+ * written with other parameters, leaves the index list empty */
+static int forest_read_index(struct forest_state *forest, const char *path)
+{
+	const struct merkle_context *context = forest->context;
+	struct forest_header header;
+	struct forest_record record;
+	char *name;
+	uint64_t i;
+	FILE *file;
+	int status = 0;
+
+	file = fopen(path, "r");
+	if (file == NULL)
+		return errno == ENOENT ? 0 : errno;
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+			header.magic != FOREST_MAGIC ||
+			header.block_size != context->block_size ||
+			header.k != context->k ||
+			header.k_leaf != context->k_leaf ||
+			header.hash_size != context->hash_size ||
+			header.blocked != context->blocked)
+		goto out_close;
+
+	for (i = 0; i < header.count; i++) {
+		if (fread(&record, sizeof(record), 1, file) != 1)
+			break;
+		name = (char*)malloc(record.path_length + 1);
+		if (name == NULL) {
+			status = errno;
+			break;
+		}
+		if (fread(name, 1, record.path_length, file) !=
+				record.path_length) {
+			free(name);
+			break;
+		}
+		name[record.path_length] = 0;
+
+		status = forest_add(&forest->index, name, &record);
+		if (status) {
+			free(name);
+			break;
+		}
+	}
+
+	/* a torn index is no better than none */
+	if (i != header.count) {
+		forest_free(&forest->index);
+		memset(&forest->index, 0, sizeof(forest->index));
+	}
+out_close:
+	fclose(file);
+	return status;
+}
+
+/* write the index to a temporary file, then rename it over the index */
+static int forest_write_index(const struct forest_state *forest,
+		const char *path)
+{
+	const struct merkle_context *context = forest->context;
+	const struct forest_list *files = &forest->files;
+	struct forest_header header;
+	char *temp;
+	uint64_t i;
+	FILE *file;
+	int status = 0;
+
+	temp = forest_join(path, ".tmp", "");
+	if (temp == NULL)
+		return errno;
+
+	file = fopen(temp, "w");
+	if (file == NULL) {
+		status = errno;
+		fprintf(stderr, "Failed to open forest index "
+				"'%s' with error %d.\n", temp, status);
+		goto out_free;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = FOREST_MAGIC;
+	header.block_size = context->block_size;
+	header.k = context->k;
+	header.k_leaf = context->k_leaf;
+	header.hash_size = context->hash_size;
+	header.blocked = context->blocked;
+	header.count = files->count;
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+		status = EIO;
+
+	for (i = 0; i < files->count && status == 0; i++) {
+		const struct forest_entry *entry = &files->entries[i];
+		if (fwrite(&entry->record, sizeof(entry->record), 1, file) != 1 ||
+				fwrite(entry->path, 1, entry->record.path_length,
+					file) != entry->record.path_length)
+			status = EIO;
+	}
+
+	if (fflush(file) || fdatasync(fileno(file)) == -1)
+		status = errno;
+	fclose(file);
+
+	if (status == 0 && rename(temp, path) == -1)
+		status = errno;
+	if (status)
+		fprintf(stderr, "Failed to write forest index "
+				"'%s' with error %d.\n", path, status);
+out_free:
+	free(temp);
+	return status;
+}
+
+/* rewrite the tree of a changed file, and read its root checksum */
+static void forest_update(void *arg, unsigned worker)
+{
+	struct forest_task *task = (struct forest_task*)arg;
+	struct forest_state *forest = task->forest;
+	struct forest_entry *entry = task->entry;
+	struct merkle_context context = *forest->context;
+	uint64_t total_blocks, leaves;
+	char *file, *tree;
+	int status;
+
+	merkle_context_detach(&context);
+	context.block_buffer = forest->buffers[worker].block_buffer;
+	context.node_buffer = forest->buffers[worker].node_buffer;
+
+	file = forest_join(forest->directory, "/", entry->path);
+	tree = forest_tree(forest, entry->path);
+	if (file == NULL || tree == NULL) {
+		status = ENOMEM;
+		goto out;
+	}
+
+	/* an empty file has no tree, and a root of zeroes */
+	total_blocks = entry->record.size / context.block_size +
+		(entry->record.size % context.block_size ? 1 : 0);
+	if (total_blocks == 0) {
+		memset(entry->record.root, 0, sizeof(entry->record.root));
+		status = unlink(tree) == -1 && errno != ENOENT ? errno : 0;
+		goto out;
+	}
+
+	context.fd_in = open(file, O_RDONLY);
+	if (context.fd_in == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open input file "
+				"'%s' with error %d.\n", file, status);
+		goto out;
+	}
+
+	/* the whole tree is rewritten, and the digests of a larger one
+	 * mustn't be left past its end */
+	context.fd_out = open(tree, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (context.fd_out == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open hash file "
+				"'%s' with error %d.\n", tree, status);
+		goto out_close_in;
+	}
+
+	status = merkle_update(&context, 0, total_blocks - 1, total_blocks);
+	if (status)
+		goto out_close_out;
+
+	leaves = total_blocks / context.k_leaf +
+		(total_blocks % context.k_leaf ? 1 : 0);
+	memset(entry->record.root, 0, sizeof(entry->record.root));
+	status = read_at(context.fd_out, context.hash_size *
+			merkle_root_offset(context.k_leaf, context.k, leaves),
+			entry->record.root, context.hash_size);
+out_close_out:
+	close(context.fd_out);
+out_close_in:
+	close(context.fd_in);
+out:
+	pthread_mutex_lock(&forest->lock);
+	if (status) {
+		forest->failed++;
+		fprintf(stderr, "forest: update of '%s' failed with error %d\n",
+				entry->path, status);
+	} else if (context.verbose)
+		printf("file %s updated\n", entry->path);
+	pthread_mutex_unlock(&forest->lock);
+
+	free(tree);
+	free(file);
+}
+
+/* compare each file with its index record, carrying over the roots of
+ * files that haven't changed, and removing the trees of files that
+ * are gone. returns the number of changed files */
+static uint64_t forest_compare(const struct forest_state *forest)
+{
+	const struct forest_list *files = &forest->files;
+	const struct forest_list *index = &forest->index;
+	struct forest_entry *entry, *old;
+	uint64_t i, j, changed = 0;
+	char *tree;
+	int order;
+
+	/* both lists are sorted by path */
+	for (i = 0, j = 0; i < files->count || j < index->count; ) {
+		entry = i < files->count ? &files->entries[i] : NULL;
+		old = j < index->count ? &index->entries[j] : NULL;
+		order = entry == NULL ? 1 : old == NULL ? -1 :
+			strcmp(entry->path, old->path);
+
+		if (order > 0) {
+			/* removed since the last update */
+			tree = forest_tree(forest, old->path);
+			if (tree)
+				unlink(tree);
+			free(tree);
+			j++;
+			continue;
+		}
+
+		entry->changed = 1;
+		if (order == 0) {
+			tree = forest_tree(forest, entry->path);
+			if (entry->record.size == old->record.size &&
+					entry->record.mtime_sec == old->record.mtime_sec &&
+					entry->record.mtime_nsec == old->record.mtime_nsec &&
+					(entry->record.size == 0 ||
+					 (tree && access(tree, F_OK) == 0))) {
+				memcpy(entry->record.root, old->record.root,
+						sizeof(entry->record.root));
+				entry->changed = 0;
+			}
+			free(tree);
+			j++;
+		}
+		changed += entry->changed;
+		i++;
+	}
+	return changed;
+}
+
+/* compute the digest of each file's path and root, which are the
+ * blocks of the forest tree */
+static void forest_digests(const struct forest_state *forest,
+		unsigned char *digests)
+{
+	const struct merkle_context *context = forest->context;
+	const struct forest_list *files = &forest->files;
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	SHA_CTX hash;
+	uint64_t i;
+
+	for (i = 0; i < files->count; i++) {
+		const struct forest_entry *entry = &files->entries[i];
+
+		/* the path's terminator separates it from the root */
+		SHA1_Init(&hash);
+		SHA1_Update(&hash, entry->path, entry->record.path_length + 1);
+		SHA1_Update(&hash, entry->record.root, context->hash_size);
+		SHA1_Final(digest, &hash);
+		memcpy(digests + i * context->hash_size, digest,
+				context->hash_size);
+	}
+}
+
+/* update the forest tree over the file digests, which are stored one
+ * per block in the entries file. when the set of files is the same as
+ * the last update, only the blocks of the changed files and their
+ * ancestors are rewritten */
+static int forest_root(struct forest_state *forest, const char *path,
+		const char *entries, int rebuild, unsigned char *root)
+{
+	struct merkle_context context = *forest->context;
+	uint64_t count = forest->files.count;
+	size_t size = count * context.hash_size;
+	unsigned char *digests, *previous;
+	struct merkle_range *ranges;
+	uint64_t i, nranges = 0, leaves, root_offset;
+	struct stat stat;
+	int status;
+
+	merkle_context_detach(&context);
+	context.block_size = context.hash_size;
+	context.levels = 0;
+	leaves = count / context.k_leaf + (count % context.k_leaf ? 1 : 0);
+	root_offset = context.hash_size *
+		merkle_root_offset(context.k_leaf, context.k, leaves);
+
+	digests = (unsigned char*)malloc(size);
+	previous = (unsigned char*)calloc(1, size);
+	ranges = (struct merkle_range*)malloc(count * sizeof(*ranges));
+	context.block_buffer = (unsigned char*)malloc(context.k_leaf *
+			context.block_size);
+	context.node_buffer = (unsigned char*)malloc(context.node_size);
+	if (digests == NULL || previous == NULL || ranges == NULL ||
+			context.block_buffer == NULL || context.node_buffer == NULL) {
+		status = ENOMEM;
+		goto out_free;
+	}
+	forest_digests(forest, digests);
+
+	context.fd_in = open(entries, O_RDWR | O_CREAT, 0600);
+	if (context.fd_in == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open forest entries file "
+				"'%s' with error %d.\n", entries, status);
+		goto out_free;
+	}
+
+	context.fd_out = open(path, O_RDWR | O_CREAT, 0600);
+	if (context.fd_out == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open forest file "
+				"'%s' with error %d.\n", path, status);
+		goto out_close_in;
+	}
+
+	/* both files must be complete from the last update to reuse them */
+	if (fstat(context.fd_out, &stat) == -1 ||
+			(uint64_t)stat.st_size != root_offset + context.hash_size ||
+			fstat(context.fd_in, &stat) == -1 ||
+			(uint64_t)stat.st_size != size)
+		rebuild = 1;
+
+	if (rebuild) {
+		/* a tree over more files would leave its digests past the
+		 * end of this one, where they'd be hashed into its nodes */
+		if (ftruncate(context.fd_out, 0) == -1) {
+			status = errno;
+			fprintf(stderr, "Failed to truncate forest file "
+					"'%s' with error %d.\n", path, status);
+			goto out_close_out;
+		}
+		ranges[nranges].from_block = 0;
+		ranges[nranges++].to_block = count - 1;
+	} else {
+		status = read_at(context.fd_in, 0, previous, size);
+		if (status)
+			goto out_close_out;
+
+		/* merge the changed blocks into ranges */
+		for (i = 0; i < count; i++) {
+			if (memcmp(digests + i * context.hash_size,
+						previous + i * context.hash_size,
+						context.hash_size) == 0)
+				continue;
+			if (nranges && ranges[nranges-1].to_block == i - 1)
+				ranges[nranges-1].to_block = i;
+			else {
+				ranges[nranges].from_block = i;
+				ranges[nranges++].to_block = i;
+			}
+		}
+	}
+
+	if (nranges) {
+		for (i = 0; i < nranges; i++) {
+			status = write_at(context.fd_in, ranges[i].from_block *
+					context.hash_size,
+					digests + ranges[i].from_block * context.hash_size,
+					(ranges[i].to_block - ranges[i].from_block + 1) *
+					context.hash_size);
+			if (status)
+				goto out_close_out;
+		}
+		if (ftruncate(context.fd_in, size) == -1) {
+			status = errno;
+			goto out_close_out;
+		}
+
+		if (context.verbose)
+			printf("forest tree updated in %lu ranges\n", nranges);
+		status = merkle_update_ranges(&context, ranges, nranges, count);
+		if (status)
+			goto out_close_out;
+	}
+
+	memset(root, 0, SHA_DIGEST_LENGTH);
+	status = read_at(context.fd_out, root_offset, root, context.hash_size);
+out_close_out:
+	close(context.fd_out);
+out_close_in:
+	close(context.fd_in);
+out_free:
+	free(context.node_buffer);
+	free(context.block_buffer);
+	free(ranges);
+	free(previous);
+	free(digests);
+	return status;
+}
+
+/* record the device and inode of a file to skip during the walk */
+static void forest_exclude(struct stat *excluded, const char *path)
+{
+	if (stat(path, excluded) == -1)
+		memset(excluded, 0, sizeof(*excluded));
+}
+
+int merkle_forest(const struct merkle_context *context,
+		const char *directory, const char *path, unsigned threads,
+		unsigned char *root)
+{
+	struct forest_state forest;
+	struct forest_task *tasks = NULL;
+	struct pool *pool;
+	char *index, *entries;
+	uint64_t i, changed, submitted = 0;
+	unsigned j;
+	int status;
+
+	memset(&forest, 0, sizeof(forest));
+	forest.context = context;
+	forest.directory = directory;
+	pthread_mutex_init(&forest.lock, NULL);
+
+	index = forest_join(path, ".index", "");
+	entries = forest_join(path, ".entries", "");
+	forest.trees = forest_join(path, ".trees", "");
+	if (index == NULL || entries == NULL || forest.trees == NULL) {
+		status = ENOMEM;
+		goto out_free;
+	}
+
+	if (mkdir(forest.trees, 0700) == -1 && errno != EEXIST) {
+		status = errno;
+		fprintf(stderr, "Failed to create directory '%s' with "
+				"error %d.\n", forest.trees, status);
+		goto out_free;
+	}
+	forest_exclude(&forest.excluded[0], path);
+	forest_exclude(&forest.excluded[1], index);
+	forest_exclude(&forest.excluded[2], entries);
+	forest_exclude(&forest.excluded[3], forest.trees);
+
+	status = forest_walk(&forest, "");
+	if (status)
+		goto out_free;
+	if (forest.files.count == 0) {
+		fprintf(stderr, "forest: no files in '%s'\n", directory);
+		status = ENOENT;
+		goto out_free;
+	}
+	qsort(forest.files.entries, forest.files.count,
+			sizeof(struct forest_entry), entry_compare);
+
+	status = forest_read_index(&forest, index);
+	if (status)
+		goto out_free;
+	changed = forest_compare(&forest);
+
+	if (context->verbose)
+		printf("forest of %lu files, %lu changed\n",
+				forest.files.count, changed);
+
+	/* rewrite the trees of the changed files in parallel */
+	if (changed) {
+		tasks = (struct forest_task*)malloc(changed * sizeof(*tasks));
+		forest.buffers = (struct forest_buffers*)calloc(threads,
+				sizeof(struct forest_buffers));
+		if (tasks == NULL || forest.buffers == NULL) {
+			status = ENOMEM;
+			goto out_free;
+		}
+		for (j = 0; j < threads; j++) {
+			forest.buffers[j].block_buffer = (unsigned char*)malloc(
+					context->k_leaf * context->block_size);
+			forest.buffers[j].node_buffer = (unsigned char*)malloc(
+					context->node_size);
+			if (forest.buffers[j].block_buffer == NULL ||
+					forest.buffers[j].node_buffer == NULL) {
+				status = ENOMEM;
+				goto out_free;
+			}
+		}
+
+		status = pool_create(&pool, threads);
+		if (status)
+			goto out_free;
+
+		for (i = 0; i < forest.files.count; i++) {
+			if (!forest.files.entries[i].changed)
+				continue;
+			tasks[submitted].forest = &forest;
+			tasks[submitted].entry = &forest.files.entries[i];
+			status = pool_submit(pool, forest_update, &tasks[submitted]);
+			if (status)
+				break;
+			submitted++;
+		}
+		pool_destroy(pool);
+
+		if (status == 0 && forest.failed)
+			status = -1;
+		if (status)
+			goto out_free;
+	}
+
+	/* only the super-root path above the changed files is rehashed,
+	 * unless the set of files changed */
+	status = forest_root(&forest, path, entries,
+			forest.files.count != forest.index.count, root);
+	if (status)
+		goto out_free;
+
+	status = forest_write_index(&forest, index);
+out_free:
+	for (j = 0; forest.buffers && j < threads; j++) {
+		free(forest.buffers[j].block_buffer);
+		free(forest.buffers[j].node_buffer);
+	}
+	free(forest.buffers);
+	free(tasks);
+	forest_free(&forest.files);
+	forest_free(&forest.index);
+	free(forest.trees);
+	free(entries);
+	free(index);
+	pthread_mutex_destroy(&forest.lock);
+	return status;
+}
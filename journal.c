@@ -0,0 +1,442 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <openssl/sha.h>
+
+#include "merkle.h"
+#include "journal.h"
+#include "update.h"
+
+
+#define JOURNAL_MAGIC 0x4a4b524d /* "MRKJ" */
+#define NO_TRUNCATE ((uint64_t)-1)
+
+/* committed batches are replayed on open, so once the journal grows
+ * past this size, sync the hash file and start the journal over */
+#define JOURNAL_LIMIT (16 << 20)
+
+/* header written before the node images of each committed batch */
+struct journal_header {
+	uint32_t magic;
+	uint32_t node_size;
+	uint64_t count; /* number of node records that follow */
+	uint64_t truncate; /* new hash file size, or NO_TRUNCATE */
+	unsigned char checksum[SHA_DIGEST_LENGTH]; /* of header and records */
+};
+
+/* each record is a node index, followed by node_size bytes */
+#define RECORD_SIZE(node_size) (sizeof(uint64_t) + (node_size))
+
+/* pending node writes, buffered in memory until commit */
+struct merkle_journal {
+	int fd; /* journal file */
+	size_t node_size;
+	uint64_t length; /* size of the journal file */
+	uint64_t truncate; /* pending hash file size, or NO_TRUNCATE */
+	/* node records in the order they were first written */
+	unsigned char *records;
+	uint64_t count, capacity;
+	/* open-addressed table of record indices + 1, keyed by node */
+	uint64_t *table;
+	uint64_t table_size; /* power of 2 */
+};
+
+
+static inline uint64_t record_node(const struct merkle_journal *journal,
+		uint64_t index)
+{
+	uint64_t node;
+	memcpy(&node, journal->records +
+			index * RECORD_SIZE(journal->node_size), sizeof(node));
+	return node;
+}
+
+static inline unsigned char* record_data(
+		const struct merkle_journal *journal, uint64_t index)
+{
+	return journal->records + index * RECORD_SIZE(journal->node_size) +
+		sizeof(uint64_t);
+}
+
+/* return the table slot for the given node, which is either empty
+ * or holds that node's record */
+static uint64_t table_slot(const struct merkle_journal *journal,
+		uint64_t node)
+{
+	uint64_t mask = journal->table_size - 1;
+	uint64_t slot = (node * 0x9E3779B97F4A7C15ULL) & mask;
+
+	while (journal->table[slot] &&
+			record_node(journal, journal->table[slot] - 1) != node)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+/* double the capacity of the records and table */
+static int journal_grow(struct merkle_journal *journal)
+{
+	uint64_t capacity = journal->capacity ? journal->capacity * 2 : 64;
+	uint64_t i;
+	void *records;
+
+	records = realloc(journal->records,
+			capacity * RECORD_SIZE(journal->node_size));
+	if (records == NULL)
+		return errno;
+	journal->records = (unsigned char*)records;
+	journal->capacity = capacity;
+
+	/* keep the table at most half full */
+	free(journal->table);
+	journal->table_size = capacity * 2;
+	journal->table = (uint64_t*)calloc(journal->table_size,
+			sizeof(uint64_t));
+	if (journal->table == NULL)
+		return errno;
+
+	for (i = 0; i < journal->count; i++)
+		journal->table[table_slot(journal,
+				record_node(journal, i))] = i + 1;
+	return 0;
+}
+
+/* find the buffered node, or load it from the hash file */
+static int journal_node(const struct merkle_context *context,
+		uint64_t node, unsigned char **data)
+{
+	struct merkle_journal *journal = context->journal;
+	uint64_t slot;
+	int status;
+
+	if (journal->count == journal->capacity) {
+		status = journal_grow(journal);
+		if (status)
+			return status;
+	}
+
+	slot = table_slot(journal, node);
+	if (journal->table[slot] == 0) {
+		/* read the current contents of the node */
+		*data = record_data(journal, journal->count);
+		status = read_at(context->fd_out, node * journal->node_size,
+				*data, journal->node_size);
+		if (status)
+			return status;
+
+		memcpy(journal->records + journal->count *
+				RECORD_SIZE(journal->node_size),
+				&node, sizeof(node));
+		journal->table[slot] = ++journal->count;
+		return 0;
+	}
+	*data = record_data(journal, journal->table[slot] - 1);
+	return 0;
+}
+
+/* read from the hash file, including any buffered node writes */
+int journal_read(const struct merkle_context *context, off_t offset,
+		unsigned char *buffer, size_t length)
+{
+	const struct merkle_journal *journal = context->journal;
+	uint64_t node, slot;
+	size_t start, count;
+	int status;
+
+	while (length) {
+		node = offset / journal->node_size;
+		start = offset % journal->node_size;
+		count = journal->node_size - start;
+		if (count > length)
+			count = length;
+
+		slot = journal->count ? table_slot(journal, node) : 0;
+		if (journal->count && journal->table[slot]) {
+			memcpy(buffer, record_data(journal,
+						journal->table[slot] - 1) + start, count);
+		} else {
+			status = read_at(context->fd_out, offset, buffer, count);
+			if (status)
+				return status;
+		}
+		offset += count;
+		buffer += count;
+		length -= count;
+	}
+	return 0;
+}
+
+/* buffer a write to the hash file until commit */
+int journal_write(const struct merkle_context *context, off_t offset,
+		const unsigned char *buffer, size_t length)
+{
+	const struct merkle_journal *journal = context->journal;
+	unsigned char *data;
+	size_t start, count;
+	int status;
+
+	while (length) {
+		start = offset % journal->node_size;
+		count = journal->node_size - start;
+		if (count > length)
+			count = length;
+
+		status = journal_node(context,
+				offset / journal->node_size, &data);
+		if (status)
+			return status;
+		memcpy(data + start, buffer, count);
+
+		offset += count;
+		buffer += count;
+		length -= count;
+	}
+	return 0;
+}
+
+/* buffer a truncate of the hash file until commit */
+int journal_truncate(const struct merkle_context *context, off_t length)
+{
+	context->journal->truncate = length;
+	return 0;
+}
+
+/* apply the node records and truncate of a committed batch */
+static int journal_apply(const struct merkle_context *context,
+		const unsigned char *records, uint64_t count, uint64_t truncate)
+{
+	size_t node_size = context->node_size;
+	uint64_t i, node;
+	int status;
+
+	for (i = 0; i < count; i++) {
+		const unsigned char *record = records + i * RECORD_SIZE(node_size);
+		memcpy(&node, record, sizeof(node));
+
+		status = write_at(context->fd_out, node * node_size,
+				(unsigned char*)record + sizeof(node), node_size);
+		if (status)
+			return status;
+	}
+
+	if (truncate != NO_TRUNCATE &&
+			ftruncate(context->fd_out, truncate) == -1) {
+		status = errno;
+		fprintf(stderr, "journal: ftruncate(%lu) failed with %d\n",
+				truncate, status);
+		return status;
+	}
+	return 0;
+}
+
+/* compute the checksum over a batch header and its records */
+static void journal_checksum(struct journal_header *header,
+		const unsigned char *records, unsigned char *digest)
+{
+	SHA_CTX hash;
+
+	memset(header->checksum, 0, sizeof(header->checksum));
+	SHA1_Init(&hash);
+	SHA1_Update(&hash, header, sizeof(*header));
+	SHA1_Update(&hash, records,
+			header->count * RECORD_SIZE(header->node_size));
+	SHA1_Final(digest, &hash);
+}
+
+/* sync the hash file, after which the journal can be discarded */
+static int journal_checkpoint(const struct merkle_context *context)
+{
+	struct merkle_journal *journal = context->journal;
+
+	if (fdatasync(context->fd_out) == -1) {
+		fprintf(stderr, "journal: fdatasync() of hash file "
+				"failed with %d\n", errno);
+		return errno;
+	}
+	if (ftruncate(journal->fd, 0) == -1) {
+		fprintf(stderr, "journal: ftruncate() failed with %d\n", errno);
+		return errno;
+	}
+	journal->length = 0;
+	return 0;
+}
+
+/* write the buffered node writes to the journal as a single batch,
+ * sync it, and only then apply the writes to the hash file */
+static int journal_commit(const struct merkle_context *context)
+{
+	struct merkle_journal *journal = context->journal;
+	struct journal_header header;
+	int status;
+
+	if (journal->count == 0 && journal->truncate == NO_TRUNCATE)
+		return 0;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = JOURNAL_MAGIC;
+	header.node_size = journal->node_size;
+	header.count = journal->count;
+	header.truncate = journal->truncate;
+	journal_checksum(&header, journal->records, header.checksum);
+
+	status = write_at(journal->fd, journal->length,
+			(unsigned char*)&header, sizeof(header));
+	if (status)
+		return status;
+	status = write_at(journal->fd, journal->length + sizeof(header),
+			journal->records,
+			journal->count * RECORD_SIZE(journal->node_size));
+	if (status)
+		return status;
+
+	/* the only sync required for each batch */
+	if (fdatasync(journal->fd) == -1) {
+		status = errno;
+		fprintf(stderr, "journal: fdatasync() failed with %d\n", status);
+		return status;
+	}
+	journal->length += sizeof(header) +
+		journal->count * RECORD_SIZE(journal->node_size);
+
+	if (context->verbose)
+		printf("journal committed %lu nodes\n", journal->count);
+
+	status = journal_apply(context, journal->records,
+			journal->count, journal->truncate);
+	if (status)
+		return status;
+
+	if (journal->length > JOURNAL_LIMIT)
+		return journal_checkpoint(context);
+	return 0;
+}
+
+/* commit the buffered writes if the operation succeeded, otherwise
+ * discard them to leave the hash file as it was */
+int journal_finish(const struct merkle_context *context, int status)
+{
+	struct merkle_journal *journal = context->journal;
+	uint64_t i;
+
+	if (journal == NULL)
+		return status;
+
+	if (status == 0)
+		status = journal_commit(context);
+
+	for (i = 0; i < journal->table_size; i++)
+		journal->table[i] = 0;
+	journal->count = 0;
+	journal->truncate = NO_TRUNCATE;
+	return status;
+}
+
+/* replay each complete batch in the journal, discarding the rest */
+static int journal_recover(const struct merkle_context *context)
+{
+	struct merkle_journal *journal = context->journal;
+	struct journal_header header;
+	unsigned char checksum[SHA_DIGEST_LENGTH];
+	unsigned char *records = NULL;
+	uint64_t offset = 0, batches = 0, size;
+	ssize_t bytes;
+	int status = 0;
+
+	for (;;) {
+		bytes = pread(journal->fd, &header, sizeof(header), offset);
+		if (bytes != sizeof(header) || header.magic != JOURNAL_MAGIC)
+			break;
+
+		size = header.count * RECORD_SIZE(header.node_size);
+		free(records);
+		records = (unsigned char*)malloc(size ? size : 1);
+		if (records == NULL) {
+			status = errno;
+			goto out;
+		}
+		bytes = pread(journal->fd, records, size,
+				offset + sizeof(header));
+		if (bytes != (ssize_t)size)
+			break;
+
+		/* a torn batch was never applied, so it can be dropped */
+		memcpy(checksum, header.checksum, sizeof(checksum));
+		journal_checksum(&header, records, header.checksum);
+		if (memcmp(checksum, header.checksum, sizeof(checksum)))
+			break;
+
+		/* a committed batch may be partly applied, so it can't be
+		 * dropped, and can only be replayed with the same nodes */
+		if (header.node_size != journal->node_size) {
+			fprintf(stderr, "journal: committed batch %lu has "
+					"node size %u, but the tree's node size is "
+					"%lu. recover it with the parameters the "
+					"journal was written with.\n", batches,
+					header.node_size, journal->node_size);
+			status = EINVAL;
+			goto out;
+		}
+
+		status = journal_apply(context, records,
+				header.count, header.truncate);
+		if (status)
+			goto out;
+
+		offset += sizeof(header) + size;
+		batches++;
+	}
+
+	if (context->verbose && batches)
+		printf("journal replayed %lu batches\n", batches);
+
+	status = journal_checkpoint(context);
+out:
+	free(records);
+	return status;
+}
+
+/* open the journal and recover any committed batches */
+int merkle_journal_open(struct merkle_context *context, const char *path)
+{
+	struct merkle_journal *journal;
+	int status;
+
+	journal = (struct merkle_journal*)calloc(1, sizeof(*journal));
+	if (journal == NULL)
+		return errno;
+
+	journal->node_size = context->node_size;
+	journal->truncate = NO_TRUNCATE;
+	journal->fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (journal->fd == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open journal file "
+				"'%s' with error %d.\n", path, status);
+		free(journal);
+		return status;
+	}
+
+	context->journal = journal;
+	status = journal_recover(context);
+	if (status)
+		merkle_journal_close(context);
+	return status;
+}
+
+/* close the journal, discarding any uncommitted writes */
+void merkle_journal_close(struct merkle_context *context)
+{
+	struct merkle_journal *journal = context->journal;
+
+	if (journal == NULL)
+		return;
+
+	close(journal->fd);
+	free(journal->records);
+	free(journal->table);
+	free(journal);
+	context->journal = NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef COHORT_MERKLE_JOURNAL_H
+#define COHORT_MERKLE_JOURNAL_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+
+/* from merkle.h */
+struct merkle_context;
+
+/* hash file i/o through the journal, for internal use by update.c */
+int journal_read(const struct merkle_context *context, off_t offset,
+		unsigned char *buffer, size_t length);
+int journal_write(const struct merkle_context *context, off_t offset,
+		const unsigned char *buffer, size_t length);
+int journal_truncate(const struct merkle_context *context, off_t length);
+
+/* commit the writes of a successful operation, or discard them if
+ * status is nonzero. returns the final status */
+int journal_finish(const struct merkle_context *context, int status);
+
+#endif /* COHORT_MERKLE_JOURNAL_H */
@@ -0,0 +1,89 @@
+#include <string.h>
+
+#include "layout.h"
+#include "tree.h"
+
+
+/* return the most levels of a band whose full groups fit in a page,
+ * counting the leaf band, whose nodes may be wider, and the bands
+ * above it. a band is at least one level, even if a node is larger
+ * than a page */
+static uint8_t layout_band(uint8_t k_leaf, uint8_t k, uint8_t hash_size)
+{
+	uint64_t budget = LAYOUT_PAGE_SIZE / hash_size;
+	/* digests in a group of one level, and the nodes in its bottom row */
+	uint64_t nodes = k, leaves = k_leaf, row = 1;
+	uint64_t next_nodes, next_leaves;
+	uint8_t band = 1;
+
+	while (band < LAYOUT_MAX_DEPTH) {
+		/* another level adds k times as many nodes under the bottom
+		 * row. in the leaf band, that row becomes interior nodes,
+		 * and the new row holds the leaves */
+		next_nodes = nodes + row * k * k;
+		next_leaves = leaves + row * (k - k_leaf) + row * k * k_leaf;
+		if (next_nodes > budget || next_leaves > budget)
+			break;
+		nodes = next_nodes;
+		leaves = next_leaves;
+		row *= k;
+		band++;
+	}
+	return band;
+}
+
+void merkle_layout_init(struct merkle_layout *layout, uint8_t k_leaf,
+		uint8_t k, uint8_t hash_size, uint8_t blocked,
+		uint64_t total_blocks)
+{
+	struct layout_level *level;
+	uint64_t leaves, offset = 0, count, within, within_last;
+	uint8_t depth, lo, hi, d, width;
+
+	memset(layout, 0, sizeof(*layout));
+	layout->k_leaf = k_leaf;
+	layout->k = k;
+	layout->blocked = blocked;
+	layout->total_blocks = total_blocks;
+
+	leaves = total_blocks / k_leaf + (total_blocks % k_leaf ? 1 : 0);
+	layout->depth = merkle_depth(k, leaves);
+	if (!blocked)
+		return;
+	layout->band = layout_band(k_leaf, k, hash_size);
+
+	/* count the nodes at each depth */
+	count = leaves;
+	for (depth = 1; depth <= layout->depth; depth++) {
+		layout->levels[depth-1].nodes = count;
+		count = count / k + (count % k ? 1 : 0);
+	}
+
+	/* place the bands from the leaves up */
+	for (lo = 1; lo <= layout->depth; lo = hi + 1) {
+		hi = lo + layout->band - 1;
+		if (hi > layout->depth)
+			hi = layout->depth;
+
+		/* walk down from the top of the band, where each group has
+		 * a single node, so each depth follows those above it */
+		within = within_last = 0;
+		for (d = hi; d >= lo; d--) {
+			level = &layout->levels[d-1];
+			width = d == 1 ? k_leaf : k;
+			level->per_group = d == hi ? 1 :
+				layout->levels[d].per_group * k;
+			level->last = layout->levels[hi-1].nodes - 1;
+			level->start = offset;
+			level->within = within;
+			level->within_last = within_last;
+
+			within += level->per_group * width;
+			within_last += (level->nodes -
+					level->last * level->per_group) * width;
+		}
+		for (d = lo; d <= hi; d++)
+			layout->levels[d-1].group = within;
+		offset += layout->levels[hi-1].last * within + within_last;
+	}
+}
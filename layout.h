@@ -0,0 +1,67 @@
+#ifndef COHORT_MERKLE_LAYOUT_H
+#define COHORT_MERKLE_LAYOUT_H
+
+#include <stdint.h>
+
+
+/* deepest possible tree, with k_leaf=k=2 over 64-bit block numbers */
+#define LAYOUT_MAX_DEPTH 64
+
+/* size of the pages that groups of nodes should fit in. it's fixed,
+ * rather than the page size of this machine, because it decides where
+ * the nodes are in the file */
+#define LAYOUT_PAGE_SIZE 4096
+
+/* placement of the nodes at one depth of the blocked layout */
+struct layout_level {
+	uint64_t nodes; /* number of nodes at this depth */
+	uint64_t start; /* offset of the band that holds this depth */
+	uint64_t group; /* digests in each full group of the band */
+	uint64_t per_group; /* nodes of this depth in each full group */
+	uint64_t within; /* offset of this depth within a full group */
+	uint64_t within_last; /* and within the last group of the band */
+	uint64_t last; /* index of the last group of the band */
+};
+
+/* placement of the node digests in the hash file. the preorder layout
+ * numbers the nodes as merkle_child() does, and places each node's
+ * digests at merkle_offset(). the blocked layout splits the levels of
+ * the tree into bands, from the leaves up, each as many levels as fit
+ * a subtree in a page. each band is a row of groups, one for each
+ * node at the top of the band, which hold the nodes of its subtree in
+ * level order. a path from a leaf to the root then reads one group
+ * per band, instead of a distant node per level. every node keeps the
+ * size it has in the preorder layout, so the hash file is the same
+ * size, and the root checksum is at the same offset */
+struct merkle_layout {
+	uint8_t k_leaf, k;
+	uint8_t blocked; /* nonzero for the blocked layout */
+	uint8_t band; /* levels in each band of the blocked layout */
+	uint8_t depth; /* levels in the tree */
+	uint64_t total_blocks;
+	struct layout_level levels[LAYOUT_MAX_DEPTH]; /* by depth-1 */
+};
+
+/* compute the layout of a tree over total_blocks, in the blocked
+ * layout if blocked is nonzero */
+void merkle_layout_init(struct merkle_layout *layout, uint8_t k_leaf,
+		uint8_t k, uint8_t hash_size, uint8_t blocked,
+		uint64_t total_blocks);
+
+/* return the offset of a node's digests in the blocked layout, counted
+ * in digests, from its depth and its index among the nodes at that
+ * depth */
+static inline uint64_t layout_blocked_offset(
+		const struct merkle_layout *layout, uint8_t depth,
+		uint64_t index)
+{
+	const struct layout_level *level = &layout->levels[depth-1];
+	uint64_t group = index / level->per_group;
+	uint8_t width = depth == 1 ? layout->k_leaf : layout->k;
+
+	return level->start + group * level->group +
+		(group == level->last ? level->within_last : level->within) +
+		(index % level->per_group) * width;
+}
+
+#endif /* COHORT_MERKLE_LAYOUT_H */
@@ -0,0 +1,298 @@
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "merkle.h"
+#include "map.h"
+#include "tree.h"
+
+
+/* default size of the input window */
+#define WINDOW_SIZE (64 << 20)
+
+/* mapping of the hash file */
+struct merkle_map {
+	unsigned char *data;
+	uint64_t size; /* length of the mapping */
+	uint64_t length; /* length of the hash file, up to size */
+};
+
+/* window into the input file */
+struct merkle_window {
+	const unsigned char *data; /* or NULL before the first block */
+	uint64_t offset; /* file offset of the window */
+	uint64_t size; /* length of the window */
+	uint64_t window_size; /* length of each mapping */
+	uint64_t file_size;
+};
+
+
+/* read from the mapped hash file, zero-filling past the end like
+ * read_at() does */
+int map_read(const struct merkle_context *context, off_t offset,
+		unsigned char *buffer, size_t length)
+{
+	const struct merkle_map *map = context->map;
+	size_t count = 0;
+
+	if ((uint64_t)offset < map->length) {
+		count = map->length - offset;
+		if (count > length)
+			count = length;
+		memcpy(buffer, map->data + offset, count);
+	}
+	memset(buffer + count, 0, length - count);
+	return 0;
+}
+
+/* write to the mapped hash file */
+int map_write(const struct merkle_context *context, off_t offset,
+		const unsigned char *buffer, size_t length)
+{
+	const struct merkle_map *map = context->map;
+
+	if ((uint64_t)offset + length > map->length) {
+		fprintf(stderr, "map: write of %lu bytes at offset %lu is "
+				"past the end of the mapping\n", length, offset);
+		return ERANGE;
+	}
+	memcpy(map->data + offset, buffer, length);
+	return 0;
+}
+
+/* sync the mapped hash file, then truncate it. this is the only
+ * sync, and it happens once when the root checksum is written */
+int map_truncate(const struct merkle_context *context, off_t length)
+{
+	struct merkle_map *map = context->map;
+	int status;
+
+	if (msync(map->data, map->size, MS_SYNC) == -1) {
+		status = errno;
+		fprintf(stderr, "map: msync() failed with error %d\n", status);
+		return status;
+	}
+
+	if (ftruncate(context->fd_out, length) == -1) {
+		status = errno;
+		fprintf(stderr, "ftruncate(%lu) failed with error %d\n",
+				length, status);
+		return status;
+	}
+
+	/* pages past the end of the file can no longer be touched */
+	if ((uint64_t)length < map->length)
+		map->length = length;
+	return 0;
+}
+
+/* zero the mapped hash file, by truncating it and extending it back to
+ * the length of the mapping */
+int map_clear(const struct merkle_context *context)
+{
+	struct merkle_map *map = context->map;
+	int status;
+
+	if (ftruncate(context->fd_out, 0) == -1 ||
+			ftruncate(context->fd_out, map->length) == -1) {
+		status = errno;
+		fprintf(stderr, "map: ftruncate() failed with error %d\n",
+				status);
+		return status;
+	}
+	return 0;
+}
+
+/* map the hash file into memory, extending it to hold the tree */
+int merkle_map(struct merkle_context *context, uint64_t total_blocks,
+		int sequential)
+{
+	uint64_t leaves = total_blocks / context->k_leaf +
+		(total_blocks % context->k_leaf ? 1 : 0);
+	uint64_t size = context->hash_size *
+		(merkle_root_offset(context->k_leaf, context->k, leaves) + 1);
+	int prot = PROT_READ;
+	struct merkle_map *map;
+	struct stat stat;
+	int status;
+
+	if (fstat(context->fd_out, &stat) == -1)
+		return errno;
+
+	/* extend the hash file unless it's already large enough, or
+	 * opened read-only for verification */
+	if ((uint64_t)stat.st_size < size) {
+		if (ftruncate(context->fd_out, size) == 0)
+			stat.st_size = size;
+		else if (errno != EINVAL && errno != EBADF) {
+			status = errno;
+			fprintf(stderr, "map: ftruncate(%lu) failed with "
+					"error %d\n", size, status);
+			return status;
+		}
+	}
+	if (stat.st_size == 0)
+		return 0; /* nothing to map, reads return zeroes */
+
+	map = (struct merkle_map*)calloc(1, sizeof(*map));
+	if (map == NULL)
+		return errno;
+
+	if ((fcntl(context->fd_out, F_GETFL) & O_ACCMODE) == O_RDWR)
+		prot |= PROT_WRITE;
+
+	map->data = (unsigned char*)mmap(NULL, stat.st_size, prot,
+			MAP_SHARED, context->fd_out, 0);
+	if (map->data == MAP_FAILED) {
+		status = errno;
+		fprintf(stderr, "map: mmap(%lu) failed with error %d\n",
+				stat.st_size, status);
+		free(map);
+		return status;
+	}
+	map->size = map->length = stat.st_size;
+
+	/* a full traversal moves mostly forward through the hash file,
+	 * while a small range touches one node per level */
+	if (madvise(map->data, map->size, sequential ?
+				MADV_SEQUENTIAL : MADV_RANDOM) == -1 &&
+			context->verbose)
+		printf("map: madvise() failed with error %d\n", errno);
+
+	context->map = map;
+	if (context->verbose)
+		printf("mapped %lu bytes of hash file\n", map->size);
+	return 0;
+}
+
+/* unmap the hash file mapped by merkle_map() */
+void merkle_unmap(struct merkle_context *context)
+{
+	struct merkle_map *map = context->map;
+
+	if (map == NULL)
+		return;
+
+	munmap(map->data, map->size);
+	free(map);
+	context->map = NULL;
+}
+
+/* map the window of the input file that holds the given block */
+static int window_slide(const struct merkle_context *context,
+		uint64_t block)
+{
+	struct merkle_window *window = context->window;
+	uint64_t page_size = sysconf(_SC_PAGESIZE);
+	uint64_t offset = block * context->block_size;
+	void *data;
+	int status;
+
+	if (window->data) {
+		munmap((void*)window->data, window->size);
+		window->data = NULL;
+	}
+
+	/* start the window on the page holding the block, and stop it
+	 * at the end of the file rather than mapping past it */
+	window->offset = offset - offset % page_size;
+	window->size = window->file_size - window->offset;
+	if (window->size > window->window_size)
+		window->size = window->window_size;
+
+	data = mmap(NULL, window->size, PROT_READ, MAP_SHARED,
+			context->fd_in, window->offset);
+	if (data == MAP_FAILED) {
+		status = errno;
+		fprintf(stderr, "map: mmap(%lu) of input at offset %lu "
+				"failed with error %d\n", window->size,
+				window->offset, status);
+		return status;
+	}
+	window->data = (const unsigned char*)data;
+
+	/* blocks are hashed in order within the window, and pages are
+	 * dropped from the mapping when it slides */
+	madvise(data, window->size, MADV_SEQUENTIAL);
+
+	if (context->verbose)
+		printf("mapped %lu bytes of input at offset %lu\n",
+				window->size, window->offset);
+	return 0;
+}
+
+/* return a pointer to the given input block in the window */
+int map_block(const struct merkle_context *context, uint64_t block,
+		const unsigned char **data, size_t *length)
+{
+	struct merkle_window *window = context->window;
+	uint64_t offset = block * context->block_size;
+	uint64_t end = offset + context->block_size;
+	int status;
+
+	/* nothing past the end of the file is ever touched */
+	if (end > window->file_size)
+		end = window->file_size;
+	if (offset >= end) {
+		*length = 0;
+		return 0;
+	}
+
+	if (window->data == NULL || offset < window->offset ||
+			end > window->offset + window->size) {
+		status = window_slide(context, block);
+		if (status)
+			return status;
+	}
+
+	*data = window->data + (offset - window->offset);
+	*length = end - offset;
+	return 0;
+}
+
+/* map the input file through a sliding window */
+int merkle_map_input(struct merkle_context *context,
+		uint64_t window_size)
+{
+	uint64_t page_size = sysconf(_SC_PAGESIZE);
+	struct merkle_window *window;
+	struct stat stat;
+
+	if (fstat(context->fd_in, &stat) == -1)
+		return errno;
+
+	window = (struct merkle_window*)calloc(1, sizeof(*window));
+	if (window == NULL)
+		return errno;
+
+	/* a block starting anywhere in the first page must fit */
+	if (window_size == 0)
+		window_size = WINDOW_SIZE;
+	if (window_size < context->block_size + page_size)
+		window_size = context->block_size + page_size;
+	window->window_size = (window_size + page_size - 1) /
+		page_size * page_size;
+	window->file_size = stat.st_size;
+
+	context->window = window;
+	return 0;
+}
+
+/* unmap the input file mapped by merkle_map_input() */
+void merkle_unmap_input(struct merkle_context *context)
+{
+	struct merkle_window *window = context->window;
+
+	if (window == NULL)
+		return;
+
+	if (window->data)
+		munmap((void*)window->data, window->size);
+	free(window);
+	context->window = NULL;
+}
@@ -0,0 +1,24 @@
+#ifndef COHORT_MERKLE_MAP_H
+#define COHORT_MERKLE_MAP_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+
+/* from merkle.h */
+struct merkle_context;
+
+/* hash file i/o through the mapping, for internal use by update.c */
+int map_read(const struct merkle_context *context, off_t offset,
+		unsigned char *buffer, size_t length);
+int map_write(const struct merkle_context *context, off_t offset,
+		const unsigned char *buffer, size_t length);
+int map_truncate(const struct merkle_context *context, off_t length);
+int map_clear(const struct merkle_context *context);
+
+/* return a pointer to the given input block and the number of bytes
+ * in it, which is less than block_size only for the final block */
+int map_block(const struct merkle_context *context, uint64_t block,
+		const unsigned char **data, size_t *length);
+
+#endif /* COHORT_MERKLE_MAP_H */
@@ -9,56 +9,339 @@
 #include <string.h>
 
 #include "merkle.h"
+#include "tree.h"
 
 
 int usage(char *name)
 {
 	printf("Usage:\n"
-			"%s <operation> [options] <input file> <output file>\n\n"
+			"%s <operation> [options] <input file> <output file>\n"
+			"%s repair [options] <source file> <source hash file> "
+			"<target file> <target hash file>\n"
+			"%s batch [options] <manifest file>\n"
+			"%s snapdiff [options] <store file> <version> <version>\n"
+			"%s compact [options] <store file> <oldest version>\n\n"
 			"Operations:\n"
 			"  write    Read blocks from the input file and write an updated\n"
 			"           hash tree to the output file.\n\n"
-			"  truncate Truncate the input file at the upper bound specified\n"
-			"           with -r, and write an updated hash tree to the output file.\n\n"
+			"  truncate Truncate or extend the input file to the upper bound\n"
+			"           specified with -r, and write an updated hash tree to\n"
+			"           the output file. Extended blocks are filled with zeroes.\n\n"
 			"  verify   Read blocks from the input file and compare the hashes\n"
 			"           with those from the output file.\n\n"
+			"  diff     Compare the hash trees in the two given hash files, and\n"
+			"           print each range of blocks whose hashes differ.\n\n"
+			"  repair   Copy the blocks and hashes that differ from the source\n"
+			"           file and its hash tree to the target file and its\n"
+			"           hash tree, and verify the copied blocks.\n\n"
+			"  mark     Append the blocks in the range given with -r to the\n"
+			"           dirty block log in '<output file>.dirty', without\n"
+			"           updating any hashes.\n\n"
+			"  flush    Update the hashes of every block in the dirty block\n"
+			"           log in a single pass, and empty the log.\n\n"
+			"  watch    Write the hash tree for the input file, then keep it\n"
+			"           up to date as the file changes, by updating only the\n"
+			"           regions of the file that changed. Runs until the input\n"
+			"           file is removed.\n\n"
+			"  batch    Run each write or verify listed in the manifest file,\n"
+			"           one per line as '<write|verify> <input file> <hash\n"
+			"           file> [<from> <to>]', on a pool of threads, and\n"
+			"           print the result of each. Entries with the same\n"
+			"           hash file run one at a time, in order.\n\n"
+			"  forest   Write a hash tree for each file under the input\n"
+			"           directory, then a single forest tree over the path\n"
+			"           and root of each file to the output file. Later\n"
+			"           writes rehash only the files that changed.\n\n"
+			"  commit   Hash the blocks of the input file in the range given\n"
+			"           with -r into a new version of the tree in the\n"
+			"           copy-on-write node store in the output file, and\n"
+			"           print its number. Only the nodes above those blocks\n"
+			"           are written, and the rest are shared with the last\n"
+			"           version.\n\n"
+			"  snapdiff Print each range of blocks whose hashes differ between\n"
+			"           two versions in the node store.\n\n"
+			"  compact  Remove the versions older than the given version from\n"
+			"           the node store, along with the nodes only they use.\n\n"
+			"  scrub    Verify the input file in the background, within the\n"
+			"           budgets given with -R and -I, or over the period\n"
+			"           given with -p. The position is saved in\n"
+			"           '<output file>.scrub', so a stopped scrub resumes\n"
+			"           there. SIGUSR1 pauses the scrub, SIGUSR2 resumes\n"
+			"           it, and SIGINT or SIGTERM stop it.\n\n"
 			"Options:\n"
 			"  -b #     Size of each file block in bytes. default: 512\n\n"
+			"  -C #     Hash the tree over content-defined chunks of the\n"
+			"           input file that average the given size, a power\n"
+			"           of 2, in place of fixed blocks. An edit only\n"
+			"           changes the chunks near it. Write stores the chunks\n"
+			"           in '<output file>.chunks' for verify, whose -r\n"
+			"           range selects the chunks that hold those blocks.\n"
+			"           Write only supports the whole file.\n\n"
+			"  -c       Lock each hash tree node while it's updated, so that\n"
+			"           several writes can update different ranges of the\n"
+			"           same file at once. Not compatible with -j or\n"
+			"           --resume.\n\n"
+			"  -F       Keep a fast fingerprint of each block in\n"
+			"           '<output file>.fingerprints', and only rehash the\n"
+			"           blocks whose fingerprints changed since the last\n"
+			"           write with -F. Write only supports the whole file.\n\n"
 			"  -h #     Size of the hash digest. default: 20\n\n"
+			"  -I #     Most reads per second for scrub. default: no limit\n\n"
+			"  --idle   Scrub in the idle i/o scheduling class, so it only\n"
+			"           reads when no other process does.\n\n"
+			"  -j file  Journal the hash file writes of each update in the\n"
+			"           given file, so that an interrupted update can be\n"
+			"           recovered by the next one. default: none\n\n"
 			"  -k #     Number of children for each hash tree node. Must be\n"
 			"           a power of 2, between 2 and 128. default: 4\n\n"
+			"  -K #     Number of blocks under each leaf node, when it\n"
+			"           should differ from the number of children of the\n"
+			"           nodes above. Must be a power of 2, between 2 and\n"
+			"           128. default: the value of -k\n\n"
+			"  -l       Update or verify the tree a level at a time, from\n"
+			"           the leaves up, instead of depth-first. Not\n"
+			"           compatible with --resume.\n\n"
+			"  -L       Lay out the hash file in blocks of nearby levels,\n"
+			"           so that the path from a leaf to the root reads a\n"
+			"           few pages instead of one for each level. Every\n"
+			"           operation on the hash file must give -L, and\n"
+			"           truncate rewrites the whole hash file.\n\n"
+			"  -m       Memory-map the hash file, so that node reads and\n"
+			"           writes don't need a system call each. Not\n"
+			"           compatible with -j.\n\n"
+			"  -M       Memory-map the input file of write and verify in\n"
+			"           a sliding window, and hash each block in place.\n\n"
+			"  -p #     Scrub the whole file once every period, with a suffix\n"
+			"           of s, m, h or d, and keep scrubbing. default: one\n"
+			"           pass\n\n"
+			"  -R #     Most bytes per second for scrub, with an optional\n"
+			"           suffix of K, M or G. default: no limit\n\n"
 			"  -r # #   Range of file blocks on which to operate, using\n"
 			"           zero-based indices. default: all blocks\n\n"
-			"  -v       Verbose output.\n", name);
+			"  -t #     Number of threads for batch and forest. default: one for\n"
+			"           each online processor\n\n"
+			"  -v       Verbose output.\n\n"
+			"  --resume Resume an interrupted write from its last checkpoint\n"
+			"           in '<output file>.checkpoint'. Writes that take more\n"
+			"           than a minute record a checkpoint every minute.\n",
+			name, name, name, name, name);
 	return 1;
 }
 
+/* range_to value that selects every block in the file */
+#define RANGE_ALL UINT64_MAX
+
 /* command line options */
 struct cmd_options {
 	const char *operation;
 	const char *source;
 	const char *hash;
+	const char *target; /* target file for repair */
+	const char *target_hash; /* target hash file for repair */
+	const char *journal; /* journal file for hash file writes */
 	uint32_t block_size;
-	uint32_t range_from;
-	uint32_t range_to;
+	uint64_t range_from;
+	uint64_t range_to; /* RANGE_ALL until -r is given */
 	uint32_t hash_size;
 	uint8_t tree_width;
 	uint8_t verbose;
+	uint8_t resume; /* resume an interrupted write */
+	uint8_t map; /* memory-map the hash file */
+	uint8_t map_input; /* memory-map the input file */
+	uint8_t levels; /* traverse the tree a level at a time */
+	uint8_t concurrent; /* lock hash file nodes during updates */
+	uint32_t threads; /* worker threads for batch, or 0 for default */
+	uint32_t chunk_size; /* average content-defined chunk size, or 0 */
+	uint64_t rate; /* scrub bytes per second, or 0 for no limit */
+	uint32_t iops; /* scrub reads per second, or 0 for no limit */
+	uint64_t period; /* seconds for each scrub pass, or 0 for one pass */
+	uint8_t idle; /* scrub in the idle i/o class */
+	uint8_t fingerprints; /* skip blocks with unchanged fingerprints */
+	uint8_t leaf_width; /* blocks per leaf node, or 0 for tree_width */
+	uint8_t blocked; /* blocked layout of the hash file */
 };
 
 
+/* return the number of digests in the widest node */
+static uint8_t node_width(const struct cmd_options *options)
+{
+	return options->tree_width > options->leaf_width ?
+		options->tree_width : options->leaf_width;
+}
+
+/* set up a context with the tree parameters and flags of the options,
+ * no buffers, files or optional attachments */
+static void context_init(const struct cmd_options *options,
+		struct merkle_context *context)
+{
+	memset(context, 0, sizeof(*context));
+	context->verbose = options->verbose;
+	context->k = options->tree_width;
+	context->k_leaf = options->leaf_width;
+	context->block_size = options->block_size;
+	context->hash_size = options->hash_size;
+	context->node_size = node_width(options) * context->hash_size;
+	context->fd_in = -1;
+	context->fd_out = -1;
+	context->blocked = options->blocked;
+	context->levels = options->levels;
+	context->concurrent = options->concurrent;
+}
+
+/* check that the hash file offsets for the given block count fit in
+ * a 64-bit off_t, returning an error if they don't */
+static int check_size(const struct cmd_options *options, uint64_t blocks)
+{
+	uint64_t leaves = blocks / options->leaf_width +
+		(blocks % options->leaf_width ? 1 : 0);
+
+	/* the hash file ends with the root checksum, which follows the
+	 * digests of each node, at most max(k, k_leaf) of them */
+	if (merkle_nodes(options->tree_width, leaves) >
+			(INT64_MAX / options->hash_size - 1) /
+			node_width(options)) {
+		fprintf(stderr, "Hash file for %lu blocks would be larger "
+				"than the largest possible file size.\n", blocks);
+		return EFBIG;
+	}
+	return 0;
+}
+
 /* update the block range options once we know the total block count,
  * returning an error if our arguments are out of range. */
 static int update_range(struct cmd_options *options, uint64_t blocks)
 {
-	if (options->range_to == 0xFFFFFFFF) {
+	if (blocks == 0) {
+		fprintf(stderr, "Input file has no blocks.\n");
+		return ERANGE;
+	} else if (options->range_to == RANGE_ALL) {
 		options->range_to = blocks - 1;
 	} else if (options->range_to >= blocks) {
-		fprintf(stderr, "Upper bound of block range '%u' "
+		fprintf(stderr, "Upper bound of block range '%lu' "
 				"larger than highest block in file '%lu'.\n",
 				options->range_to, blocks - 1);
 		return ERANGE;
 	}
+	return check_size(options, blocks);
+}
+
+/* return the path of a file that lives alongside the hash file, with
+ * the given suffix. the caller must free() it */
+static char* hash_path(const struct cmd_options *options,
+		const char *suffix)
+{
+	char *path = (char*)malloc(strlen(options->hash) + strlen(suffix) + 1);
+	if (path) {
+		strcpy(path, options->hash);
+		strcat(path, suffix);
+	}
+	return path;
+}
+
+/* return the size of the block buffer, which holds a leaf's blocks,
+ * or the largest chunk */
+static size_t buffer_size(const struct cmd_options *options)
+{
+	size_t size = options->leaf_width * options->block_size;
+	if (options->chunk_size &&
+			MERKLE_CHUNK_MAX((size_t)options->chunk_size) > size)
+		size = MERKLE_CHUNK_MAX((size_t)options->chunk_size);
+	return size;
+}
+
+/* close the files of a context and free its buffers and optional
+ * attachments, whichever of them are set up */
+static void context_close(struct merkle_context *context)
+{
+	merkle_chunks_free(context);
+	merkle_unmap_input(context);
+	merkle_unmap(context);
+	merkle_dirty_close(context);
+	merkle_journal_close(context);
+	free(context->node_buffer);
+	free(context->block_buffer);
+	if (context->fd_out != -1)
+		close(context->fd_out);
+	if (context->fd_in != -1)
+		close(context->fd_in);
+}
+
+/* open the input and hash files of a context set up by context_init()
+ * with the given flags, creating them with mode 0600, and allocate its
+ * buffers. when the hash file is writable, the journal is opened too,
+ * replaying any interrupted updates. on failure, the context is closed
+ * again */
+static int context_open(const struct cmd_options *options,
+		struct merkle_context *context, const char *input,
+		int in_flags, const char *hash, int out_flags)
+{
+	size_t size = buffer_size(options);
+	int status;
+
+	context->fd_in = open(input, in_flags, 0600);
+	if (context->fd_in == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open input file "
+				"'%s' with error %d.\n", input, status);
+		goto out_close;
+	}
+
+	context->fd_out = open(hash, out_flags, 0600);
+	if (context->fd_out == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open hash file "
+				"'%s' with error %d.\n", hash, status);
+		goto out_close;
+	}
+
+	/* allocate buffers needed for i/o */
+	context->block_buffer = (unsigned char*)malloc(size);
+	if (context->block_buffer == NULL) {
+		status = errno;
+		fprintf(stderr, "Failed to allocate block buffer "
+				"(%lu bytes) with error %d.\n", size, status);
+		goto out_close;
+	}
+	context->node_buffer = (unsigned char*)malloc(context->node_size);
+	if (context->node_buffer == NULL) {
+		status = errno;
+		fprintf(stderr, "Failed to allocate node buffer "
+				"(%lu bytes) with error %d.\n",
+				context->node_size, status);
+		goto out_close;
+	}
+
+	if (options->journal && (out_flags & O_ACCMODE) != O_RDONLY) {
+		status = merkle_journal_open(context, options->journal);
+		if (status)
+			goto out_close;
+	}
+	return 0;
+
+out_close:
+	context_close(context);
+	return status;
+}
+
+/* get the size of an open file and its number of blocks */
+static int file_blocks(const struct merkle_context *context, int fd,
+		const char *path, uint64_t *total_blocks, off_t *size)
+{
+	struct stat stat;
+	int status;
+
+	if (fstat(fd, &stat) == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to get file size of "
+				"input file '%s' with error %d.\n",
+				path, status);
+		return status;
+	}
+
+	*total_blocks = stat.st_size / context->block_size +
+		(stat.st_size % context->block_size ? 1 : 0);
+	if (size)
+		*size = stat.st_size;
 	return 0;
 }
 
@@ -68,112 +351,715 @@ static int update_range(struct cmd_options *options, uint64_t blocks)
 static int hash_write(struct cmd_options *options)
 {
 	struct merkle_context update;
-	struct stat stat;
 	uint64_t total_blocks;
+	char *checkpoint = NULL, *chunks, *fingerprints;
 	int status;
 
-	update.verbose = options->verbose;
-	update.k = options->tree_width;
-	update.block_size = options->block_size;
-	update.hash_size = options->hash_size;
-	update.node_size = update.k * update.hash_size;
+	context_init(options, &update);
 
-	/* open input file for read */
-	update.fd_in = open(options->source, O_RDONLY);
-	if (update.fd_in == -1) {
+	/* open input file for read, and open/create output file */
+	status = context_open(options, &update, options->source, O_RDONLY,
+			options->hash, O_RDWR | O_CREAT);
+	if (status)
+		return status;
+
+	status = file_blocks(&update, update.fd_in, options->source,
+			&total_blocks, NULL);
+	if (status)
+		goto out;
+
+	/* the tree covers chunks in place of blocks */
+	if (options->chunk_size) {
+		status = merkle_chunk(&update, options->chunk_size,
+				&total_blocks);
+		if (status)
+			goto out;
+	}
+
+	status = update_range(options, total_blocks);
+	if (status)
+		goto out;
+
+	/* checkpoint alongside the hash file. a write that doesn't resume
+	 * starts over, so a checkpoint left by an interrupted write no
+	 * longer describes the tree */
+	checkpoint = hash_path(options, ".checkpoint");
+	if (checkpoint == NULL) {
 		status = errno;
-		fprintf(stderr, "Failed to open input file "
+		goto out;
+	}
+	if (!options->resume && unlink(checkpoint) == -1 && errno != ENOENT) {
+		status = errno;
+		fprintf(stderr, "Failed to remove checkpoint file "
+				"'%s' with error %d.\n", checkpoint, status);
+		goto out;
+	}
+
+	/* map the hash file, expecting a forward traversal when
+	 * updating the whole file */
+	if (options->map) {
+		status = merkle_map(&update, total_blocks,
+				options->range_from == 0 &&
+				options->range_to == total_blocks - 1);
+		if (status)
+			goto out;
+	}
+
+	if (options->map_input) {
+		status = merkle_map_input(&update, 0);
+		if (status)
+			goto out;
+	}
+
+	/* compare with the fingerprints saved by the last write */
+	if (options->fingerprints) {
+		fingerprints = hash_path(options, ".fingerprints");
+		status = fingerprints ? merkle_update_fingerprinted(&update,
+				fingerprints, total_blocks) : errno;
+		free(fingerprints);
+		goto out_update;
+	}
+
+/* start the update traversal. checkpoints follow the depth-first
+	 * block order, so a level-order update runs without them, as does
+	 * a concurrent update that would share them with other writers */
+	if (options->levels || options->concurrent)
+		status = merkle_update(&update, options->range_from,
+				options->range_to, total_blocks);
+	else
+		status = merkle_update_resumable(&update, checkpoint,
+				options->resume, options->range_from,
+				options->range_to, total_blocks);
+
+	/* save the chunks that the tree was hashed over */
+	if (status == 0 && update.chunks) {
+		chunks = hash_path(options, ".chunks");
+		status = chunks ? merkle_chunks_save(&update, chunks) : errno;
+		free(chunks);
+	}
+out_update:
+	if (status) {
+		fprintf(stderr, "hash update failed with error %d.\n",
+				status);
+		goto out;
+	}
+
+	printf("hash update successful\n");
+
+out:
+	free(checkpoint);
+	context_close(&update);
+	return status;
+}
+
+/* truncate the input file and invoke merkle_truncate() to
+ * write an updated hash tree file */
+static int hash_truncate(struct cmd_options *options)
+{
+	struct merkle_context truncate;
+	uint64_t total_blocks, new_size;
+	int status;
+
+	context_init(options, &truncate);
+
+	/* open input and output files for read/write */
+	status = context_open(options, &truncate, options->source, O_RDWR,
+			options->hash, O_RDWR);
+	if (status)
+		return status;
+
+	status = file_blocks(&truncate, truncate.fd_in, options->source,
+			&total_blocks, NULL);
+	if (status)
+		goto out;
+
+	if (options->range_to == RANGE_ALL ||
+			options->range_to == total_blocks - 1) {
+		status = ERANGE;
+		fprintf(stderr, "The truncate operation requires a new last "
+				"block other than %lu, specified in the second "
+				"argument of the -r option.\n", total_blocks - 1);
+		goto out;
+	}
+
+	/* truncate or extend the input file after the given block */
+	if (options->range_to >= INT64_MAX / options->block_size) {
+		status = EFBIG;
+		fprintf(stderr, "The new last block %lu is beyond the largest "
+				"possible file size.\n", options->range_to);
+		goto out;
+	}
+	new_size = (options->range_to + 1) * options->block_size;
+
+	status = check_size(options, options->range_to + 1);
+	if (status)
+		goto out;
+
+	if (ftruncate(truncate.fd_in, new_size) == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to truncate input file "
 				"'%s' with error %d.\n",
 				options->source, status);
 		goto out;
 	}
 
-	/* open/create output file */
-	update.fd_out = open(options->hash, O_RDWR | O_CREAT, 0600);
-	if (update.fd_out == -1) {
+	/* map the hash file at the larger of the two tree sizes */
+	if (options->map) {
+		status = merkle_map(&truncate,
+				total_blocks > options->range_to + 1 ?
+				total_blocks : options->range_to + 1, 0);
+		if (status)
+			goto out;
+	}
+
+	/* start the truncate traversal */
+	status = merkle_resize(&truncate, total_blocks,
+			options->range_to + 1);
+	if (status) {
+		fprintf(stderr, "hash truncate failed with error %d.\n",
+				status);
+		goto out;
+	}
+
+	printf("hash truncate successful\n");
+
+out:
+	context_close(&truncate);
+	return status;
+}
+
+/* read from the input file and invoke merkle_verify() to
+ * compare the generated hashes with the hash tree file */
+static int hash_verify(struct cmd_options *options)
+{
+	struct merkle_context verify;
+	uint64_t total_blocks;
+	struct merkle_range range;
+	char *chunks;
+	off_t size;
+	int status;
+
+	context_init(options, &verify);
+
+	/* open input and output files for read */
+	status = context_open(options, &verify, options->source, O_RDONLY,
+			options->hash, O_RDONLY);
+	if (status)
+		return status;
+
+	status = file_blocks(&verify, verify.fd_in, options->source,
+			&total_blocks, &size);
+	if (status)
+		goto out;
+
+	/* verify the chunks that the tree was written over, mapping the
+	 * block range to the chunks that hold it */
+	if (options->chunk_size) {
+		chunks = hash_path(options, ".chunks");
+		if (chunks == NULL) {
+			status = errno;
+			goto out;
+		}
+		status = merkle_chunks_load(&verify, chunks,
+				options->chunk_size, &total_blocks);
+		free(chunks);
+		if (status)
+			goto out;
+
+		if (options->range_to != RANGE_ALL) {
+			if (options->range_to >= INT64_MAX / verify.block_size ||
+					(options->range_to + 1) * verify.block_size >
+					(uint64_t)size) {
+				status = ERANGE;
+				fprintf(stderr, "Upper bound of block range '%lu' "
+						"is past the end of the file.\n",
+						options->range_to);
+				goto out;
+			}
+			merkle_chunk_range(&verify,
+					options->range_from * verify.block_size,
+					(options->range_to + 1) * verify.block_size - 1,
+					&range);
+			options->range_from = range.from_block;
+			options->range_to = range.to_block;
+		}
+	}
+
+	status = update_range(options, total_blocks);
+	if (status)
+		goto out;
+
+	if (options->map) {
+		status = merkle_map(&verify, total_blocks,
+				options->range_from == 0 &&
+				options->range_to == total_blocks - 1);
+		if (status)
+			goto out;
+	}
+
+	if (options->map_input) {
+		status = merkle_map_input(&verify, 0);
+		if (status)
+			goto out;
+	}
+
+	/* start the verification traversal */
+	status = merkle_verify(&verify, options->range_from,
+			options->range_to, total_blocks);
+	if (status) {
+		fprintf(stderr, "hash verification failed with error %d.\n",
+				status);
+		goto out;
+	}
+
+	printf("hash verification successful\n");
+
+out:
+	context_close(&verify);
+	return status;
+}
+
+/* print a range of differing blocks for merkle_diff() */
+static int print_range(uint64_t from_block, uint64_t to_block, void *user)
+{
+	printf("%lu %lu\n", from_block, to_block);
+	return 0;
+}
+
+/* open both hash files and invoke merkle_diff() to print the
+ * ranges of blocks whose hashes differ */
+static int hash_diff(struct cmd_options *options)
+{
+	struct merkle_context diff;
+	struct stat stat, stat_other;
+	uint64_t total_blocks;
+	int fd_other;
+	int status;
+
+	context_init(options, &diff);
+
+	/* open the first hash file for read */
+	diff.fd_out = open(options->source, O_RDONLY);
+	if (diff.fd_out == -1) {
 		status = errno;
 		fprintf(stderr, "Failed to open hash file "
+				"'%s' with error %d.\n",
+				options->source, status);
+		goto out;
+	}
+
+	/* open the second hash file for read */
+	fd_other = open(options->hash, O_RDONLY);
+	if (fd_other == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open hash file "
+				"'%s' with error %d.\n",
+				options->hash, status);
+		goto out_close_out;
+	}
+
+	/* get the hash file sizes */
+	if (fstat(diff.fd_out, &stat) == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to get file size of "
+				"hash file '%s' with error %d.\n",
+				options->source, status);
+		goto out_close_other;
+	}
+	if (fstat(fd_other, &stat_other) == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to get file size of "
+				"hash file '%s' with error %d.\n",
+				options->hash, status);
+		goto out_close_other;
+	}
+
+	/* trees of different sizes don't share their node indices */
+	if (stat.st_size != stat_other.st_size) {
+		status = EINVAL;
+		fprintf(stderr, "Hash files '%s' and '%s' have different "
+				"sizes, so they cover different block counts.\n",
+				options->source, options->hash);
+		goto out_close_other;
+	}
+
+	total_blocks = merkle_hash_blocks(diff.k_leaf, diff.k,
+			diff.hash_size, stat.st_size);
+	if (total_blocks == 0) {
+		status = EINVAL;
+		fprintf(stderr, "Hash file '%s' size %lu does not match "
+				"the given -k, -K and -h parameters.\n",
+				options->source, stat.st_size);
+		goto out_close_other;
+	}
+
+	status = update_range(options, total_blocks);
+	if (status)
+		goto out_close_other;
+
+	/* start the diff traversal */
+	status = merkle_diff(&diff, fd_other, options->range_from,
+			options->range_to, total_blocks, print_range, NULL);
+	if (status)
+		fprintf(stderr, "hash diff failed with error %d.\n",
+				status);
+
+out_close_other:
+	close(fd_other);
+out_close_out:
+	close(diff.fd_out);
+out:
+	return status;
+}
+
+/* invoke merkle_repair() to bring the target file and hash tree
+ * up to date with the source file and hash tree */
+static int hash_repair(struct cmd_options *options)
+{
+	struct merkle_context repair;
+	uint64_t total_blocks;
+	int fd_source, fd_source_hash;
+	int status;
+
+	context_init(options, &repair);
+
+	/* open source files for read */
+	fd_source = open(options->source, O_RDONLY);
+	if (fd_source == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open source file "
+				"'%s' with error %d.\n",
+				options->source, status);
+		goto out;
+	}
+	fd_source_hash = open(options->hash, O_RDONLY);
+	if (fd_source_hash == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open source hash file "
 				"'%s' with error %d.\n",
 				options->hash, status);
+		goto out_close_source;
+	}
+
+	/* open/create target files for read/write. verifying the repaired
+	 * blocks reads a whole leaf of them at once */
+	status = context_open(options, &repair, options->target,
+			O_RDWR | O_CREAT, options->target_hash, O_RDWR | O_CREAT);
+	if (status)
+		goto out_close_source_hash;
+
+	status = file_blocks(&repair, fd_source, options->source,
+			&total_blocks, NULL);
+	if (status)
+		goto out_close;
+
+	/* start the repair traversal */
+	status = merkle_repair(&repair, fd_source, fd_source_hash,
+			total_blocks);
+	if (status) {
+		fprintf(stderr, "hash repair failed with error %d.\n",
+				status);
+		goto out_close;
+	}
+
+	printf("hash repair successful\n");
+
+out_close:
+	context_close(&repair);
+out_close_source_hash:
+	close(fd_source_hash);
+out_close_source:
+	close(fd_source);
+out:
+	return status;
+}
+
+/* append the blocks in the requested range to the dirty block log
+ * with merkle_mark_dirty() */
+static int hash_mark(struct cmd_options *options)
+{
+	struct merkle_context mark;
+	struct stat stat;
+	uint64_t total_blocks, block;
+	char *path;
+	int status;
+
+	context_init(options, &mark);
+
+	/* open input file for its size */
+	mark.fd_in = open(options->source, O_RDONLY);
+	if (mark.fd_in == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open input file "
+				"'%s' with error %d.\n",
+				options->source, status);
+		goto out;
+	}
+
+	/* get the input file size */
+	if (fstat(mark.fd_in, &stat) == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to get file size of "
+				"input file '%s' with error %d.\n",
+				options->source, status);
 		goto out_close_in;
 	}
 
-	/* allocate buffers needed for i/o */
-	update.block_buffer = (unsigned char*)malloc(update.block_size);
-	if (update.block_buffer == NULL) {
+	total_blocks = stat.st_size / mark.block_size +
+		(stat.st_size % mark.block_size ? 1 : 0);
+
+	status = update_range(options, total_blocks);
+	if (status)
+		goto out_close_in;
+
+	/* open the log alongside the hash file, without automatic
+	 * flushes */
+	path = hash_path(options, ".dirty");
+	if (path == NULL) {
 		status = errno;
-		fprintf(stderr, "Failed to allocate block buffer "
-				"(%lu bytes) with error %d.\n",
-				update.block_size, status);
-		goto out_close_out;
+		goto out_close_in;
 	}
-	update.node_buffer = (unsigned char*)malloc(update.node_size);
-	if (update.node_buffer == NULL) {
+	status = merkle_dirty_open(&mark, path, 0, 0);
+	free(path);
+	if (status)
+		goto out_close_in;
+
+	for (block = options->range_from; block <= options->range_to; block++) {
+		status = merkle_mark_dirty(&mark, block, total_blocks);
+		if (status) {
+			fprintf(stderr, "hash mark failed with error %d.\n",
+					status);
+			goto out_close_dirty;
+		}
+	}
+
+	printf("hash mark successful\n");
+
+out_close_dirty:
+	merkle_dirty_close(&mark);
+out_close_in:
+	close(mark.fd_in);
+out:
+	return status;
+}
+
+/* read from the input file and invoke merkle_flush() to update the
+ * hashes of the blocks in the dirty block log */
+static int hash_flush(struct cmd_options *options)
+{
+	struct merkle_context flush;
+	uint64_t total_blocks;
+	char *path;
+	int status;
+
+	context_init(options, &flush);
+	flush.levels = 0;
+
+	/* open input file for read, and open/create output file */
+	status = context_open(options, &flush, options->source, O_RDONLY,
+			options->hash, O_RDWR | O_CREAT);
+	if (status)
+		return status;
+
+	status = file_blocks(&flush, flush.fd_in, options->source,
+			&total_blocks, NULL);
+	if (status)
+		goto out;
+
+	status = update_range(options, total_blocks);
+	if (status)
+		goto out;
+
+	path = hash_path(options, ".dirty");
+	if (path == NULL) {
 		status = errno;
-		fprintf(stderr, "Failed to allocate node buffer "
-				"(%lu bytes) with error %d.\n",
-				update.node_size, status);
-		goto out_free_block;
+		goto out;
+	}
+	status = merkle_dirty_open(&flush, path, 0, 0);
+	free(path);
+	if (status)
+		goto out;
+
+	status = merkle_flush(&flush, total_blocks);
+	if (status) {
+		fprintf(stderr, "hash flush failed with error %d.\n",
+				status);
+		goto out;
 	}
 
-	/* get the input file size */
-	if (fstat(update.fd_in, &stat) == -1) {
-		status = errno;
-		fprintf(stderr, "Failed to get file size of "
-				"input file '%s' with error %d.\n",
-				options->source, status);
-		goto out_free_node;
+	printf("hash flush successful\n");
+
+out:
+	context_close(&flush);
+	return status;
+}
+
+
+/* invoke merkle_watch() to keep the hash tree up to date with changes
+ * to the input file */
+static int hash_watch(struct cmd_options *options)
+{
+	struct merkle_context watch;
+	int status;
+
+	context_init(options, &watch);
+	watch.levels = 0;
+
+	/* open input file for read, and open/create output file */
+	status = context_open(options, &watch, options->source, O_RDONLY,
+			options->hash, O_RDWR | O_CREAT);
+	if (status)
+		return status;
+
+	/* run until the input file is removed */
+	status = merkle_watch(&watch, options->source);
+	if (status) {
+		fprintf(stderr, "hash watch failed with error %d.\n",
+				status);
+		goto out;
+	}
+
+	printf("hash watch successful\n");
+
+out:
+	context_close(&watch);
+	return status;
+}
+
+/* invoke merkle_batch() on the entries of the manifest file */
+static int hash_batch(struct cmd_options *options)
+{
+	struct merkle_context batch;
+	long threads = options->threads;
+	int status;
+
+	context_init(options, &batch);
+	batch.levels = 0;
+	batch.concurrent = 0;
+
+	if (threads == 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+
+	status = merkle_batch(&batch, options->source, threads);
+	if (status) {
+		fprintf(stderr, "hash batch failed with error %d.\n", status);
+		return status;
+	}
+
+	printf("hash batch successful\n");
+	return 0;
+}
+
+/* invoke merkle_forest() on the input directory, and print the
+ * forest root checksum */
+static int hash_forest(struct cmd_options *options)
+{
+	struct merkle_context forest;
+	unsigned char root[20];
+	long threads = options->threads;
+	unsigned i;
+	int status;
+
+	context_init(options, &forest);
+	forest.concurrent = 0;
+
+	if (threads == 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+
+	status = merkle_forest(&forest, options->source, options->hash,
+			threads, root);
+	if (status) {
+		fprintf(stderr, "hash forest failed with error %d.\n", status);
+		return status;
 	}
 
-	total_blocks = stat.st_size / update.block_size +
-		(stat.st_size % update.block_size ? 1 : 0);
+	printf("forest root ");
+	for (i = 0; i < forest.hash_size; i++)
+		printf("%02x", root[i]);
+	printf("\nhash forest successful\n");
+	return 0;
+}
+
+/* invoke merkle_scrub() to verify the input file within the given
+ * budgets */
+static int hash_scrub(struct cmd_options *options)
+{
+	struct merkle_context scrub;
+	char *cursor;
+	int status;
+
+	context_init(options, &scrub);
+	scrub.levels = 0;
+	scrub.concurrent = 0;
 
-	status = update_range(options, total_blocks);
+	/* open input and output files for read */
+	status = context_open(options, &scrub, options->source, O_RDONLY,
+			options->hash, O_RDONLY);
 	if (status)
-		goto out_free_node;
+		return status;
 
-	/* start the update traversal */
-	status = merkle_update(&update, options->range_from,
-			options->range_to, total_blocks);
+	/* the cursor lives alongside the hash file */
+	cursor = hash_path(options, ".scrub");
+	if (cursor == NULL) {
+		status = errno;
+		goto out;
+	}
+
+	status = merkle_scrub(&scrub, cursor, options->rate, options->iops,
+			options->period, options->idle);
+	free(cursor);
 	if (status) {
-		fprintf(stderr, "hash update failed with error %d.\n",
+		fprintf(stderr, "hash scrub failed with error %d.\n",
 				status);
-		goto out_free_node;
+		goto out;
 	}
 
-	printf("hash update successful\n");
+	printf("hash scrub successful\n");
 
-out_free_node:
-	free(update.node_buffer);
-out_free_block:
-	free(update.block_buffer);
-out_close_out:
-	close(update.fd_out);
-out_close_in:
-	close(update.fd_in);
 out:
+	context_close(&scrub);
 	return status;
 }
 
-/* truncate the input file and invoke merkle_truncate() to
- * write an updated hash tree file */
-static int hash_truncate(struct cmd_options *options)
+/* parse a 64-bit block number, returning nonzero if it's invalid */
+static int parse_block(const char *arg, uint64_t *block)
 {
-	struct merkle_context truncate;
+	char *end;
+
+	if (arg[0] < '0' || arg[0] > '9')
+		return -1;
+
+	errno = 0;
+	*block = strtoull(arg, &end, 10);
+	if (errno || *end || *block == RANGE_ALL)
+		return -1;
+	return 0;
+}
+
+/* read from the input file and invoke merkle_commit() to write a new
+ * version of the tree to the node store */
+static int hash_commit(struct cmd_options *options)
+{
+	struct merkle_context commit;
+	struct merkle_store *store;
+	struct merkle_range range;
+	unsigned char root[20];
 	struct stat stat;
-	uint64_t total_blocks, new_size;
+	uint64_t total_blocks, version;
+	unsigned i;
 	int status;
 
-	truncate.verbose = options->verbose;
-	truncate.k = options->tree_width;
-	truncate.block_size = options->block_size;
-	truncate.hash_size = options->hash_size;
-	truncate.node_size = truncate.k * truncate.hash_size;
-	truncate.partial = 0;
+	context_init(options, &commit);
+	commit.levels = 0;
+	commit.concurrent = 0;
 
-	/* open input file for read/write */
-	truncate.fd_in = open(options->source, O_RDWR);
-	if (truncate.fd_in == -1) {
+	/* open input file for read */
+	commit.fd_in = open(options->source, O_RDONLY);
+	if (commit.fd_in == -1) {
 		status = errno;
 		fprintf(stderr, "Failed to open input file "
 				"'%s' with error %d.\n",
@@ -181,179 +1067,207 @@ static int hash_truncate(struct cmd_options *options)
 		goto out;
 	}
 
-	/* open output file for read/write */
-	truncate.fd_out = open(options->hash, O_RDWR);
-	if (truncate.fd_out == -1) {
+	/* open/create the node store */
+	commit.fd_out = open(options->hash, O_RDWR | O_CREAT, 0600);
+	if (commit.fd_out == -1) {
 		status = errno;
-		fprintf(stderr, "Failed to open hash file "
+		fprintf(stderr, "Failed to open store file "
 				"'%s' with error %d.\n",
 				options->hash, status);
 		goto out_close_in;
 	}
 
-	/* allocate buffers needed for i/o */
-	truncate.block_buffer = (unsigned char*)malloc(truncate.block_size);
-	if (truncate.block_buffer == NULL) {
+	/* allocate the buffer for reading blocks */
+	commit.block_buffer = (unsigned char*)malloc(commit.k_leaf *
+			commit.block_size);
+	if (commit.block_buffer == NULL) {
 		status = errno;
 		fprintf(stderr, "Failed to allocate block buffer "
 				"(%lu bytes) with error %d.\n",
-				truncate.block_size, status);
+				commit.k_leaf * commit.block_size, status);
 		goto out_close_out;
 	}
-	truncate.node_buffer = (unsigned char*)malloc(truncate.node_size);
-	if (truncate.node_buffer == NULL) {
-		status = errno;
-		fprintf(stderr, "Failed to allocate node buffer "
-				"(%lu bytes) with error %d.\n",
-				truncate.node_size, status);
-		goto out_free_block;
-	}
 
 	/* get the input file size */
-	if (fstat(truncate.fd_in, &stat) == -1) {
+	if (fstat(commit.fd_in, &stat) == -1) {
 		status = errno;
 		fprintf(stderr, "Failed to get file size of "
 				"input file '%s' with error %d.\n",
 				options->source, status);
-		goto out_free_node;
+		goto out_free_block;
 	}
 
-	total_blocks = stat.st_size / truncate.block_size +
-		(stat.st_size % truncate.block_size ? 1 : 0);
-
-	if (options->range_to >= total_blocks - 1) {
-		status = ERANGE;
-		fprintf(stderr, "The truncate operation requires a new last "
-				"block smaller than %lu, specified in the second "
-				"argument of the -r option.\n", total_blocks - 1);
-		goto out_free_node;
-	}
+	total_blocks = stat.st_size / commit.block_size +
+		(stat.st_size % commit.block_size ? 1 : 0);
 
-	/* truncate the input file after the given block */
-	new_size = (options->range_to + 1) * options->block_size;
+	status = update_range(options, total_blocks);
+	if (status)
+		goto out_free_block;
 
-	if (ftruncate(truncate.fd_in, new_size) == -1) {
-		status = errno;
-		fprintf(stderr, "Failed to truncate input file "
-				"'%s' with error %d.\n",
-				options->source, status);
-		goto out_free_node;
+	if (options->map_input) {
+		status = merkle_map_input(&commit, 0);
+		if (status)
+			goto out_free_block;
 	}
 
-	/* start the truncate traversal */
-	status = merkle_truncate(&truncate, options->range_to);
+	status = merkle_store_open(&commit, &store);
+	if (status)
+		goto out_unmap;
+
+	range.from_block = options->range_from;
+	range.to_block = options->range_to;
+	status = merkle_commit(&commit, store, &range, 1,
+			total_blocks, &version);
+	if (status == 0)
+		status = merkle_store_version(store, version, &version,
+				&total_blocks, root);
 	if (status) {
-		fprintf(stderr, "hash truncate failed with error %d.\n",
+		fprintf(stderr, "hash commit failed with error %d.\n",
 				status);
-		goto out_free_node;
+		goto out_close_store;
 	}
 
-	printf("hash truncate successful\n");
+	printf("version %lu root ", version);
+	for (i = 0; i < commit.hash_size; i++)
+		printf("%02x", root[i]);
+	printf("\nhash commit successful\n");
 
-out_free_node:
-	free(truncate.node_buffer);
+out_close_store:
+	merkle_store_close(store);
+out_unmap:
+	merkle_unmap_input(&commit);
 out_free_block:
-	free(truncate.block_buffer);
+	free(commit.block_buffer);
 out_close_out:
-	close(truncate.fd_out);
+	close(commit.fd_out);
 out_close_in:
-	close(truncate.fd_in);
+	close(commit.fd_in);
 out:
 	return status;
 }
 
-/* read from the input file and invoke merkle_verify() to
- * compare the generated hashes with the hash tree file */
-static int hash_verify(struct cmd_options *options)
+/* open the node store and invoke merkle_snapdiff() to print the
+ * ranges of blocks whose hashes differ between two versions */
+static int hash_snapdiff(struct cmd_options *options)
 {
-	struct merkle_context verify;
-	struct stat stat;
-	uint64_t total_blocks;
+	struct merkle_context diff;
+	struct merkle_store *store;
+	uint64_t first, second;
 	int status;
 
-	verify.verbose = options->verbose;
-	verify.k = options->tree_width;
-	verify.block_size = options->block_size;
-	verify.hash_size = options->hash_size;
-	verify.node_size = verify.k * verify.hash_size;
+	context_init(options, &diff);
+	diff.levels = 0;
+	diff.concurrent = 0;
 
-	/* open input file for read */
-	verify.fd_in = open(options->source, O_RDONLY);
-	if (verify.fd_in == -1) {
-		status = errno;
-		fprintf(stderr, "Failed to open input file "
-				"'%s' with error %d.\n",
-				options->source, status);
-		goto out;
+	if (parse_block(options->hash, &first) ||
+			parse_block(options->target, &second)) {
+		fprintf(stderr, "Invalid versions: %s and %s.\n",
+				options->hash, options->target);
+		return EINVAL;
 	}
 
-	/* open output file for read */
-	verify.fd_out = open(options->hash, O_RDONLY);
-	if (verify.fd_out == -1) {
+	/* open the node store for read */
+	diff.fd_out = open(options->source, O_RDONLY);
+	if (diff.fd_out == -1) {
 		status = errno;
-		fprintf(stderr, "Failed to open hash file "
+		fprintf(stderr, "Failed to open store file "
 				"'%s' with error %d.\n",
-				options->hash, status);
-		goto out_close_in;
+				options->source, status);
+		goto out;
 	}
 
-	/* allocate buffers needed for i/o */
-	verify.block_buffer = (unsigned char*)malloc(verify.block_size);
-	if (verify.block_buffer == NULL) {
-		status = errno;
-		fprintf(stderr, "Failed to allocate block buffer "
-				"(%lu bytes) with error %d.\n",
-				verify.block_size, status);
+	status = merkle_store_open(&diff, &store);
+	if (status)
 		goto out_close_out;
-	}
-	verify.node_buffer = (unsigned char*)malloc(verify.node_size);
-	if (verify.node_buffer == NULL) {
-		status = errno;
-		fprintf(stderr, "Failed to allocate node buffer "
-				"(%lu bytes) with error %d.\n",
-				verify.node_size, status);
-		goto out_free_block;
+
+	status = merkle_snapdiff(&diff, store, first, second,
+			print_range, NULL);
+	if (status)
+		fprintf(stderr, "hash snapdiff failed with error %d.\n",
+				status);
+
+	merkle_store_close(store);
+out_close_out:
+	close(diff.fd_out);
+out:
+	return status;
+}
+
+/* invoke merkle_compact() to remove the versions of the node store
+ * older than the given version */
+static int hash_compact(struct cmd_options *options)
+{
+	struct merkle_context compact;
+	struct merkle_store *store;
+	uint64_t oldest;
+	int status;
+
+	context_init(options, &compact);
+	compact.levels = 0;
+	compact.concurrent = 0;
+
+	if (parse_block(options->hash, &oldest)) {
+		fprintf(stderr, "Invalid version '%s'.\n", options->hash);
+		return EINVAL;
 	}
 
-	/* get the input file size */
-	if (fstat(verify.fd_in, &stat) == -1) {
+	/* open the node store for read and write */
+	compact.fd_out = open(options->source, O_RDWR);
+	if (compact.fd_out == -1) {
 		status = errno;
-		fprintf(stderr, "Failed to get file size of "
-				"input file '%s' with error %d.\n",
+		fprintf(stderr, "Failed to open store file "
+				"'%s' with error %d.\n",
 				options->source, status);
-		goto out_free_node;
+		goto out;
 	}
 
-	total_blocks = stat.st_size / verify.block_size +
-		(stat.st_size % verify.block_size ? 1 : 0);
-
-	status = update_range(options, total_blocks);
+	status = merkle_store_open(&compact, &store);
 	if (status)
-		goto out_free_node;
+		goto out_close_out;
 
-	/* start the verification traversal */
-	status = merkle_verify(&verify, options->range_from,
-			options->range_to, total_blocks);
-	if (status) {
-		fprintf(stderr, "hash verification failed with error %d.\n",
+	status = merkle_compact(&compact, store, options->source, oldest);
+	if (status)
+		fprintf(stderr, "hash compact failed with error %d.\n",
 				status);
-		goto out_free_node;
-	}
-
-	printf("hash verification successful\n");
+	else
+		printf("hash compact successful\n");
 
-out_free_node:
-	free(verify.node_buffer);
-out_free_block:
-	free(verify.block_buffer);
+	merkle_store_close(store);
 out_close_out:
-	close(verify.fd_out);
-out_close_in:
-	close(verify.fd_in);
+	close(compact.fd_out);
 out:
 	return status;
 }
 
+/* multipliers for the suffixes of parse_scaled() */
+static const uint64_t size_scales[] = { 1 << 10, 1 << 20, 1 << 30 };
+static const uint64_t period_scales[] = { 1, 60, 3600, 86400 };
+
+/* parse a nonzero number with an optional suffix from the given list,
+ * which multiplies it by the matching scale */
+static int parse_scaled(const char *arg, const char *suffixes,
+		const uint64_t *scales, uint64_t *value)
+{
+	const char *suffix;
+	char *end;
+
+	if (arg[0] < '0' || arg[0] > '9')
+		return -1;
+
+	errno = 0;
+	*value = strtoull(arg, &end, 10);
+	if (errno || *value == 0)
+		return -1;
+	if (*end == 0)
+		return 0;
+
+	suffix = strchr(suffixes, *end);
+	if (suffix == NULL || end[1] ||
+			*value > UINT64_MAX / scales[suffix - suffixes])
+		return -1;
+	*value *= scales[suffix - suffixes];
+	return 0;
+}
 
 /* parse command line options */
 int parse(struct cmd_options *options, int argc, char *argv[])
@@ -367,7 +1281,18 @@ int parse(struct cmd_options *options, int argc, char *argv[])
 	options->operation = argv[0];
 	if (strcmp(options->operation, "write") &&
 			strcmp(options->operation, "truncate") &&
-			strcmp(options->operation, "verify")) {
+			strcmp(options->operation, "verify") &&
+			strcmp(options->operation, "diff") &&
+			strcmp(options->operation, "repair") &&
+			strcmp(options->operation, "mark") &&
+			strcmp(options->operation, "flush") &&
+			strcmp(options->operation, "watch") &&
+			strcmp(options->operation, "batch") &&
+			strcmp(options->operation, "forest") &&
+			strcmp(options->operation, "commit") &&
+			strcmp(options->operation, "snapdiff") &&
+			strcmp(options->operation, "compact") &&
+			strcmp(options->operation, "scrub")) {
 		fprintf(stderr, "Unknown operation '%s'.\n", options->operation);
 		return -1;
 	}
@@ -387,6 +1312,29 @@ int parse(struct cmd_options *options, int argc, char *argv[])
 			}
 			argc -= 2;
 			argv += 2;
+		} else if (strcmp(argv[0], "-C") == 0) {
+			if (argc < 2) {
+				fprintf(stderr, "Option -C missing argument.\n");
+				return -1;
+			}
+			options->chunk_size = atoi(argv[1]);
+			if (options->chunk_size < 256 ||
+					options->chunk_size > (1 << 22) ||
+					(options->chunk_size & (options->chunk_size - 1))) {
+				fprintf(stderr, "Invalid chunk size '%s': not a "
+						"power of 2 between 256 and 4M.\n", argv[1]);
+				return -1;
+			}
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[0], "-c") == 0) {
+			options->concurrent = 1;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[0], "-F") == 0) {
+			options->fingerprints = 1;
+			argc--;
+			argv++;
 		} else if (strcmp(argv[0], "-h") == 0) {
 			if (argc < 2) {
 				fprintf(stderr, "Option -h missing argument.\n");
@@ -403,6 +1351,14 @@ int parse(struct cmd_options *options, int argc, char *argv[])
 			}
 			argc -= 2;
 			argv += 2;
+		} else if (strcmp(argv[0], "-j") == 0) {
+			if (argc < 2) {
+				fprintf(stderr, "Option -j missing argument.\n");
+				return -1;
+			}
+			options->journal = argv[1];
+			argc -= 2;
+			argv += 2;
 		} else if (strcmp(argv[0], "-k") == 0) {
 			if (argc < 2) {
 				fprintf(stderr, "Option -k missing argument.\n");
@@ -419,20 +1375,108 @@ int parse(struct cmd_options *options, int argc, char *argv[])
 			}
 			argc -= 2;
 			argv += 2;
+		} else if (strcmp(argv[0], "-K") == 0) {
+			if (argc < 2) {
+				fprintf(stderr, "Option -K missing argument.\n");
+				return -1;
+			}
+			options->leaf_width = atoi(argv[1]);
+			if (options->leaf_width != 2 && options->leaf_width != 4 &&
+					options->leaf_width != 8 && options->leaf_width != 16 &&
+					options->leaf_width != 32 && options->leaf_width != 64 &&
+					options->leaf_width != 128) {
+				fprintf(stderr, "Invalid value for k_leaf='%s': not a "
+						"power of 2 between 2 and 128.\n", argv[1]);
+				return -1;
+			}
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[0], "-l") == 0) {
+			options->levels = 1;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[0], "-L") == 0) {
+			options->blocked = 1;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[0], "-m") == 0) {
+			options->map = 1;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[0], "-M") == 0) {
+			options->map_input = 1;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[0], "-I") == 0) {
+			if (argc < 2) {
+				fprintf(stderr, "Option -I missing argument.\n");
+				return -1;
+			}
+			options->iops = atoi(argv[1]);
+			if (options->iops == 0) {
+				fprintf(stderr, "Invalid read rate '%s'.\n", argv[1]);
+				return -1;
+			}
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[0], "--idle") == 0) {
+			options->idle = 1;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[0], "-p") == 0) {
+			if (argc < 2) {
+				fprintf(stderr, "Option -p missing argument.\n");
+				return -1;
+			}
+			if (parse_scaled(argv[1], "smhd", period_scales,
+						&options->period)) {
+				fprintf(stderr, "Invalid period '%s'.\n", argv[1]);
+				return -1;
+			}
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[0], "-R") == 0) {
+			if (argc < 2) {
+				fprintf(stderr, "Option -R missing argument.\n");
+				return -1;
+			}
+			if (parse_scaled(argv[1], "KMG", size_scales,
+						&options->rate)) {
+				fprintf(stderr, "Invalid byte rate '%s'.\n", argv[1]);
+				return -1;
+			}
+			argc -= 2;
+			argv += 2;
 		} else if (strcmp(argv[0], "-r") == 0) {
 			if (argc < 3) {
 				fprintf(stderr, "Option -r missing arguments.\n");
 				return -1;
 			}
-			options->range_from = atoi(argv[1]);
-			options->range_to = atoi(argv[2]);
-			if (options->range_from >= options->range_to) {
+			if (parse_block(argv[1], &options->range_from) ||
+					parse_block(argv[2], &options->range_to) ||
+					options->range_from >= options->range_to) {
 				fprintf(stderr, "Invalid block range: %s to %s.\n",
 						argv[1], argv[2]);
 				return -1;
 			}
 			argc -= 3;
 			argv += 3;
+		} else if (strcmp(argv[0], "-t") == 0) {
+			if (argc < 2) {
+				fprintf(stderr, "Option -t missing argument.\n");
+				return -1;
+			}
+			options->threads = atoi(argv[1]);
+			if (options->threads == 0) {
+				fprintf(stderr, "Invalid thread count '%s'.\n", argv[1]);
+				return -1;
+			}
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[0], "--resume") == 0) {
+			options->resume = 1;
+			argc--;
+			argv++;
 		} else if (strcmp(argv[0], "-v") == 0) {
 			options->verbose = 1;
 			argc--;
@@ -444,6 +1488,61 @@ int parse(struct cmd_options *options, int argc, char *argv[])
 		}
 	}
 
+	/* leaves are as wide as the nodes above them unless given */
+	if (options->leaf_width == 0)
+		options->leaf_width = options->tree_width;
+
+	/* journal writes are buffered separately from the mapping */
+	if (options->map && options->journal) {
+		fprintf(stderr, "Options -m and -j can't be used together.\n");
+		return -1;
+	}
+
+	/* journal writes aren't visible to other writers until commit,
+	 * and writers would share a single checkpoint file */
+	if (options->concurrent && (options->journal || options->resume)) {
+		fprintf(stderr, "Option -c can't be used with -j or "
+				"--resume.\n");
+		return -1;
+	}
+
+	/* chunks are only found by hashing the whole file, and only
+	 * write and verify hash the input file */
+	if (options->chunk_size && strcmp(options->operation, "verify") &&
+			(strcmp(options->operation, "write") ||
+			 options->range_to != RANGE_ALL)) {
+		fprintf(stderr, "Option -C can only be used with write of the "
+				"whole file, or verify.\n");
+		return -1;
+	}
+
+	/* fingerprints are compared over the whole file, in place of
+	 * the traversal that checkpoints follow */
+	if (options->fingerprints && (strcmp(options->operation, "write") ||
+				options->range_to != RANGE_ALL ||
+				options->chunk_size || options->resume)) {
+		fprintf(stderr, "Option -F can only be used with write of the "
+				"whole file, without -C or --resume.\n");
+		return -1;
+	}
+
+	/* checkpoints rely on the depth-first block order */
+	if (options->levels && options->resume) {
+		fprintf(stderr, "Options -l and --resume can't be used "
+				"together.\n");
+		return -1;
+	}
+
+	/* batch takes its files from the manifest */
+	if (strcmp(options->operation, "batch") == 0) {
+		if (argc < 1) {
+			fprintf(stderr, "Missing argument for manifest file.\n");
+			return -1;
+		}
+		options->source = argv[0];
+		return 0;
+	}
+
 	if (argc < 1) {
 		fprintf(stderr, "Missing argument for input file.\n");
 		return -1;
@@ -455,20 +1554,61 @@ int parse(struct cmd_options *options, int argc, char *argv[])
 		return -1;
 	}
 	options->hash = argv[1];
+
+	if (strcmp(options->operation, "snapdiff") == 0) {
+		if (argc < 3) {
+			fprintf(stderr, "Missing argument for second version.\n");
+			return -1;
+		}
+		options->target = argv[2];
+		return 0;
+	}
+
+	if (strcmp(options->operation, "repair"))
+		return 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "Missing argument for target file.\n");
+		return -1;
+	}
+	options->target = argv[2];
+
+	if (argc < 4) {
+		fprintf(stderr, "Missing argument for target hash file.\n");
+		return -1;
+	}
+	options->target_hash = argv[3];
 	return 0;
 }
 
 int main(int argc, char *argv[])
 {
 	struct cmd_options options = {
+		NULL,
+		NULL,
+		NULL,
 		NULL,
 		NULL,
 		NULL,
 		4096,
 		0,
-		0xFFFFFFFF,
+		RANGE_ALL,
 		20,
 		4,
+		0,
+		0,
+		0,
+		0,
+		0,
+		0,
+		0,
+		0,
+		0,
+		0,
+		0,
+		0,
+		0,
+		0,
 		0
 	};
 	if (parse(&options, argc, argv) == 0) {
@@ -480,6 +1620,39 @@ int main(int argc, char *argv[])
 
 		if (strcmp(options.operation, "verify") == 0)
 			return hash_verify(&options);
+
+		if (strcmp(options.operation, "diff") == 0)
+			return hash_diff(&options);
+
+		if (strcmp(options.operation, "repair") == 0)
+			return hash_repair(&options);
+
+		if (strcmp(options.operation, "mark") == 0)
+			return hash_mark(&options);
+
+		if (strcmp(options.operation, "flush") == 0)
+			return hash_flush(&options);
+
+		if (strcmp(options.operation, "watch") == 0)
+			return hash_watch(&options);
+
+		if (strcmp(options.operation, "batch") == 0)
+			return hash_batch(&options);
+
+		if (strcmp(options.operation, "forest") == 0)
+			return hash_forest(&options);
+
+		if (strcmp(options.operation, "commit") == 0)
+			return hash_commit(&options);
+
+		if (strcmp(options.operation, "snapdiff") == 0)
+			return hash_snapdiff(&options);
+
+		if (strcmp(options.operation, "compact") == 0)
+			return hash_compact(&options);
+
+		if (strcmp(options.operation, "scrub") == 0)
+			return hash_scrub(&options);
 	}
 	return usage(argv[0]);
 }
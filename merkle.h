@@ -5,22 +5,111 @@
 #include <stdint.h>
 
 
+/* from journal.c */
+struct merkle_journal;
+
+/* from map.c */
+struct merkle_map;
+struct merkle_window;
+
+/* from dirty.c */
+struct merkle_dirty;
+
+/* from store.c */
+struct merkle_store;
+
+/* from chunk.c */
+struct merkle_chunks;
+
+/* from visitor.c */
+struct merkle_stack;
+
+/* from session.c */
+struct merkle_session;
+
+/* from async.c */
+struct merkle_async;
+struct merkle_async_handle;
+
+/* a range of blocks from from_block through to_block */
+struct merkle_range {
+	uint64_t from_block, to_block;
+};
+
 /* context passed as argument to merkle tree operations */
 struct merkle_context {
-	/* buffer and size for reading blocks from the input file */
+	/* buffer for reading up to k_leaf blocks from the input file at
+	 * once, and the size of each block */
 	unsigned char *block_buffer;
 	size_t block_size;
 	/* buffer and size for reading nodes from the output file */
 	unsigned char *node_buffer;
-	size_t node_size; /* node size = k * hash_size */
+	size_t node_size; /* max(k, k_leaf) * hash_size */
 	int fd_in; /* input file */
 	int fd_out; /* output file */
+	/* optional redo journal for hash file writes, or NULL */
+	struct merkle_journal *journal;
+	/* optional memory mapping of the output file, or NULL */
+	struct merkle_map *map;
+	/* optional sliding mapping of the input file, or NULL */
+	struct merkle_window *window;
+	/* optional log of blocks waiting for merkle_flush(), or NULL */
+	struct merkle_dirty *dirty;
+	/* optional content-defined chunks of the input file, which take
+	 * the place of its blocks, or NULL */
+	struct merkle_chunks *chunks;
+	/* optional traversal state kept between operations, or NULL */
+	struct merkle_stack *stack;
 	uint8_t hash_size; /* size of hash digest (may be smaller than sha) */
 	uint8_t k; /* number of children per hash tree node */
+	uint8_t k_leaf; /* number of blocks per leaf node */
 	uint8_t verbose; /* verbose output */
 	uint8_t partial; /* truncate that was not on a block boundary */
+	uint8_t levels; /* update and verify a tree level at a time */
+	uint8_t blocked; /* blocked layout of the hash file */
+	/* lock the nodes of the hash file during updates, so that other
+	 * processes can update other blocks of the same file at once */
+	uint8_t concurrent;
 };
 
+/* clear the journal, mappings, dirty log, chunks and stack that a
+ * copy of a context shares with the original, along with its partial
+ * and concurrent flags, so that the copy can run operations of its
+ * own on other buffers or threads */
+void merkle_context_detach(struct merkle_context *context);
+
+/* open a redo journal for the hash file in context.fd_out, first
+ * replaying any updates that were committed to it but may not have
+ * reached the hash file. while the journal is open, the hash file
+ * writes of each update are buffered in memory, then committed to
+ * the journal with a single sync before they are applied. an update
+ * interrupted before its commit leaves the hash file untouched */
+int merkle_journal_open(struct merkle_context *context, const char *path);
+
+/* close the journal opened by merkle_journal_open() */
+void merkle_journal_close(struct merkle_context *context);
+
+/* map the hash file in context.fd_out into memory, extending it if
+ * necessary to hold the tree for total_blocks. while it is mapped,
+ * node reads and writes are memory copies instead of system calls,
+ * and the only sync is a single msync() when the root is written.
+ * set sequential for traversals that cover most of the file */
+int merkle_map(struct merkle_context *context, uint64_t total_blocks,
+		int sequential);
+
+/* unmap the hash file mapped by merkle_map() */
+void merkle_unmap(struct merkle_context *context);
+
+/* map the input file in context.fd_in through a window of the given
+ * size (or a default size for 0) that slides forward as blocks are
+ * read, so that blocks are hashed directly from the page cache
+ * without a copy or a system call each */
+int merkle_map_input(struct merkle_context *context,
+		uint64_t window_size);
+
+/* unmap the input file mapped by merkle_map_input() */
+void merkle_unmap_input(struct merkle_context *context);
+
 /* update the hashes for dirty blocks in the given range,
  * along with all associated ancestors. total_blocks is
  * required to locate the root checksum.
@@ -29,12 +118,208 @@ int merkle_update(struct merkle_context *context,
 		uint64_t from_block, uint64_t to_block,
 		uint64_t total_blocks);
 
+/* update the hashes for the given block ranges like merkle_update(),
+ * in a single traversal that rehashes each shared ancestor once. the
+ * ranges must be sorted and must not overlap */
+int merkle_update_ranges(struct merkle_context *context,
+		const struct merkle_range *ranges, uint64_t count,
+		uint64_t total_blocks);
+
+/* open a log of dirty blocks in the given file. blocks marked dirty
+ * are appended to the log, and merkle_flush() updates their hashes
+ * all at once. the log survives until it's flushed, so marks made
+ * before a crash are flushed after it. a flush happens automatically
+ * when a mark brings the log to max_count blocks, or comes max_age
+ * seconds or more after the log's first mark. zero disables either */
+int merkle_dirty_open(struct merkle_context *context, const char *path,
+		uint64_t max_count, uint32_t max_age);
+
+/* close the dirty block log opened by merkle_dirty_open(), leaving
+ * any blocks that weren't flushed in the log */
+void merkle_dirty_close(struct merkle_context *context);
+
+/* append a dirty block to the log, flushing it if it's due */
+int merkle_mark_dirty(struct merkle_context *context, uint64_t block,
+		uint64_t total_blocks);
+
+/* update the hashes for every block in the dirty block log, sorted
+ * and merged into ranges, then empty the log. blocks past
+ * total_blocks are dropped */
+int merkle_flush(struct merkle_context *context, uint64_t total_blocks);
+
+/* open the input file and hash file at the given paths for any number
+ * of operations, with the k, k_leaf, block_size, hash_size, levels and
+ * verbose settings of context. the session keeps the block count of
+ * the input file, and the buffers and traversal state that each
+ * operation reuses. if writable is set, both files are opened for
+ * write access and the hash file is created if it doesn't exist. a
+ * session must only be used by one thread at a time, but each thread
+ * can have sessions of its own */
+int merkle_session_open(const struct merkle_context *context,
+		const char *input, const char *hash, int writable,
+		struct merkle_session **session);
+
+/* return the number of blocks in the session's input file */
+uint64_t merkle_session_blocks(const struct merkle_session *session);
+
+/* merkle_update() of the given range of the session's files */
+int merkle_session_update(struct merkle_session *session,
+		uint64_t from_block, uint64_t to_block);
+
+/* merkle_verify() of the given range of the session's files */
+int merkle_session_verify(struct merkle_session *session,
+		uint64_t from_block, uint64_t to_block);
+
+/* truncate or extend the input file to total_blocks blocks, filling
+ * any new blocks with zeroes, and resize the tree to match */
+int merkle_session_truncate(struct merkle_session *session,
+		uint64_t total_blocks);
+
+/* close the files and free the session */
+void merkle_session_close(struct merkle_session *session);
+
+/* run the write and verify operations listed in the manifest file,
+ * with the k, k_leaf, block_size, hash_size and verbose settings of
+ * context, on a pool of the given number of threads. each line of the
+ * manifest is "<write|verify> <input file> <hash file> [<from> <to>]".
+ * files are split into chunks of blocks, and the chunks of all the
+ * files are interleaved, so small files aren't stuck behind large ones.
+ * entries that name the same hash file, by the same path, run one at a
+ * time in the order of the manifest, so a verify after a write checks
+ * the finished tree.
+ * prints the result of each entry as it finishes, and returns nonzero
+ * if any entry failed */
+int merkle_batch(const struct merkle_context *context,
+		const char *manifest, unsigned threads);
+
+/* operations for merkle_async_submit() */
+enum merkle_async_operation {
+	MERKLE_ASYNC_UPDATE, /* merkle_update() */
+	MERKLE_ASYNC_VERIFY, /* merkle_verify() */
+	MERKLE_ASYNC_TRUNCATE /* merkle_resize() to to_block + 1 blocks */
+};
+
+/* request for merkle_async_submit(). the files stay open and owned by
+ * the caller until the request completes. for a truncate, total_blocks
+ * is the old block count and from_block is unused */
+struct merkle_async_request {
+	enum merkle_async_operation operation;
+	int fd_in; /* input file */
+	int fd_out; /* hash file, opened for write access unless verifying */
+	uint64_t from_block, to_block;
+	uint64_t total_blocks;
+};
+
+/* completion callback, invoked from merkle_async_complete() with the
+ * result the synchronous call would have returned, or ECANCELED */
+typedef void (*merkle_async_fn)(const struct merkle_async_request *request,
+		int status, void *user);
+
+/* start the given number of worker threads to run requests with the
+ * k, k_leaf, block_size, hash_size, levels and verbose settings of
+ * context. any number of requests may be in flight, and they wait in
+ * a queue for the next free worker, which reuses its own buffers */
+int merkle_async_create(const struct merkle_context *context,
+		unsigned threads, struct merkle_async **async);
+
+/* return an eventfd that becomes readable when requests complete, for
+ * an epoll or poll loop to call merkle_async_complete() */
+int merkle_async_fd(const struct merkle_async *async);
+
+/* queue a request, and start the kernel's readahead of its input
+ * blocks so the worker doesn't wait for them. updates of the same hash
+ * file may run at once, and lock the nodes they share. a truncate must
+ * not run alongside other requests on its file. the handle is valid
+ * until its callback returns */
+int merkle_async_submit(struct merkle_async *async,
+		const struct merkle_async_request *request,
+		merkle_async_fn callback, void *user,
+		struct merkle_async_handle **handle);
+
+/* cancel a request that hasn't started, so that its callback gets
+ * ECANCELED. returns EBUSY once it has started */
+int merkle_async_cancel(struct merkle_async *async,
+		struct merkle_async_handle *handle);
+
+/* invoke the callback of every request that completed since the last
+ * call, in the calling thread, and return how many there were */
+unsigned merkle_async_complete(struct merkle_async *async);
+
+/* run the requests still queued, invoke their callbacks, then stop
+ * the worker threads */
+void merkle_async_destroy(struct merkle_async *async);
+
+/* write a tree for each regular file under the given directory, in
+ * parallel on the given number of threads, then a forest tree at path
+ * whose blocks are digests of each file's relative path and root
+ * checksum, in path order. the forest root checksum is copied to root,
+ * which must hold SHA_DIGEST_LENGTH bytes. the file trees are kept in
+ * '<path>.trees', and '<path>.index' records the size, mtime and root
+ * of each file, so the next update rewrites only the trees of files
+ * that changed, and the forest nodes above them */
+int merkle_forest(const struct merkle_context *context,
+		const char *directory, const char *path, unsigned threads,
+		unsigned char *root);
+
+/* verify the tree in steps of about a megabyte, pacing the steps to
+ * stay within rate bytes and iops reads per second, either of which
+ * may be 0 for no limit. with a period in seconds, the rate is set to
+ * cover the file once per period, and the scrub runs pass after pass.
+ * otherwise it stops after one pass. the cursor is saved to path, so
+ * a stopped scrub resumes where it left off. idle puts the process in
+ * the idle i/o scheduling class. SIGUSR1 pauses the scrub, SIGUSR2
+ * resumes it, and SIGINT or SIGTERM stop it. returns nonzero if the
+ * last pass found any blocks that don't match */
+int merkle_scrub(struct merkle_context *context, const char *path,
+		uint64_t rate, uint32_t iops, uint64_t period, int idle);
+
+/* watch the input file at path, which is open in context.fd_in, and
+ * keep the hash tree up to date as it changes. after a full update,
+ * each inotify modify event, or change of mtime or size, leads to a
+ * scan that compares a fast fingerprint of each leaf's region of the
+ * file with the last scan, and updates only the regions that changed.
+ * a change in size resizes the tree with merkle_resize(). returns
+ * once the file is removed, or on error */
+int merkle_watch(struct merkle_context *context, const char *path);
+
+/* update the hashes in the given range like merkle_update(), while
+ * periodically recording its progress in the checkpoint file at the
+ * boundary of a completed subtree. if resume is nonzero and the file
+ * holds a checkpoint for the same parameters and range, the update
+ * skips the blocks it already completed. the checkpoint file is
+ * removed once the update succeeds */
+int merkle_update_resumable(struct merkle_context *context,
+		const char *checkpoint, int resume, uint64_t from_block,
+		uint64_t to_block, uint64_t total_blocks);
+
+/* update the hashes of every block like merkle_update(), after
+ * comparing a fast fingerprint of each block with those saved in the
+ * fingerprint file at path, and only rehash the blocks that changed.
+ * the saved fingerprints are only used if they were taken along with
+ * the tree's current root checksum, and otherwise every block is
+ * rehashed. the file is rewritten with the new fingerprints */
+int merkle_update_fingerprinted(struct merkle_context *context,
+		const char *path, uint64_t total_blocks);
+
 /* update the hash tree to reflect the given new last block,
  * truncating the hash file and regenerating the root checksum.
+ * in the blocked layout, every node moves, and without the old size
+ * they can't be found, so every block is rehashed. merkle_resize()
+ * moves them instead.
  * context.fd_in and fd_out must be opened for write access */
 int merkle_truncate(struct merkle_context *context,
 		uint64_t new_last_block);
 
+/* update the hash tree to reflect a new total block count, either
+ * truncating it as merkle_truncate() does, or extending it over new
+ * blocks that are assumed to contain zeroes, without reading them.
+ * in the blocked layout, the digests are first moved from their places
+ * for the old size to those for the new one, so only the path over the
+ * last block is rehashed there too.
+ * context.fd_out must be opened for write access */
+int merkle_resize(struct merkle_context *context,
+		uint64_t old_total_blocks, uint64_t new_total_blocks);
+
 /* verify the checksums of all blocks in the given range,
  * along with all associated ancestors. total_blocks is
  * required to locate the root checksum */
@@ -42,4 +327,102 @@ int merkle_verify(struct merkle_context *context,
 		uint64_t from_block, uint64_t to_block,
 		uint64_t total_blocks);
 
+/* callback for merkle_diff(), invoked in ascending order with
+ * each range of blocks whose hashes differ */
+typedef int (*merkle_diff_fn)(uint64_t from_block, uint64_t to_block,
+		void *user);
+
+/* compare the hash tree in context.fd_out with the one in fd_other,
+ * descending only into subtrees whose hashes differ. both trees must
+ * share the same parameters and total_blocks */
+int merkle_diff(struct merkle_context *context, int fd_other,
+		uint64_t from_block, uint64_t to_block,
+		uint64_t total_blocks, merkle_diff_fn callback, void *user);
+
+/* bounds on the size of content-defined chunks */
+#define MERKLE_CHUNK_MIN(avg_size) ((avg_size) / 4)
+#define MERKLE_CHUNK_MAX(avg_size) ((avg_size) * 8)
+
+/* split the input file in context.fd_in into content-defined chunks
+ * that average avg_size bytes, a power of 2, with a rolling hash, and
+ * hash the tree over those chunks in place of its blocks. a chunk ends
+ * wherever the hash of the bytes before it matches a mask, so an edit
+ * only moves the boundaries near it, and the chunks after it keep
+ * their digests. the block buffer must hold MERKLE_CHUNK_MAX() bytes */
+int merkle_chunk(struct merkle_context *context, uint32_t avg_size,
+		uint64_t *total_chunks);
+
+/* write the chunk index to path, so that a later verify hashes the
+ * same chunks */
+int merkle_chunks_save(const struct merkle_context *context,
+		const char *path);
+
+/* read the chunk index from path in place of merkle_chunk(). the index
+ * must have been written with chunks of the given avg_size, and the
+ * block buffer must hold MERKLE_CHUNK_MAX() bytes of it */
+int merkle_chunks_load(struct merkle_context *context, const char *path,
+		uint32_t avg_size, uint64_t *total_chunks);
+
+/* free the chunks from merkle_chunk() or merkle_chunks_load() */
+void merkle_chunks_free(struct merkle_context *context);
+
+/* find the range of chunks that hold the given range of bytes */
+void merkle_chunk_range(const struct merkle_context *context,
+		uint64_t from_offset, uint64_t to_offset,
+		struct merkle_range *range);
+
+/* open the copy-on-write node store in context.fd_out, creating it
+ * if the file is empty. the store holds any number of versions of the
+ * tree, each a root that shares every unchanged subtree with the
+ * version before it. node records are only ever appended, so a commit
+ * that doesn't finish leaves the earlier versions intact */
+int merkle_store_open(const struct merkle_context *context,
+		struct merkle_store **store);
+
+/* close the store opened by merkle_store_open() */
+void merkle_store_close(struct merkle_store *store);
+
+/* look up the given version, or the latest version for 0, returning
+ * its number, block count and root checksum */
+int merkle_store_version(const struct merkle_store *store, uint64_t number,
+		uint64_t *version, uint64_t *total_blocks, unsigned char *root);
+
+/* commit a new version of the tree over the input file in context.fd_in,
+ * with the blocks in the given sorted ranges rehashed, and returning its
+ * number. only the nodes on the paths from those blocks to the root are
+ * written, and every other node is shared with the latest version. the
+ * first version, or one with a new block count, writes every node */
+int merkle_commit(const struct merkle_context *context,
+		struct merkle_store *store, const struct merkle_range *ranges,
+		uint64_t count, uint64_t total_blocks, uint64_t *version);
+
+/* compare two versions with the same block count, like merkle_diff().
+ * subtrees shared by both versions are skipped without reading them */
+int merkle_snapdiff(const struct merkle_context *context,
+		struct merkle_store *store, uint64_t first, uint64_t second,
+		merkle_diff_fn callback, void *user);
+
+/* reclaim the nodes only used by versions older than oldest, by
+ * copying the newer versions into a new store that replaces the one
+ * at path */
+int merkle_compact(const struct merkle_context *context,
+		struct merkle_store *store, const char *path, uint64_t oldest);
+
+/* repair the file and hash tree in context.fd_in and fd_out from
+ * the source file and hash tree, copying only the blocks and nodes
+ * under subtrees whose hashes differ, then verify the copied blocks
+ * and their nodes up to the source root checksum. context.block_buffer
+ * must hold k_leaf blocks. total_blocks is that of the source, and
+ * the target hash tree must be consistent with its own file, and in
+ * the blocked layout, must be the same size as the source's.
+ * context.fd_in and fd_out must be opened for read/write access */
+int merkle_repair(struct merkle_context *context, int fd_source,
+		int fd_source_hash, uint64_t total_blocks);
+
+/* return the number of blocks covered by a hash file of the given
+ * size, rounded up to a whole leaf node. returns 0 if the size does
+ * not match any tree with these parameters */
+uint64_t merkle_hash_blocks(uint8_t k_leaf, uint8_t k, uint8_t hash_size,
+		uint64_t file_size);
+
 #endif /* COHORT_MERKLE_H */
@@ -0,0 +1,152 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "pool.h"
+
+
+/* queued task */
+struct pool_task {
+	pool_fn fn;
+	void *arg;
+	struct pool_task *next;
+};
+
+/* argument for each worker thread */
+struct pool_worker {
+	struct pool *pool;
+	pthread_t thread;
+	unsigned index;
+};
+
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t task_ready; /* signaled when a task is queued */
+	pthread_cond_t idle; /* signaled when the last task finishes */
+	struct pool_task *head, *tail; /* fifo of queued tasks */
+	unsigned long pending; /* tasks queued or running */
+	int stopping;
+	struct pool_worker *workers;
+	unsigned threads;
+};
+
+
+/* run tasks from the queue until the pool is stopped */
+static void* pool_run(void *arg)
+{
+	struct pool_worker *worker = (struct pool_worker*)arg;
+	struct pool *pool = worker->pool;
+	struct pool_task *task;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->head == NULL && !pool->stopping)
+			pthread_cond_wait(&pool->task_ready, &pool->lock);
+		if (pool->head == NULL)
+			break;
+
+		task = pool->head;
+		pool->head = task->next;
+		if (pool->head == NULL)
+			pool->tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		task->fn(task->arg, worker->index);
+		free(task);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0)
+			pthread_cond_broadcast(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+int pool_create(struct pool **result, unsigned threads)
+{
+	struct pool *pool;
+	unsigned i;
+	int status;
+
+	pool = (struct pool*)calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		return errno;
+
+	pool->workers = (struct pool_worker*)calloc(threads,
+			sizeof(struct pool_worker));
+	if (pool->workers == NULL) {
+		status = errno;
+		free(pool);
+		return status;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->task_ready, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+
+	for (i = 0; i < threads; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].index = i;
+		status = pthread_create(&pool->workers[i].thread, NULL,
+				pool_run, &pool->workers[i]);
+		if (status) {
+			pool_destroy(pool);
+			return status;
+		}
+		pool->threads++;
+	}
+
+	*result = pool;
+	return 0;
+}
+
+int pool_submit(struct pool *pool, pool_fn fn, void *arg)
+{
+	struct pool_task *task;
+
+	task = (struct pool_task*)malloc(sizeof(*task));
+	if (task == NULL)
+		return errno;
+	task->fn = fn;
+	task->arg = arg;
+	task->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail)
+		pool->tail->next = task;
+	else
+		pool->head = task;
+	pool->tail = task;
+	pool->pending++;
+	pthread_cond_signal(&pool->task_ready);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+void pool_wait(struct pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(struct pool *pool)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->task_ready);
+	pthread_mutex_unlock(&pool->lock);
+
+	/* workers drain the queue before they see the stop */
+	for (i = 0; i < pool->threads; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->task_ready);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
@@ -0,0 +1,25 @@
+#ifndef COHORT_MERKLE_POOL_H
+#define COHORT_MERKLE_POOL_H
+
+
+/* a fixed set of worker threads that run tasks in the order they
+ * were submitted */
+struct pool;
+
+/* task function, called with the task's argument and the index of the
+ * worker thread that runs it, in [0, threads) */
+typedef void (*pool_fn)(void *arg, unsigned worker);
+
+/* start the given number of worker threads */
+int pool_create(struct pool **pool, unsigned threads);
+
+/* queue a task for the next free worker */
+int pool_submit(struct pool *pool, pool_fn fn, void *arg);
+
+/* wait until every submitted task has finished */
+void pool_wait(struct pool *pool);
+
+/* wait for the submitted tasks, then stop the worker threads */
+void pool_destroy(struct pool *pool);
+
+#endif /* COHORT_MERKLE_POOL_H */
@@ -0,0 +1,40 @@
+#ifndef COHORT_MERKLE_PROBES_H
+#define COHORT_MERKLE_PROBES_H
+
+/* static tracepoints of the "merkle" provider, for perf, bpftrace and
+ * systemtap. with <sys/sdt.h> from systemtap, each probe is a single
+ * nop and a note in the binary, so it costs nothing until a tracer
+ * attaches. without it, or with -DMERKLE_NO_PROBES, probes compile to
+ * nothing. list them with 'bpftrace -l usdt:./merkle:*'.
+ *
+ *   visit__start(from_block, to_block, total_blocks)
+ *   visit__done(from_block, to_block, status)
+ *   node__push(node, depth)            traversal moves down to node
+ *   node__pop(node, depth)             and back up from it
+ *   leaf__visit(node, offset, first_block, count)
+ *   node__visit(node, offset, depth, count)
+ *   hash__start(first_block, count)
+ *   hash__done(first_block, count, status)
+ *   read__start(fd, offset, length)
+ *   read__done(fd, offset, bytes)      bytes read, or -1
+ *   write__start(fd, offset, length)
+ *   write__done(fd, offset, status)
+ *   prefetch(node, offset, width)      node read started early
+ *   root(node, offset)                 root checksum written
+ *   truncate(length)                   hash file truncated
+ *
+ * offsets of nodes are counted in digests, and those of reads and
+ * writes in bytes */
+
+#if !defined(MERKLE_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MERKLE_PROBE(...) STAP_PROBEV(merkle, __VA_ARGS__)
+#endif
+#endif
+
+#ifndef MERKLE_PROBE
+#define MERKLE_PROBE(...) do { } while (0)
+#endif
+
+#endif /* COHORT_MERKLE_PROBES_H */
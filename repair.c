@@ -0,0 +1,193 @@
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <openssl/sha.h>
+
+#include "merkle.h"
+#include "diff.h"
+#include "journal.h"
+#include "update.h"
+#include "visitor.h"
+#include "tree.h"
+
+
+/* source files for the repair callbacks, and the ranges of blocks
+ * they copied, to verify afterwards */
+struct repair_state {
+	const struct merkle_context *context;
+	int fd_source;
+	struct merkle_range *ranges;
+	uint64_t count, capacity;
+};
+
+
+/* copy a node from the source tree whose hashes differ. the child
+ * digests that already match are identical in both trees, so the
+ * whole node can be copied without rehashing */
+static int repair_node(const struct merkle_state *node, uint8_t depth,
+		const unsigned char *ours, const unsigned char *theirs,
+		void *user)
+{
+	const struct repair_state *repair = (const struct repair_state*)user;
+	const struct merkle_context *context = repair->context;
+	uint64_t write_offset = context->hash_size * node->offset;
+	size_t size = context->hash_size *
+		merkle_width(node, context->k_leaf, context->k);
+
+	if (memcmp(ours, theirs, size) == 0)
+		return 0;
+
+	if (context->verbose)
+		printf("%*snode %lu copied to offset %lu\n",
+				2*depth, "", node->node, write_offset);
+
+	return write_hash(context, write_offset,
+			(unsigned char*)theirs, size);
+}
+
+/* copy a range of differing blocks from the source file */
+static int repair_blocks(uint64_t from_block, uint64_t to_block,
+		void *user)
+{
+	struct repair_state *repair = (struct repair_state*)user;
+	const struct merkle_context *context = repair->context;
+	uint64_t block, offset;
+	void *ranges;
+	int status;
+
+	if (repair->count == repair->capacity) {
+		repair->capacity = repair->capacity ? repair->capacity * 2 : 64;
+		ranges = realloc(repair->ranges,
+				repair->capacity * sizeof(struct merkle_range));
+		if (ranges == NULL)
+			return errno;
+		repair->ranges = (struct merkle_range*)ranges;
+	}
+	repair->ranges[repair->count].from_block = from_block;
+	repair->ranges[repair->count].to_block = to_block;
+	repair->count++;
+
+	if (context->verbose)
+		printf("blocks %lu to %lu copied\n", from_block, to_block);
+
+	for (block = from_block; block <= to_block; block++) {
+		offset = block * context->block_size;
+
+		status = read_at(repair->fd_source, offset,
+				context->block_buffer, context->block_size);
+		if (status)
+			return status;
+
+		status = write_at(context->fd_in, offset,
+				context->block_buffer, context->block_size);
+		if (status)
+			return status;
+	}
+	return 0;
+}
+
+/* copy the blocks and nodes of subtrees that differ from the source,
+ * then verify each copied range of blocks against the repaired tree,
+ * up to the source root checksum */
+int merkle_repair(struct merkle_context *context, int fd_source,
+		int fd_source_hash, uint64_t total_blocks)
+{
+	struct repair_state repair = {
+		context,
+		fd_source,
+		NULL,
+		0,
+		0
+	};
+	struct diff_visitor visitor = {
+		repair_node,
+		repair_blocks,
+		&repair
+	};
+	unsigned char expected[SHA_DIGEST_LENGTH];
+	uint64_t i, leaves, root_offset, truncate_offset;
+	struct stat stat;
+	int status;
+
+	leaves = total_blocks / context->k_leaf +
+		(total_blocks % context->k_leaf ? 1 : 0);
+	root_offset = context->hash_size *
+		merkle_root_offset(context->k_leaf, context->k, leaves);
+	truncate_offset = root_offset + context->hash_size;
+
+	/* in the blocked layout, a tree of another size has its nodes in
+	 * other places, so the nodes that match can't be skipped */
+	if (context->blocked) {
+		if (fstat(context->fd_out, &stat) == -1)
+			return errno;
+		if ((uint64_t)stat.st_size != truncate_offset) {
+			fprintf(stderr, "repair: target hash file is %lu bytes, "
+					"but the blocked layout can only be repaired "
+					"from a tree of the same size\n", stat.st_size);
+			return EINVAL;
+		}
+	}
+
+	/* copy everything under the subtrees whose hashes differ */
+	status = diff_visit(context, fd_source_hash, &visitor,
+			0, total_blocks - 1, total_blocks);
+	if (status)
+		goto out_journal;
+
+	/* copy the root checksum, and truncate both target files
+	 * in case they were larger than the source */
+	status = read_at(fd_source_hash, root_offset,
+			expected, context->hash_size);
+	if (status)
+		goto out_journal;
+
+	status = write_hash(context, root_offset,
+			expected, context->hash_size);
+	if (status)
+		goto out_journal;
+
+	status = truncate_hash(context, truncate_offset);
+out_journal:
+	status = journal_finish(context, status);
+	if (status)
+		goto out_free;
+
+	if (fstat(fd_source, &stat) == -1) {
+		status = errno;
+		fprintf(stderr, "repair: fstat() of source file "
+				"failed with %d\n", status);
+		goto out_free;
+	}
+
+	if (ftruncate(context->fd_in, stat.st_size) == -1) {
+		status = errno;
+		fprintf(stderr, "repair: ftruncate(%lu) of target file "
+				"failed with %d\n", stat.st_size, status);
+		goto out_free;
+	}
+
+	/* verify the copied blocks against the repaired tree, which
+	 * checks every node up to the source root checksum */
+	for (i = 0; i < repair.count; i++) {
+		status = merkle_verify(context, repair.ranges[i].from_block,
+				repair.ranges[i].to_block, total_blocks);
+		if (status) {
+			fprintf(stderr, "repaired blocks %lu to %lu do not "
+					"match the source tree\n",
+					repair.ranges[i].from_block,
+					repair.ranges[i].to_block);
+			goto out_free;
+		}
+	}
+
+	if (context->verbose)
+		printf("verified %lu repaired ranges against the source root "
+				"checksum at offset %lu\n", repair.count, root_offset);
+out_free:
+	free(repair.ranges);
+	return status;
+}
@@ -0,0 +1,322 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "merkle.h"
+#include "update.h"
+#include "tree.h"
+
+
+#define SCRUB_MAGIC 0x424b524d /* "MRKB" */
+
+/* bytes of input verified between checks of the budget */
+#define SCRUB_STEP (1 << 20)
+
+/* seconds between saves of the cursor */
+#define SCRUB_SAVE_INTERVAL 10
+
+/* linux ioprio_set() values, which glibc doesn't define */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+/* cursor of an incremental scrub, as stored in the scrub file */
+struct scrub_record {
+	uint32_t magic;
+	uint32_t block_size;
+	uint8_t k;
+	uint8_t k_leaf;
+	uint8_t hash_size;
+	uint64_t total_blocks;
+	uint64_t next_block; /* every block before this one was verified */
+	int64_t pass_start; /* time the current pass started */
+	uint64_t errors; /* failed steps in the current pass */
+};
+
+/* token bucket for one budget. tokens may go negative after a step,
+ * and the next step waits until the debt is paid */
+struct scrub_bucket {
+	double rate; /* tokens per second, or 0 for no limit */
+	double tokens;
+	double burst; /* most tokens that can be saved up */
+};
+
+/* set by the signal handlers */
+static volatile sig_atomic_t scrub_paused;
+static volatile sig_atomic_t scrub_stopped;
+
+
+static void scrub_signal(int signal)
+{
+	if (signal == SIGUSR1)
+		scrub_paused = 1;
+	else if (signal == SIGUSR2)
+		scrub_paused = 0;
+	else
+		scrub_stopped = 1;
+}
+
+static double scrub_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* add the tokens earned since the last refill */
+static void bucket_refill(struct scrub_bucket *bucket, double elapsed)
+{
+	if (bucket->rate == 0)
+		return;
+	bucket->tokens += elapsed * bucket->rate;
+	if (bucket->tokens > bucket->burst)
+		bucket->tokens = bucket->burst;
+}
+
+/* return the seconds to wait before the bucket is out of debt */
+static double bucket_wait(const struct scrub_bucket *bucket)
+{
+	if (bucket->rate == 0 || bucket->tokens >= 0)
+		return 0;
+	return -bucket->tokens / bucket->rate;
+}
+
+/* wait while paused, then sleep for the given seconds, returning
+ * early if the scrub is stopped */
+static void scrub_sleep(double seconds)
+{
+	struct timespec delay;
+	sigset_t mask, old;
+
+	/* block the signals while checking the flags, so that a resume
+	 * can't arrive between the check and the wait */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR2);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, &old);
+	while (scrub_paused && !scrub_stopped)
+		sigsuspend(&old);
+	sigprocmask(SIG_SETMASK, &old, NULL);
+
+	while (!scrub_stopped && seconds > 0) {
+		delay.tv_sec = (time_t)seconds;
+		delay.tv_nsec = (long)((seconds - delay.tv_sec) * 1e9);
+		if (nanosleep(&delay, &delay) == 0)
+			break;
+		seconds = delay.tv_sec + delay.tv_nsec / 1e9;
+	}
+}
+
+/* write the cursor over the scrub file. it's only a hint, so a lost
+ * write just repeats part of a pass */
+static int scrub_save(const struct merkle_context *context,
+		const char *path, const struct scrub_record *record)
+{
+	int fd, status;
+
+	fd = open(path, O_WRONLY | O_CREAT, 0600);
+	if (fd == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open scrub file "
+				"'%s' with error %d.\n", path, status);
+		return status;
+	}
+	status = write_at(fd, 0, (unsigned char*)record, sizeof(*record));
+	close(fd);
+
+	if (status == 0 && context->verbose)
+		printf("scrub cursor at block %lu\n", record->next_block);
+	return status;
+}
+
+/* read the cursor, starting a new pass if it's missing or doesn't
+ * match the tree */
+static void scrub_load(const char *path, struct scrub_record *record)
+{
+	struct scrub_record saved;
+	ssize_t bytes;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	bytes = pread(fd, &saved, sizeof(saved), 0);
+	close(fd);
+
+	if (bytes == sizeof(saved) &&
+			saved.magic == record->magic &&
+			saved.block_size == record->block_size &&
+			saved.k == record->k &&
+			saved.k_leaf == record->k_leaf &&
+			saved.hash_size == record->hash_size &&
+			saved.total_blocks == record->total_blocks &&
+			saved.next_block < record->total_blocks)
+		*record = saved;
+}
+
+/* verify the input file in steps, paced by the given budgets */
+int merkle_scrub(struct merkle_context *context, const char *path,
+		uint64_t rate, uint32_t iops, uint64_t period, int idle)
+{
+	struct scrub_bucket bytes = { 0, 0, 0 }, ios = { 0, 0, 0 };
+	struct scrub_record record;
+	struct sigaction action;
+	struct stat stat;
+	uint64_t step, last_block, leaves, passes = 0;
+	double now, last, saved;
+	uint8_t depth;
+	int status = 0;
+
+	if (idle && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+				IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1)
+		fprintf(stderr, "scrub: ioprio_set() failed with error %d\n",
+				errno);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = scrub_signal;
+	/* reads restart after a signal, while sleeps end early */
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &action, NULL);
+	sigaction(SIGUSR2, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	scrub_paused = scrub_stopped = 0;
+
+	step = SCRUB_STEP / context->block_size;
+	if (step == 0)
+		step = 1;
+
+	while (!scrub_stopped) {
+		/* the file may have changed size since the last pass */
+		if (fstat(context->fd_in, &stat) == -1) {
+			status = errno;
+			break;
+		}
+
+		memset(&record, 0, sizeof(record));
+		record.magic = SCRUB_MAGIC;
+		record.block_size = context->block_size;
+		record.k = context->k;
+		record.k_leaf = context->k_leaf;
+		record.hash_size = context->hash_size;
+		record.total_blocks = stat.st_size / context->block_size +
+			(stat.st_size % context->block_size ? 1 : 0);
+		record.pass_start = time(NULL);
+		if (record.total_blocks == 0) {
+			fprintf(stderr, "scrub: input file has no blocks\n");
+			status = ERANGE;
+			break;
+		}
+		scrub_load(path, &record);
+
+		/* spread the pass over the period, within the byte budget */
+		bytes.rate = rate;
+		if (period) {
+			bytes.rate = (double)stat.st_size / period;
+			if (rate && rate < bytes.rate) {
+				fprintf(stderr, "scrub: %lu bytes per second is too "
+						"slow to cover the file every %lu seconds\n",
+						rate, period);
+				bytes.rate = rate;
+			}
+		}
+		bytes.burst = bytes.rate > SCRUB_STEP ? bytes.rate : SCRUB_STEP;
+		ios.rate = iops;
+		ios.burst = iops;
+
+		/* each leaf is a read of the input and of its node, and
+		 * each step also reads the path above it */
+		leaves = record.total_blocks / context->k_leaf +
+			(record.total_blocks % context->k_leaf ? 1 : 0);
+		depth = merkle_depth(context->k, leaves);
+
+		if (context->verbose)
+			printf("scrub of %lu blocks from block %lu at %.0f bytes "
+					"per second\n", record.total_blocks,
+					record.next_block, bytes.rate);
+
+		last = saved = scrub_now();
+		while (record.next_block < record.total_blocks) {
+			/* wait for both budgets, or for resume */
+			scrub_sleep(bucket_wait(&bytes) > bucket_wait(&ios) ?
+					bucket_wait(&bytes) : bucket_wait(&ios));
+			if (scrub_stopped)
+				break;
+			now = scrub_now();
+			bucket_refill(&bytes, now - last);
+			bucket_refill(&ios, now - last);
+			last = now;
+
+			last_block = record.next_block + step - 1;
+			if (last_block >= record.total_blocks)
+				last_block = record.total_blocks - 1;
+
+			if (merkle_verify(context, record.next_block, last_block,
+						record.total_blocks)) {
+				record.errors++;
+				printf("blocks %lu to %lu failed verification\n",
+						record.next_block, last_block);
+			}
+
+			/* don't let the scrub push foreground data out of the
+			 * page cache */
+			posix_fadvise(context->fd_in,
+					record.next_block * context->block_size,
+					(last_block - record.next_block + 1) *
+					context->block_size, POSIX_FADV_DONTNEED);
+
+			bytes.tokens -= (double)(last_block - record.next_block + 1) *
+				context->block_size;
+			ios.tokens -= 2.0 * ((last_block - record.next_block) /
+					context->k_leaf + 1) + depth;
+			record.next_block = last_block + 1;
+
+			if (now - saved >= SCRUB_SAVE_INTERVAL &&
+					record.next_block < record.total_blocks) {
+				saved = now;
+				status = scrub_save(context, path, &record);
+				if (status)
+					goto out;
+			}
+		}
+
+		if (scrub_stopped) {
+			status = scrub_save(context, path, &record);
+			printf("scrub stopped at block %lu\n", record.next_block);
+			break;
+		}
+
+		passes++;
+		printf("scrub pass of %lu blocks finished in %ld seconds "
+				"with %lu errors\n", record.total_blocks,
+				(long)(time(NULL) - record.pass_start), record.errors);
+		status = record.errors ? -1 : 0;
+
+		/* start the next pass from the beginning */
+		if (unlink(path) == -1 && errno != ENOENT) {
+			status = errno;
+			break;
+		}
+
+		/* without a period to keep to, one pass is enough */
+		if (period == 0)
+			break;
+	}
+
+out:
+	signal(SIGUSR1, SIG_DFL);
+	signal(SIGUSR2, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	if (context->verbose)
+		printf("scrub finished %lu passes\n", passes);
+	return status;
+}
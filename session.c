@@ -0,0 +1,147 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "merkle.h"
+#include "visitor.h"
+
+
+/* file and hash file pair, open for any number of operations */
+struct merkle_session {
+	struct merkle_context context;
+	struct merkle_stack stack; /* reused by every traversal */
+	unsigned char *arena; /* block buffer, then node buffer */
+	uint64_t total_blocks;
+};
+
+
+int merkle_session_open(const struct merkle_context *context,
+		const char *input, const char *hash, int writable,
+		struct merkle_session **result)
+{
+	struct merkle_session *session;
+	size_t block_bytes = context->k_leaf * context->block_size;
+	struct stat stat;
+	int status;
+
+	session = (struct merkle_session*)calloc(1, sizeof(*session));
+	if (session == NULL)
+		return errno;
+
+	session->context = *context;
+	merkle_context_detach(&session->context);
+	session->context.stack = &session->stack;
+
+	/* one allocation holds both buffers */
+	session->arena = (unsigned char*)malloc(block_bytes +
+			context->node_size);
+	if (session->arena == NULL) {
+		status = errno;
+		goto out_free;
+	}
+	session->context.block_buffer = session->arena;
+	session->context.node_buffer = session->arena + block_bytes;
+
+	session->context.fd_in = open(input, writable ? O_RDWR : O_RDONLY);
+	if (session->context.fd_in == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open input file "
+				"'%s' with error %d.\n", input, status);
+		goto out_free_arena;
+	}
+
+	session->context.fd_out = writable ?
+		open(hash, O_RDWR | O_CREAT, 0600) : open(hash, O_RDONLY);
+	if (session->context.fd_out == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open hash file "
+				"'%s' with error %d.\n", hash, status);
+		goto out_close_in;
+	}
+
+	if (fstat(session->context.fd_in, &stat) == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to get file size of "
+				"input file '%s' with error %d.\n", input, status);
+		goto out_close_out;
+	}
+	session->total_blocks = stat.st_size / context->block_size +
+		(stat.st_size % context->block_size ? 1 : 0);
+
+	if (context->verbose)
+		printf("session opened over %lu blocks\n",
+				session->total_blocks);
+	*result = session;
+	return 0;
+
+out_close_out:
+	close(session->context.fd_out);
+out_close_in:
+	close(session->context.fd_in);
+out_free_arena:
+	free(session->arena);
+out_free:
+	free(session);
+	return status;
+}
+
+uint64_t merkle_session_blocks(const struct merkle_session *session)
+{
+	return session->total_blocks;
+}
+
+int merkle_session_update(struct merkle_session *session,
+		uint64_t from_block, uint64_t to_block)
+{
+	if (from_block > to_block || to_block >= session->total_blocks)
+		return ERANGE;
+	return merkle_update(&session->context, from_block, to_block,
+			session->total_blocks);
+}
+
+int merkle_session_verify(struct merkle_session *session,
+		uint64_t from_block, uint64_t to_block)
+{
+	if (from_block > to_block || to_block >= session->total_blocks)
+		return ERANGE;
+	return merkle_verify(&session->context, from_block, to_block,
+			session->total_blocks);
+}
+
+int merkle_session_truncate(struct merkle_session *session,
+		uint64_t total_blocks)
+{
+	struct merkle_context *context = &session->context;
+	int status;
+
+	if (total_blocks == 0 || total_blocks == session->total_blocks)
+		return EINVAL;
+	if (total_blocks > INT64_MAX / context->block_size)
+		return EFBIG;
+
+	if (ftruncate(context->fd_in, total_blocks * context->block_size)
+			== -1) {
+		status = errno;
+		fprintf(stderr, "Failed to truncate input file "
+				"with error %d.\n", status);
+		return status;
+	}
+
+	status = merkle_resize(context, session->total_blocks, total_blocks);
+	if (status == 0)
+		session->total_blocks = total_blocks;
+	return status;
+}
+
+void merkle_session_close(struct merkle_session *session)
+{
+	close(session->context.fd_out);
+	close(session->context.fd_in);
+	merkle_stack_free(&session->stack);
+	free(session->arena);
+	free(session);
+}
@@ -0,0 +1,1007 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <openssl/sha.h>
+
+#include "merkle.h"
+#include "update.h"
+#include "tree.h"
+
+
+#define STORE_MAGIC 0x534b524d /* "MRKS" */
+#define RECORD_NODE 0x444e4b4d /* "MKND" */
+#define RECORD_VERSION 0x52564b4d /* "MKVR" */
+
+/* offset of no node, as offset 0 holds the header */
+#define STORE_NONE 0
+
+/* appends are buffered up to this size */
+#define APPEND_SIZE (1 << 20)
+
+/* header at the start of the store, rewritten after each commit */
+struct store_header {
+	uint32_t magic;
+	uint32_t block_size;
+	uint8_t k;
+	uint8_t hash_size;
+	uint8_t k_leaf; /* 0 in stores written before it was added */
+	uint8_t reserved[5];
+	uint64_t last_version; /* offset of the last version record */
+};
+
+/* each node record starts with this, followed by k_leaf digests for a
+ * leaf, or by k digests and the k offsets of the child records for the
+ * nodes above the leaves */
+struct store_node {
+	uint32_t type; /* RECORD_NODE */
+	uint32_t depth;
+};
+
+/* a version record follows the nodes it was committed with */
+struct store_version {
+	uint32_t type; /* RECORD_VERSION */
+	uint32_t depth;
+	uint64_t version;
+	uint64_t total_blocks;
+	uint64_t root; /* offset of the root node record */
+	uint64_t previous; /* offset of the previous version record */
+	unsigned char digest[SHA_DIGEST_LENGTH]; /* root checksum */
+	unsigned char checksum[SHA_DIGEST_LENGTH]; /* of this record */
+};
+
+/* node records are immutable once written, and the store only grows
+ * until compaction */
+struct merkle_store {
+	int fd;
+	struct store_header header;
+	uint64_t length; /* end of the last version record */
+	struct store_version *versions; /* in ascending order */
+	uint64_t count, capacity;
+	/* appends not yet written to the store */
+	unsigned char *append;
+	uint64_t append_length;
+	/* one node record buffer for each depth */
+	unsigned char **nodes;
+	uint8_t depth;
+};
+
+
+static size_t node_record_size(const struct store_header *header,
+		uint8_t depth)
+{
+	if (depth == 1)
+		return sizeof(struct store_node) +
+			header->k_leaf * header->hash_size;
+	return sizeof(struct store_node) + header->k * header->hash_size +
+		header->k * sizeof(uint64_t);
+}
+
+/* return the size of a buffer that holds a node record of any depth */
+static size_t node_buffer_size(const struct store_header *header)
+{
+	size_t leaf = node_record_size(header, 1);
+	size_t node = node_record_size(header, 2);
+	return leaf > node ? leaf : node;
+}
+
+static inline unsigned char* node_digests(unsigned char *record)
+{
+	return record + sizeof(struct store_node);
+}
+
+static inline uint64_t* node_children(unsigned char *record,
+		const struct store_header *header)
+{
+	return (uint64_t*)(record + sizeof(struct store_node) +
+			header->k * header->hash_size);
+}
+
+/* compute the checksum of a version record with its checksum zeroed */
+static void version_checksum(struct store_version *version,
+		unsigned char *digest)
+{
+	unsigned char checksum[SHA_DIGEST_LENGTH];
+	unsigned char result[SHA_DIGEST_LENGTH];
+	SHA_CTX hash;
+
+	/* digest may be the record's own checksum */
+	memcpy(checksum, version->checksum, sizeof(checksum));
+	memset(version->checksum, 0, sizeof(version->checksum));
+	SHA1_Init(&hash);
+	SHA1_Update(&hash, version, sizeof(*version));
+	SHA1_Final(result, &hash);
+	memcpy(version->checksum, checksum, sizeof(checksum));
+	memcpy(digest, result, sizeof(result));
+}
+
+/* read a version record, returning nonzero unless it's complete */
+static int version_read(const struct merkle_store *store, uint64_t offset,
+		struct store_version *version)
+{
+	unsigned char checksum[SHA_DIGEST_LENGTH];
+
+	if (pread(store->fd, version, sizeof(*version), offset) !=
+			sizeof(*version) || version->type != RECORD_VERSION)
+		return EINVAL;
+	version_checksum(version, checksum);
+	return memcmp(checksum, version->checksum, sizeof(checksum)) ?
+		EINVAL : 0;
+}
+
+/* make sure there's a node buffer for each depth up to depth */
+static int store_buffers(struct merkle_store *store, uint8_t depth)
+{
+	size_t size = node_buffer_size(&store->header);
+	unsigned char **nodes;
+	uint8_t i;
+
+	if (depth <= store->depth)
+		return 0;
+
+	nodes = (unsigned char**)realloc(store->nodes,
+			(depth + 1) * sizeof(unsigned char*));
+	if (nodes == NULL)
+		return errno;
+	store->nodes = nodes;
+
+	for (i = store->depth + 1; i <= depth; i++) {
+		store->nodes[i] = (unsigned char*)malloc(size);
+		if (store->nodes[i] == NULL)
+			return errno;
+		store->depth = i;
+	}
+	return 0;
+}
+
+/* read the node record at offset into the buffer for its depth, or
+ * zeroes for STORE_NONE */
+static int node_read(const struct merkle_store *store, uint64_t offset,
+		uint8_t depth, unsigned char *record)
+{
+	size_t size = node_record_size(&store->header, depth);
+	struct store_node *node = (struct store_node*)record;
+	int status;
+
+	if (offset == STORE_NONE) {
+		memset(record, 0, size);
+		node->type = RECORD_NODE;
+		node->depth = depth;
+		return 0;
+	}
+
+	status = read_at(store->fd, offset, record, size);
+	if (status)
+		return status;
+	if (node->type != RECORD_NODE || node->depth != depth) {
+		fprintf(stderr, "store: no node of depth %u at offset %lu\n",
+				depth, offset);
+		return EINVAL;
+	}
+	return 0;
+}
+
+/* write out the buffered appends */
+static int store_flush(struct merkle_store *store)
+{
+	int status;
+
+	if (store->append_length == 0)
+		return 0;
+	status = write_at(store->fd, store->length - store->append_length,
+			store->append, store->append_length);
+	store->append_length = 0;
+	return status;
+}
+
+/* append a record to the store, returning its offset */
+static int store_append(struct merkle_store *store,
+		const unsigned char *record, size_t size, uint64_t *offset)
+{
+	int status;
+
+	if (store->append_length + size > APPEND_SIZE) {
+		status = store_flush(store);
+		if (status)
+			return status;
+	}
+	memcpy(store->append + store->append_length, record, size);
+	store->append_length += size;
+	*offset = store->length;
+	store->length += size;
+	return 0;
+}
+
+/* add a version record to the table */
+static int version_add(struct merkle_store *store,
+		const struct store_version *version)
+{
+	void *versions;
+
+	if (store->count == store->capacity) {
+		store->capacity = store->capacity ? store->capacity * 2 : 16;
+		versions = realloc(store->versions,
+				store->capacity * sizeof(struct store_version));
+		if (versions == NULL)
+			return errno;
+		store->versions = (struct store_version*)versions;
+	}
+	store->versions[store->count++] = *version;
+	return 0;
+}
+
+/* load the version table, following the chain back from the version
+ * in the header, then forward past any versions committed after the
+ * header was last written. anything after the last complete version
+ * was never committed, and is overwritten by the next commit */
+static int store_load(struct merkle_store *store)
+{
+	struct store_header *header = &store->header;
+	struct store_version version;
+	struct store_node node;
+	uint64_t offset, count = 0, i;
+	int status;
+
+	store->count = 0;
+	store->length = sizeof(struct store_header);
+
+	for (offset = header->last_version; offset != STORE_NONE;
+			offset = version.previous) {
+		status = version_read(store, offset, &version);
+		if (status) {
+			fprintf(stderr, "store: bad version record at "
+					"offset %lu\n", offset);
+			return status;
+		}
+		status = version_add(store, &version);
+		if (status)
+			return status;
+		if (count++ == 0)
+			store->length = offset + sizeof(version);
+	}
+
+	/* the chain runs from the newest version back */
+	for (i = 0; i < store->count / 2; i++) {
+		version = store->versions[i];
+		store->versions[i] = store->versions[store->count - 1 - i];
+		store->versions[store->count - 1 - i] = version;
+	}
+
+	for (offset = store->length; ; ) {
+		if (pread(store->fd, &node, sizeof(node), offset) != sizeof(node))
+			break;
+		if (node.type == RECORD_NODE && node.depth > 0 &&
+				node.depth <= 64) {
+			offset += node_record_size(header, node.depth);
+		} else if (version_read(store, offset, &version) == 0) {
+			status = version_add(store, &version);
+			if (status)
+				return status;
+			store->header.last_version = offset;
+			offset += sizeof(version);
+			store->length = offset;
+		} else
+			break;
+	}
+	return 0;
+}
+
+/* open the node store in context.fd_out, writing a new header if
+ * the file is empty */
+int merkle_store_open(const struct merkle_context *context,
+		struct merkle_store **result)
+{
+	struct merkle_store *store;
+	struct stat stat;
+	int status;
+
+	store = (struct merkle_store*)calloc(1, sizeof(*store));
+	if (store == NULL)
+		return errno;
+	store->fd = context->fd_out;
+
+	if (fstat(store->fd, &stat) == -1) {
+		status = errno;
+		goto out_free;
+	}
+
+	if (stat.st_size == 0) {
+		store->header.magic = STORE_MAGIC;
+		store->header.block_size = context->block_size;
+		store->header.k = context->k;
+		store->header.k_leaf = context->k_leaf;
+		store->header.hash_size = context->hash_size;
+		status = write_at(store->fd, 0, (unsigned char*)&store->header,
+				sizeof(store->header));
+		if (status)
+			goto out_free;
+	} else if (pread(store->fd, &store->header, sizeof(store->header), 0)
+			!= sizeof(store->header) ||
+			store->header.magic != STORE_MAGIC) {
+		fprintf(stderr, "store: not a node store\n");
+		status = EINVAL;
+		goto out_free;
+	}
+
+	/* older stores have leaves as wide as their nodes */
+	if (store->header.k_leaf == 0)
+		store->header.k_leaf = store->header.k;
+
+	if (store->header.block_size != context->block_size ||
+			store->header.k != context->k ||
+			store->header.k_leaf != context->k_leaf ||
+			store->header.hash_size != context->hash_size) {
+		fprintf(stderr, "store: written with block size %u, k=%u, "
+				"k_leaf=%u and hash size %u\n",
+				store->header.block_size, store->header.k,
+				store->header.k_leaf, store->header.hash_size);
+		status = EINVAL;
+		goto out_free;
+	}
+
+	store->append = (unsigned char*)malloc(APPEND_SIZE);
+	if (store->append == NULL) {
+		status = errno;
+		goto out_free;
+	}
+
+	status = store_load(store);
+	if (status)
+		goto out_free;
+
+	if (context->verbose)
+		printf("store has %lu versions in %lu bytes\n",
+				store->count, store->length);
+	*result = store;
+	return 0;
+
+out_free:
+	merkle_store_close(store);
+	return status;
+}
+
+/* close the store opened by merkle_store_open() */
+void merkle_store_close(struct merkle_store *store)
+{
+	uint8_t i;
+
+	for (i = 1; i <= store->depth; i++)
+		free(store->nodes[i]);
+	free(store->nodes);
+	free(store->append);
+	free(store->versions);
+	free(store);
+}
+
+/* find a version in the table, or the latest version for 0 */
+static const struct store_version* version_find(
+		const struct merkle_store *store, uint64_t number)
+{
+	uint64_t low = 0, high = store->count, middle;
+
+	if (number == 0)
+		return store->count ? &store->versions[store->count - 1] : NULL;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		if (store->versions[middle].version < number)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low < store->count && store->versions[low].version == number ?
+		&store->versions[low] : NULL;
+}
+
+int merkle_store_version(const struct merkle_store *store, uint64_t number,
+		uint64_t *version, uint64_t *total_blocks, unsigned char *root)
+{
+	const struct store_version *found = version_find(store, number);
+
+	if (found == NULL)
+		return ENOENT;
+	*version = found->version;
+	*total_blocks = found->total_blocks;
+	memcpy(root, found->digest, store->header.hash_size);
+	return 0;
+}
+
+
+/* state for writing a new version */
+struct store_commit {
+	const struct merkle_context *context;
+	struct merkle_store *store;
+	const struct merkle_range *ranges;
+	uint64_t count;
+	uint64_t total_blocks;
+	uint64_t span[65]; /* blocks under a node at each depth */
+	uint64_t written; /* number of node records */
+};
+
+/* return nonzero if any range intersects from_block through to_block */
+static int commit_intersects(const struct store_commit *commit,
+		uint64_t from_block, uint64_t to_block)
+{
+	uint64_t low = 0, high = commit->count, middle;
+
+	/* find the first range that ends at or after from_block */
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		if (commit->ranges[middle].to_block < from_block)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low < commit->count &&
+		commit->ranges[low].from_block <= to_block;
+}
+
+/* write a new copy of the node at the given depth whose first block is
+ * first_block, with the blocks in the commit's ranges rehashed. the
+ * children outside of the ranges are shared with the old copy at
+ * offset, which is STORE_NONE for a node that doesn't exist yet */
+static int commit_node(struct store_commit *commit, uint64_t offset,
+		uint8_t depth, uint64_t first_block, uint64_t *result,
+		unsigned char *digest)
+{
+	const struct merkle_context *context = commit->context;
+	struct merkle_store *store = commit->store;
+	unsigned char *record = store->nodes[depth];
+	unsigned char *digests = node_digests(record);
+	unsigned char node_digest[SHA_DIGEST_LENGTH];
+	uint64_t *children, start, end, block;
+	SHA_CTX hash;
+	uint8_t i, run;
+	int status;
+
+	status = node_read(store, offset, depth, record);
+	if (status)
+		return status;
+
+	if (depth == 1) {
+		/* rehash each run of blocks in the ranges */
+		end = first_block + context->k_leaf;
+		if (end > commit->total_blocks)
+			end = commit->total_blocks;
+		for (block = first_block; block < end; block += run) {
+			for (run = 0; block + run < end &&
+					commit_intersects(commit, block + run,
+						block + run); run++)
+				;
+			if (run == 0) {
+				run = 1;
+				continue;
+			}
+			status = hash_blocks(context, block, run, digests +
+					(block - first_block) * context->hash_size);
+			if (status)
+				return status;
+		}
+	} else {
+		children = node_children(record, &store->header);
+		for (i = 0; i < context->k; i++) {
+			start = first_block + i * commit->span[depth - 1];
+			if (start >= commit->total_blocks)
+				break;
+			end = start + commit->span[depth - 1] - 1;
+			if (!commit_intersects(commit, start, end))
+				continue;
+
+			status = commit_node(commit, children[i], depth - 1, start,
+					&children[i], digests + i * context->hash_size);
+			if (status)
+				return status;
+			/* the children reuse the buffers below this depth */
+		}
+	}
+
+	SHA1_Init(&hash);
+	SHA1_Update(&hash, digests, (depth == 1 ? context->k_leaf :
+				context->k) * context->hash_size);
+	SHA1_Final(node_digest, &hash);
+	memcpy(digest, node_digest, context->hash_size);
+
+	commit->written++;
+	return store_append(store, record, node_record_size(&store->header,
+				depth), result);
+}
+
+/* write a new version of the tree, sharing every node outside of
+ * the given ranges with the latest version */
+int merkle_commit(const struct merkle_context *context,
+		struct merkle_store *store, const struct merkle_range *ranges,
+		uint64_t count, uint64_t total_blocks, uint64_t *number)
+{
+	const struct store_version *latest = version_find(store, 0);
+	struct store_commit commit;
+	struct store_version version;
+	struct merkle_range all = { 0, total_blocks - 1 };
+	uint64_t leaves = total_blocks / context->k_leaf +
+		(total_blocks % context->k_leaf ? 1 : 0);
+	uint8_t depth = merkle_depth(context->k, leaves);
+	uint64_t length = store->length;
+	uint8_t i;
+	int status;
+
+	if (total_blocks == 0)
+		return EINVAL;
+
+	status = store_buffers(store, depth);
+	if (status)
+		return status;
+
+	/* drop anything left by a commit that didn't finish */
+	if (ftruncate(store->fd, store->length) == -1) {
+		status = errno;
+		fprintf(stderr, "store: ftruncate(%lu) failed with %d\n",
+				store->length, status);
+		return status;
+	}
+
+	commit.context = context;
+	commit.store = store;
+	commit.ranges = ranges;
+	commit.count = count;
+	commit.total_blocks = total_blocks;
+	commit.written = 0;
+	commit.span[1] = context->k_leaf;
+	for (i = 2; i <= depth; i++)
+		commit.span[i] = commit.span[i-1] > UINT64_MAX / context->k ?
+			UINT64_MAX : commit.span[i-1] * context->k;
+
+	memset(&version, 0, sizeof(version));
+	version.type = RECORD_VERSION;
+	version.depth = depth;
+	version.version = latest ? latest->version + 1 : 1;
+	version.total_blocks = total_blocks;
+	version.previous = store->header.last_version;
+
+	/* the node offsets are only shared by trees of the same shape */
+	if (latest == NULL || latest->total_blocks != total_blocks) {
+		commit.ranges = &all;
+		commit.count = 1;
+		if (context->verbose && latest)
+			printf("block count changed from %lu, writing every node\n",
+					latest->total_blocks);
+		latest = NULL;
+	}
+
+	status = commit_node(&commit, latest ? latest->root : STORE_NONE,
+			depth, 0, &version.root, version.digest);
+	if (status)
+		goto out_discard;
+
+	/* the nodes must be durable before the version that refers to
+	 * them, and the version before the header */
+	status = store_flush(store);
+	if (status)
+		goto out_discard;
+	if (fdatasync(store->fd) == -1) {
+		status = errno;
+		fprintf(stderr, "store: fdatasync() failed with %d\n", status);
+		goto out_discard;
+	}
+
+	version_checksum(&version, version.checksum);
+	status = write_at(store->fd, store->length,
+			(unsigned char*)&version, sizeof(version));
+	if (status)
+		goto out_discard;
+	if (fdatasync(store->fd) == -1) {
+		status = errno;
+		fprintf(stderr, "store: fdatasync() failed with %d\n", status);
+		goto out_discard;
+	}
+
+	status = version_add(store, &version);
+	if (status)
+		return status;
+	store->header.last_version = store->length;
+	store->length += sizeof(version);
+
+	/* a stale header is corrected by the next open */
+	status = write_at(store->fd, 0, (unsigned char*)&store->header,
+			sizeof(store->header));
+	if (status)
+		return status;
+
+	if (context->verbose)
+		printf("version %lu committed with %lu new nodes\n",
+				version.version, commit.written);
+	*number = version.version;
+	return 0;
+
+out_discard:
+	/* the nodes of the failed commit are overwritten by the next */
+	store->append_length = 0;
+	store->length = length;
+	return status;
+}
+
+
+/* state for comparing two versions */
+struct store_diff {
+	const struct merkle_context *context;
+	struct merkle_store *store;
+	unsigned char **others; /* node buffers for the second version */
+	uint64_t total_blocks;
+	uint64_t span[65];
+	merkle_diff_fn callback;
+	void *user;
+	uint64_t from_block, to_block; /* pending range of blocks */
+	uint8_t pending;
+	uint64_t shared; /* subtrees skipped by identity */
+};
+
+/* add a differing block, reporting the pending range once it ends */
+static int diff_block(struct store_diff *diff, uint64_t block)
+{
+	int status;
+
+	if (diff->pending && diff->to_block + 1 == block) {
+		diff->to_block = block;
+		return 0;
+	}
+	if (diff->pending) {
+		status = diff->callback(diff->from_block, diff->to_block,
+				diff->user);
+		if (status)
+			return status;
+	}
+	diff->from_block = diff->to_block = block;
+	diff->pending = 1;
+	return 0;
+}
+
+/* compare two copies of a node, descending only into the children
+ * whose digests differ. children at the same offset are shared by
+ * both versions, so they're skipped without comparing them */
+static int diff_node(struct store_diff *diff, uint64_t ours,
+		uint64_t theirs, uint8_t depth, uint64_t first_block)
+{
+	const struct merkle_context *context = diff->context;
+	struct merkle_store *store = diff->store;
+	unsigned char *record = store->nodes[depth];
+	unsigned char *other = diff->others[depth];
+	uint64_t *children, *other_children, start;
+	uint8_t i;
+	int status;
+
+	if (ours == theirs) {
+		diff->shared++;
+		return 0;
+	}
+
+	status = node_read(store, ours, depth, record);
+	if (status)
+		return status;
+	status = node_read(store, theirs, depth, other);
+	if (status)
+		return status;
+	children = node_children(record, &store->header);
+	other_children = node_children(other, &store->header);
+
+	for (i = 0; i < (depth > 1 ? context->k : context->k_leaf); i++) {
+		start = first_block + i * (depth > 1 ? diff->span[depth - 1] : 1);
+		if (start >= diff->total_blocks)
+			break;
+		if (depth > 1 && children[i] == other_children[i]) {
+			diff->shared++;
+			continue;
+		}
+		if (memcmp(node_digests(record) + i * context->hash_size,
+					node_digests(other) + i * context->hash_size,
+					context->hash_size) == 0)
+			continue;
+
+		if (depth == 1)
+			status = diff_block(diff, start);
+		else
+			status = diff_node(diff, children[i], other_children[i],
+					depth - 1, start);
+		if (status)
+			return status;
+	}
+	return 0;
+}
+
+/* compare two versions of the tree, invoking the callback with each
+ * range of blocks whose hashes differ */
+int merkle_snapdiff(const struct merkle_context *context,
+		struct merkle_store *store, uint64_t first, uint64_t second,
+		merkle_diff_fn callback, void *user)
+{
+	const struct store_version *ours = version_find(store, first);
+	const struct store_version *theirs = version_find(store, second);
+	struct store_diff diff;
+	uint8_t i;
+	int status;
+
+	if (ours == NULL || theirs == NULL) {
+		fprintf(stderr, "store: no version %lu\n",
+				ours == NULL ? first : second);
+		return ENOENT;
+	}
+
+	/* trees of different sizes don't share their node offsets */
+	if (ours->total_blocks != theirs->total_blocks) {
+		fprintf(stderr, "store: versions %lu and %lu cover different "
+				"block counts\n", ours->version, theirs->version);
+		return EINVAL;
+	}
+
+	status = store_buffers(store, ours->depth);
+	if (status)
+		return status;
+
+	memset(&diff, 0, sizeof(diff));
+	diff.context = context;
+	diff.store = store;
+	diff.total_blocks = ours->total_blocks;
+	diff.callback = callback;
+	diff.user = user;
+	diff.span[1] = context->k_leaf;
+	for (i = 2; i <= ours->depth; i++)
+		diff.span[i] = diff.span[i-1] > UINT64_MAX / context->k ?
+			UINT64_MAX : diff.span[i-1] * context->k;
+
+	diff.others = (unsigned char**)calloc(ours->depth + 1,
+			sizeof(unsigned char*));
+	if (diff.others == NULL)
+		return errno;
+	for (i = 1; i <= ours->depth; i++) {
+		diff.others[i] = (unsigned char*)malloc(node_buffer_size(
+					&store->header));
+		if (diff.others[i] == NULL) {
+			status = errno;
+			goto out_free;
+		}
+	}
+
+	status = diff_node(&diff, ours->root, theirs->root, ours->depth, 0);
+	if (status == 0 && diff.pending)
+		status = callback(diff.from_block, diff.to_block, user);
+
+	if (context->verbose)
+		printf("%lu shared subtrees skipped\n", diff.shared);
+out_free:
+	for (i = 1; i <= ours->depth; i++)
+		free(diff.others[i]);
+	free(diff.others);
+	return status;
+}
+
+
+/* state for copying the live nodes into a new store */
+struct store_compact {
+	const struct merkle_context *context;
+	struct merkle_store *store; /* the new store */
+	const struct merkle_store *old;
+	unsigned char **nodes; /* node buffers for each depth */
+	/* open-addressed table of old offsets to new offsets */
+	uint64_t *table;
+	uint64_t table_size, count; /* table_size is a power of 2 */
+};
+
+/* return the table slot for the given old offset, which is either
+ * empty or holds that offset */
+static uint64_t compact_slot(const struct store_compact *compact,
+		uint64_t offset)
+{
+	uint64_t mask = compact->table_size - 1;
+	uint64_t slot = (offset * 0x9E3779B97F4A7C15ULL) & mask;
+
+	while (compact->table[2 * slot] &&
+			compact->table[2 * slot] != offset)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+/* double the size of the table */
+static int compact_grow(struct store_compact *compact)
+{
+	uint64_t *old = compact->table, size = compact->table_size, i, slot;
+
+	compact->table_size = size ? size * 2 : 1024;
+	compact->table = (uint64_t*)calloc(2 * compact->table_size,
+			sizeof(uint64_t));
+	if (compact->table == NULL) {
+		compact->table = old;
+		compact->table_size = size;
+		return errno;
+	}
+
+	for (i = 0; i < size; i++) {
+		if (old[2 * i] == 0)
+			continue;
+		slot = compact_slot(compact, old[2 * i]);
+		compact->table[2 * slot] = old[2 * i];
+		compact->table[2 * slot + 1] = old[2 * i + 1];
+	}
+	free(old);
+	return 0;
+}
+
+/* copy a node and the children it doesn't share with a node that was
+ * already copied, returning its offset in the new store */
+static int compact_node(struct store_compact *compact, uint64_t offset,
+		uint8_t depth, uint64_t *result)
+{
+	const struct merkle_context *context = compact->context;
+	unsigned char *record = compact->nodes[depth];
+	uint64_t *children, slot;
+	uint8_t i;
+	int status;
+
+	if (offset == STORE_NONE) {
+		*result = STORE_NONE;
+		return 0;
+	}
+
+	/* keep the table at most half full */
+	if (2 * (compact->count + 1) > compact->table_size) {
+		status = compact_grow(compact);
+		if (status)
+			return status;
+	}
+	slot = compact_slot(compact, offset);
+	if (compact->table[2 * slot]) {
+		*result = compact->table[2 * slot + 1];
+		return 0;
+	}
+
+	status = node_read(compact->old, offset, depth, record);
+	if (status)
+		return status;
+
+	if (depth > 1) {
+		children = node_children(record, &compact->store->header);
+		for (i = 0; i < context->k; i++) {
+			status = compact_node(compact, children[i], depth - 1,
+					&children[i]);
+			if (status)
+				return status;
+		}
+	}
+
+	status = store_append(compact->store, record, node_record_size(
+				&compact->store->header, depth), result);
+	if (status)
+		return status;
+
+	/* the table may have grown while copying the children */
+	slot = compact_slot(compact, offset);
+	compact->table[2 * slot] = offset;
+	compact->table[2 * slot + 1] = *result;
+	compact->count++;
+	return 0;
+}
+
+/* copy the versions from oldest on, and the nodes they refer to, into
+ * a new store, then rename it over the store at path. the store's file
+ * descriptor is replaced with the new store */
+int merkle_compact(const struct merkle_context *context,
+		struct merkle_store *store, const char *path, uint64_t oldest)
+{
+	struct store_compact compact;
+	struct merkle_store copy;
+	struct store_version version;
+	uint64_t i, kept = 0, length = store->length;
+	size_t size = strlen(path);
+	char *temp;
+	uint8_t depth, j;
+	int status;
+
+	/* never remove every version */
+	if (version_find(store, oldest) == NULL) {
+		fprintf(stderr, "store: no version %lu\n", oldest);
+		return ENOENT;
+	}
+
+	memset(&compact, 0, sizeof(compact));
+	memset(&copy, 0, sizeof(copy));
+	compact.context = context;
+	compact.store = &copy;
+	compact.old = store;
+
+	temp = (char*)malloc(size + 5);
+	if (temp == NULL)
+		return errno;
+	memcpy(temp, path, size);
+	memcpy(temp + size, ".tmp", 5);
+
+	for (i = 0, depth = 1; i < store->count; i++)
+		if (store->versions[i].depth > depth)
+			depth = store->versions[i].depth;
+	compact.nodes = (unsigned char**)calloc(depth + 1,
+			sizeof(unsigned char*));
+	copy.append = (unsigned char*)malloc(APPEND_SIZE);
+	if (compact.nodes == NULL || copy.append == NULL) {
+		status = ENOMEM;
+		goto out_free;
+	}
+	for (j = 1; j <= depth; j++) {
+		compact.nodes[j] = (unsigned char*)malloc(node_buffer_size(
+					&store->header));
+		if (compact.nodes[j] == NULL) {
+			status = errno;
+			goto out_free;
+		}
+	}
+
+	copy.fd = open(temp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (copy.fd == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to open store file "
+				"'%s' with error %d.\n", temp, status);
+		goto out_free;
+	}
+	copy.header = store->header;
+	copy.header.last_version = STORE_NONE;
+	copy.length = sizeof(copy.header);
+
+	for (i = 0; i < store->count; i++) {
+		version = store->versions[i];
+		if (version.version < oldest)
+			continue;
+
+		status = compact_node(&compact, version.root, version.depth,
+				&version.root);
+		if (status)
+			goto out_close;
+		status = store_flush(&copy);
+		if (status)
+			goto out_close;
+
+		version.previous = copy.header.last_version;
+		version_checksum(&version, version.checksum);
+		status = store_append(&copy, (unsigned char*)&version,
+				sizeof(version), &copy.header.last_version);
+		if (status)
+			goto out_close;
+		kept++;
+	}
+
+	status = store_flush(&copy);
+	if (status)
+		goto out_close;
+	status = write_at(copy.fd, 0, (unsigned char*)&copy.header,
+			sizeof(copy.header));
+	if (status)
+		goto out_close;
+
+	if (fdatasync(copy.fd) == -1 || rename(temp, path) == -1) {
+		status = errno;
+		fprintf(stderr, "Failed to write store file "
+				"'%s' with error %d.\n", path, status);
+		goto out_close;
+	}
+
+	/* continue with the new store in place of the old one */
+	if (dup2(copy.fd, store->fd) == -1) {
+		status = errno;
+		goto out_close;
+	}
+	store->header = copy.header;
+	status = store_load(store);
+
+	if (context->verbose)
+		printf("compacted %lu versions from %lu to %lu bytes\n",
+				kept, length, store->length);
+out_close:
+	close(copy.fd);
+	if (status)
+		unlink(temp);
+out_free:
+	for (j = 1; compact.nodes && j <= depth; j++)
+		free(compact.nodes[j]);
+	free(compact.nodes);
+	free(compact.table);
+	free(copy.append);
+	free(temp);
+	return status;
+}
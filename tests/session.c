@@ -0,0 +1,232 @@
+/* exercise the session api over a small input file: update, verify,
+ * a change that verify finds and update fixes, and truncates that
+ * shrink and grow the file. after each truncate, the hash file must
+ * match one written from scratch over the same blocks.
+ *
+ * usage: tests/session */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "merkle.h"
+
+#define BLOCK_SIZE 512
+#define BLOCKS 1000
+
+static int failures;
+
+#define expect(cond) do { \
+	if (!(cond)) { \
+		printf("FAIL: %s (%s, line %d)\n", #cond, name, __LINE__); \
+		failures++; \
+	} \
+} while (0)
+
+/* tree parameters of each pass */
+static const struct {
+	uint8_t k, k_leaf, blocked;
+} params[] = {
+	{ 4, 4, 0 },
+	{ 4, 16, 0 },
+	{ 16, 16, 1 },
+};
+
+/* write the given bytes of random data to a new file */
+static int write_random(const char *path, size_t size)
+{
+	unsigned char buffer[BLOCK_SIZE];
+	size_t i, n;
+	int fd, status = 0;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		return errno;
+	for (; size && status == 0; size -= n) {
+		n = size < sizeof(buffer) ? size : sizeof(buffer);
+		for (i = 0; i < n; i++)
+			buffer[i] = rand();
+		if (write(fd, buffer, n) != (ssize_t)n)
+			status = errno ? errno : EIO;
+	}
+	close(fd);
+	return status;
+}
+
+/* return nonzero if the two files have the same contents */
+static int same_file(const char *a, const char *b)
+{
+	unsigned char ba[4096], bb[4096];
+	ssize_t na, nb;
+	int fa, fb, same = 0;
+
+	fa = open(a, O_RDONLY);
+	fb = open(b, O_RDONLY);
+	if (fa == -1 || fb == -1)
+		goto out;
+	do {
+		na = read(fa, ba, sizeof(ba));
+		nb = read(fb, bb, sizeof(bb));
+		if (na != nb || na < 0 || memcmp(ba, bb, na))
+			goto out;
+	} while (na);
+	same = 1;
+out:
+	if (fa != -1)
+		close(fa);
+	if (fb != -1)
+		close(fb);
+	return same;
+}
+
+/* write a tree from scratch over input in a second hash file, and
+ * compare it with the tree in hash */
+static int same_tree(const struct merkle_context *context,
+		const char *input, const char *hash, const char *fresh)
+{
+	struct merkle_session *session;
+	uint64_t blocks;
+	int status;
+
+	unlink(fresh);
+	if (merkle_session_open(context, input, fresh, 1, &session))
+		return 0;
+	blocks = merkle_session_blocks(session);
+	status = merkle_session_update(session, 0, blocks - 1);
+	merkle_session_close(session);
+	return status == 0 && same_file(hash, fresh);
+}
+
+/* flip a byte of the given block of the input file */
+static int flip(const char *path, uint64_t block)
+{
+	unsigned char byte;
+	int fd, status = 0;
+
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		return errno;
+	if (pread(fd, &byte, 1, block * BLOCK_SIZE + 7) != 1)
+		status = EIO;
+	byte ^= 0xff;
+	if (status == 0 && pwrite(fd, &byte, 1, block * BLOCK_SIZE + 7) != 1)
+		status = EIO;
+	close(fd);
+	return status;
+}
+
+static void run(const char *dir, unsigned p)
+{
+	struct merkle_context context;
+	struct merkle_session *session;
+	char input[256], hash[256], fresh[256], name[64];
+	uint64_t blocks;
+
+	snprintf(name, sizeof(name), "k %u, k_leaf %u%s", params[p].k,
+			params[p].k_leaf, params[p].blocked ? ", blocked" : "");
+	snprintf(input, sizeof(input), "%s/input", dir);
+	snprintf(hash, sizeof(hash), "%s/input.h", dir);
+	snprintf(fresh, sizeof(fresh), "%s/fresh.h", dir);
+
+	memset(&context, 0, sizeof(context));
+	context.block_size = BLOCK_SIZE;
+	context.hash_size = 20;
+	context.k = params[p].k;
+	context.k_leaf = params[p].k_leaf;
+	context.blocked = params[p].blocked;
+	context.node_size = (context.k > context.k_leaf ?
+			context.k : context.k_leaf) * context.hash_size;
+	context.fd_in = -1;
+	context.fd_out = -1;
+
+	unlink(hash);
+	expect(write_random(input, BLOCKS * BLOCK_SIZE - 3) == 0);
+
+	/* a session over missing files fails to open */
+	expect(merkle_session_open(&context, fresh, hash, 0, &session)
+			== ENOENT);
+
+	expect(merkle_session_open(&context, input, hash, 1, &session) == 0);
+	if (failures)
+		return;
+	blocks = merkle_session_blocks(session);
+	expect(blocks == BLOCKS);
+
+	/* hash the whole file in two ranges, and verify it in others */
+	expect(merkle_session_update(session, 0, 499) == 0);
+	expect(merkle_session_update(session, 500, blocks - 1) == 0);
+	expect(merkle_session_verify(session, 0, blocks - 1) == 0);
+	expect(merkle_session_verify(session, 123, 456) == 0);
+	expect(same_tree(&context, input, hash, fresh));
+
+	/* ranges past the end are rejected */
+	expect(merkle_session_verify(session, 0, blocks) == ERANGE);
+	expect(merkle_session_update(session, 10, 9) == ERANGE);
+
+	/* a changed block fails verify until it's rehashed */
+	expect(flip(input, 321) == 0);
+	expect(merkle_session_verify(session, 0, blocks - 1) != 0);
+	expect(merkle_session_verify(session, 0, 300) == 0);
+	expect(merkle_session_update(session, 321, 321) == 0);
+	expect(merkle_session_verify(session, 0, blocks - 1) == 0);
+	expect(same_tree(&context, input, hash, fresh));
+
+	/* shrink, then grow past the original size */
+	expect(merkle_session_truncate(session, 377) == 0);
+	expect(merkle_session_blocks(session) == 377);
+	expect(merkle_session_verify(session, 0, 376) == 0);
+	expect(same_tree(&context, input, hash, fresh));
+
+	expect(merkle_session_truncate(session, 1500) == 0);
+	expect(merkle_session_blocks(session) == 1500);
+	expect(merkle_session_verify(session, 0, 1499) == 0);
+	expect(same_tree(&context, input, hash, fresh));
+
+	expect(merkle_session_truncate(session, 1500) == EINVAL);
+	expect(merkle_session_truncate(session, 0) == EINVAL);
+	merkle_session_close(session);
+
+	/* a read-only session verifies the tree left by the other */
+	expect(merkle_session_open(&context, input, hash, 0, &session) == 0);
+	if (failures)
+		return;
+	expect(merkle_session_blocks(session) == 1500);
+	expect(merkle_session_verify(session, 0, 1499) == 0);
+	expect(merkle_session_update(session, 0, 0) != 0);
+	merkle_session_close(session);
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/merkle-session.XXXXXX";
+	char path[256];
+	unsigned p;
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	srand(1);
+
+	for (p = 0; p < sizeof(params) / sizeof(params[0]); p++)
+		run(dir, p);
+
+	snprintf(path, sizeof(path), "%s/input", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/input.h", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/fresh.h", dir);
+	unlink(path);
+	rmdir(dir);
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("all session tests passed\n");
+	return 0;
+}
@@ -0,0 +1,80 @@
+#!/bin/sh
+# exercise 64-bit block ranges over a sparse input file of 128T, or
+# the largest power of two below it that the file system allows. only
+# the ranges near the end of the file and around block 2^32 are
+# written, so the input and hash files stay sparse.
+#
+# usage: tests/sparse.sh [merkle binary] [size]
+
+MERKLE=${1:-./merkle}
+SIZE=${2:-128T}
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/merkle-sparse.XXXXXX") || exit 1
+INPUT=$DIR/input
+HASH=$DIR/input.h
+BS=512
+failures=0
+
+trap 'rm -rf "$DIR"' EXIT
+
+# expect the command to succeed
+pass() {
+	if ! "$@" > "$DIR/out" 2>&1; then
+		echo "FAIL: $*"
+		cat "$DIR/out"
+		failures=$((failures + 1))
+	fi
+}
+
+# expect the command to fail
+fail() {
+	if "$@" > "$DIR/out" 2>&1; then
+		echo "FAIL (expected an error): $*"
+		failures=$((failures + 1))
+	fi
+}
+
+# fall back to smaller sizes on file systems with a lower limit
+until truncate -s "$SIZE" "$INPUT" 2> /dev/null; do
+	case $SIZE in
+	128T) SIZE=64T ;;
+	64T) SIZE=32T ;;
+	32T) SIZE=16T ;;
+	16T) SIZE=8T ;;
+	*) echo "SKIP: can't create a sparse file of 8T"; exit 77 ;;
+	esac
+done
+BYTES=$(stat -c %s "$INPUT")
+BLOCKS=$((BYTES / BS))
+LAST=$((BLOCKS - 1))
+MID=4294967296 # 2^32, past the range of 32-bit block numbers
+echo "sparse input of $SIZE, $BLOCKS blocks of $BS bytes"
+
+for opts in "-k 4" "-k 4 -K 16" "-k 16 -L"; do
+	rm -f "$HASH"
+
+	# hash the end of the file, and a range across block 2^32
+	pass "$MERKLE" write -b $BS $opts -r $((LAST - 99)) $LAST "$INPUT" "$HASH"
+	pass "$MERKLE" verify -b $BS $opts -r $((LAST - 99)) $LAST "$INPUT" "$HASH"
+	pass "$MERKLE" write -b $BS $opts -r $((MID - 8)) $((MID + 8)) "$INPUT" "$HASH"
+	pass "$MERKLE" verify -b $BS $opts -r $((MID - 8)) $((MID + 8)) "$INPUT" "$HASH"
+	pass "$MERKLE" verify -b $BS $opts -r $((LAST - 99)) $LAST "$INPUT" "$HASH"
+
+	# blocks that were never hashed don't verify
+	fail "$MERKLE" verify -b $BS $opts -r $((MID + 1000)) $((MID + 1001)) "$INPUT" "$HASH"
+
+	# a change to the last block is found, and fixed by rehashing it
+	printf 'x' | dd of="$INPUT" bs=1 seek=$((BYTES - 1)) conv=notrunc 2> /dev/null
+	fail "$MERKLE" verify -b $BS $opts -r $((LAST - 1)) $LAST "$INPUT" "$HASH"
+	pass "$MERKLE" write -b $BS $opts -r $((LAST - 1)) $LAST "$INPUT" "$HASH"
+	pass "$MERKLE" verify -b $BS $opts -r $((LAST - 99)) $LAST "$INPUT" "$HASH"
+	printf '\0' | dd of="$INPUT" bs=1 seek=$((BYTES - 1)) conv=notrunc 2> /dev/null
+
+	# ranges past the end of the file are rejected
+	fail "$MERKLE" write -b $BS $opts -r $LAST $BLOCKS "$INPUT" "$HASH"
+done
+
+if [ $failures -ne 0 ]; then
+	echo "$failures failures"
+	exit 1
+fi
+echo "all sparse tests passed"
@@ -1,7 +1,6 @@
 #ifndef COHORT_MERKLE_TREE_H
 #define COHORT_MERKLE_TREE_H
 
-#include <math.h>
 #include <stdint.h>
 
 
@@ -29,6 +28,9 @@ static inline uint8_t log2n_ceil(uint64_t value, uint8_t n)
 /* return the minimum depth required to hold the given number of leaves */
 static inline uint8_t merkle_depth(uint8_t k, uint64_t leaves)
 {
+	uint64_t capacity = 1;
+	uint8_t depth = 1;
+
 	/* depth = 1 + ceil( logk(leaves) ) */
 	switch (k) {
 		/* optimization for powers of 2 */
@@ -40,11 +42,47 @@ static inline uint8_t merkle_depth(uint8_t k, uint64_t leaves)
 		case 64:  return 1 + log2n_ceil(leaves, 6);
 		case 128: return 1 + log2n_ceil(leaves, 7);
 	}
-	/* otherwise use log10() and convert the base
-	 * XXX: precision problems with larger values */
-	return 1 + (uint8_t)(ceil(
-				log10((double)leaves) /
-				log10((double)k)));
+	/* otherwise count the levels needed to cover the leaves, which
+	 * avoids the precision problems of log() on larger values */
+	while (capacity < leaves) {
+		depth++;
+		if (capacity > UINT64_MAX / k)
+			break; /* the next level covers every 64-bit count */
+		capacity *= k;
+	}
+	return depth;
+}
+
+/* return the total number of nodes in a tree with the given number of
+ * leaves. nodes are numbered densely, so this is also the index of the
+ * root's parent, where the root checksum is stored */
+static inline uint64_t merkle_nodes(uint8_t k, uint64_t leaves)
+{
+	uint64_t nodes = 0;
+	uint8_t depth = merkle_depth(k, leaves);
+	while (depth--) {
+		nodes += leaves;
+		leaves = leaves / k + (leaves % k ? 1 : 0);
+	}
+	return nodes;
+}
+
+/* return the offset of a node's digests in the hash file, counted in
+ * digests, given the number of leaves numbered before it. leaves hold
+ * k_leaf digests and the nodes above them k, so a node's offset
+ * depends on how many of the nodes before it are leaves */
+static inline uint64_t merkle_offset(uint8_t k_leaf, uint8_t k,
+		uint64_t node, uint64_t leaves)
+{
+	return leaves * k_leaf + (node - leaves) * k;
+}
+
+/* return the offset of the root checksum, counted in digests, which
+ * comes after the digests of every node */
+static inline uint64_t merkle_root_offset(uint8_t k_leaf, uint8_t k,
+		uint64_t leaves)
+{
+	return merkle_offset(k_leaf, k, merkle_nodes(k, leaves), leaves);
 }
 
 /* return the nth child node index of the given parent */
@@ -1,38 +1,164 @@
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #include <openssl/sha.h>
 
 #include "merkle.h"
+#include "journal.h"
+#include "probes.h"
 #include "update.h"
 #include "visitor.h"
+#include "tree.h"
 
 
-static int truncate_leaf(const struct merkle_state *node, uint64_t block,
-		uint8_t position, void *user);
-static int truncate_node(const struct merkle_state *node,
-		uint8_t depth, void *user);
+static int truncate_leaf_range(const struct merkle_state *node,
+		uint64_t first_block, uint8_t count, void *user);
+static int truncate_node_range(const struct merkle_state *nodes,
+		uint8_t count, uint8_t depth, void *user);
 static int truncate_root(const struct merkle_state *node,
 		uint8_t depth, void *user);
+static int grow_leaf_range(const struct merkle_state *node,
+		uint64_t first_block, uint8_t count, void *user);
+static int grow_node_range(const struct merkle_state *nodes,
+		uint8_t count, uint8_t depth, void *user);
+static int grow_root(const struct merkle_state *node,
+		uint8_t depth, void *user);
+static int rebuild(struct merkle_context *context,
+		uint64_t total_blocks);
+static int relocate(struct merkle_context *context,
+		uint64_t old_total_blocks, uint64_t new_total_blocks);
 
+/* maximum tree depth, bounded by 64-bit block numbers with k=2 */
+#define MAX_DEPTH 64
 
-/* update the hash tree to reflect the given new last block,
- * truncating the hash file and regenerating the root checksum. */
-int merkle_truncate(struct merkle_context *context,
+/* most bytes of digests moved by each read and write of a relocation */
+#define RELOCATE_BUFFER (1 << 18)
+
+/* state for rebuilding the tree in the blocked layout */
+struct rebuild_state {
+	struct merkle_context *context;
+	uint64_t total_blocks;
+};
+
+/* state for growing the tree over new zero-filled blocks */
+struct grow_state {
+	struct merkle_context *context;
+	uint64_t old_total_blocks;
+	/* digests of all-zero subtrees, indexed by depth */
+	unsigned char zeroes[MAX_DEPTH][SHA_DIGEST_LENGTH];
+};
+
+/* state for moving digests from the old blocked layout to the new one.
+ * offsets and lengths are counted in digests */
+struct relocate_state {
+	const struct merkle_context *context;
+	unsigned char *buffer;
+	int grow; /* runs are moved from the end of the file */
+	/* pending run, merged with the runs adjacent to it in both layouts */
+	uint64_t from, to, length;
+};
+
+
+/* rehash the path over the new last block, zeroing the digests after
+ * it, and truncate the hash file after the root checksum */
+static int truncate_tree(struct merkle_context *context,
 		uint64_t new_last_block)
 {
-	struct merkle_visitor visitor = {
-		truncate_leaf,
-		truncate_node,
+	struct merkle_range_visitor visitor = {
+		truncate_leaf_range,
+		truncate_node_range,
 		truncate_root,
 		context
 	};
+
 	/* traverse only the nodes with 'new_last_block' in their range */
-	return merkle_visit(&visitor, context->k,
+	return merkle_visit_ranges(&visitor, context,
 			new_last_block, new_last_block, new_last_block + 1);
 }
 
+/* update the hash tree to reflect the given new last block,
+ * truncating the hash file and regenerating the root checksum. */
+int merkle_truncate(struct merkle_context *context,
+		uint64_t new_last_block)
+{
+	/* without the old size, the nodes of the blocked layout can't be
+	 * found to move them */
+	if (context->blocked)
+		return rebuild(context, new_last_block + 1);
+
+	return journal_finish(context, truncate_tree(context, new_last_block));
+}
+
+/* update the hash tree to reflect a new total block count. blocks
+ * added past the old end of file are assumed to contain zeroes */
+int merkle_resize(struct merkle_context *context,
+		uint64_t old_total_blocks, uint64_t new_total_blocks)
+{
+	struct merkle_range_visitor visitor = {
+		grow_leaf_range,
+		grow_node_range,
+		grow_root,
+		NULL
+	};
+	struct grow_state grow;
+	SHA_CTX hash;
+	uint64_t leaves;
+	uint8_t depth, maxdepth, width;
+	int status;
+
+	if (new_total_blocks == 0)
+		return EINVAL;
+	if (new_total_blocks == old_total_blocks)
+		return 0;
+
+	/* a change in size moves the nodes of the blocked layout. move
+	 * their digests first, and the traversals below find them in
+	 * their new places */
+	if (context->blocked && old_total_blocks) {
+		status = relocate(context, old_total_blocks, new_total_blocks);
+		if (status)
+			return journal_finish(context, status);
+	}
+	if (new_total_blocks < old_total_blocks)
+		return journal_finish(context, truncate_tree(context,
+					new_total_blocks - 1));
+
+	grow.context = context;
+	grow.old_total_blocks = old_total_blocks;
+
+	/* precompute the digests of all-zero subtrees at each depth,
+	 * starting with the digest of a single zero block */
+	memset(context->block_buffer, 0, context->block_size);
+	SHA1_Init(&hash);
+	SHA1_Update(&hash, context->block_buffer, context->block_size);
+	SHA1_Final(grow.zeroes[0], &hash);
+
+	leaves = new_total_blocks / context->k_leaf +
+		(new_total_blocks % context->k_leaf ? 1 : 0);
+	maxdepth = merkle_depth(context->k, leaves);
+
+	for (depth = 1; depth < maxdepth; depth++) {
+		uint8_t i;
+		width = depth == 1 ? context->k_leaf : context->k;
+		for (i = 0; i < width; i++)
+			memcpy(context->node_buffer + i * context->hash_size,
+					grow.zeroes[depth-1], context->hash_size);
+		SHA1_Init(&hash);
+		SHA1_Update(&hash, context->node_buffer,
+				width * context->hash_size);
+		SHA1_Final(grow.zeroes[depth], &hash);
+	}
+
+	/* traverse only the nodes over the new blocks */
+	visitor.user = &grow;
+	return journal_finish(context, merkle_visit_ranges(&visitor, context,
+				old_total_blocks, new_total_blocks - 1,
+				new_total_blocks));
+}
+
 /* rehash the root node and truncate the hash file */
 static int truncate_root(const struct merkle_state *node,
 		uint8_t depth, void *user)
@@ -40,85 +166,441 @@ static int truncate_root(const struct merkle_state *node,
 	const struct merkle_context *context =
 		(const struct merkle_context*)user;
 	uint64_t truncate_offset = context->hash_size *
-		(node->parent * context->k + 1);
+		(node->parent_offset + 1);
 	int status;
 
 	/* generate the root checksum */
 	status = update_node(node, depth, user);
 	if (status)
 		return status;
+	MERKLE_PROBE(root, node->node, node->parent_offset);
 
 	/* truncate the hash file directly after the root checksum */
-	if (ftruncate(context->fd_out, truncate_offset) == -1) {
-		status = errno;
-		fprintf(stderr, "truncate: ftruncate(%lu) failed with %d\n",
-				truncate_offset, status);
+	status = truncate_hash(context, truncate_offset);
+	if (status)
 		return status;
-	}
 
 	if (context->verbose)
 		printf("truncated hash file at %lu\n", truncate_offset);
 	return 0;
 }
 
-/* write zeroes to the node hashes from the given position */
-static int zero_hashes(uint64_t node, uint8_t position,
-		uint8_t depth, const struct merkle_context *context)
+/* write zeroes to the hashes of the node with the given offset and
+ * width from the given position */
+static int zero_hashes(uint64_t node, uint64_t offset, uint8_t width,
+		uint8_t position, uint8_t depth,
+		const struct merkle_context *context)
 {
-	unsigned char digest[SHA_DIGEST_LENGTH] = { 0 };
-	uint64_t write_offset;
-	int status;
-
-	while (position < context->k) {
-		write_offset = context->hash_size *
-			(node * context->k + position);
+	uint64_t write_offset = context->hash_size * (offset + position);
+	size_t length = context->hash_size * (width - position);
 
-		if (context->verbose)
-			printf("%*swrote zeroes to node %lu.%u at offset %lu\n",
-					2*depth, "", node, position, write_offset);
+	if (position >= width)
+		return 0;
 
-		status = write_at(context->fd_out, write_offset,
-				digest, context->hash_size);
-		if (status)
-			return status;
+	if (context->verbose)
+		printf("%*swrote zeroes to node %lu.%u-%u at offset %lu\n",
+				2*depth, "", node, position, width - 1,
+				write_offset);
 
-		position++;
-	}
-	return 0;
+	/* zero the rest of the node with a single write */
+	memset(context->node_buffer, 0, length);
+	return write_hash(context, write_offset,
+			context->node_buffer, length);
 }
 
-/* rehash the child node and zero any parent hashes after */
-static int truncate_node(const struct merkle_state *node,
-		uint8_t depth, void *user)
+/* rehash the child node and zero any parent hashes after. only the
+ * nodes over the new last block are visited, one at a time */
+static int truncate_node_range(const struct merkle_state *nodes,
+		uint8_t count, uint8_t depth, void *user)
 {
 	const struct merkle_context *context =
 		(const struct merkle_context*)user;
+	const struct merkle_state *node = &nodes[count-1];
 	int status;
 
 	/* rehash this node into its parent */
-	status = update_node(node, depth, user);
+	status = update_node_range(nodes, count, depth, user);
 	if (status)
 		return status;
 
 	/* zero parent hashes for any nodes after this one */
-	return zero_hashes(node->parent, node->position + 1, depth, context);
+	return zero_hashes(node->parent, node->parent_offset, context->k,
+			node->position + 1, depth, context);
 }
 
 /* rehash the new last block and zero any node hashes after */
-static int truncate_leaf(const struct merkle_state *node, uint64_t block,
-		uint8_t position, void *user)
+static int truncate_leaf_range(const struct merkle_state *node,
+		uint64_t first_block, uint8_t count, void *user)
 {
 	const struct merkle_context *context =
 		(const struct merkle_context*)user;
+	uint8_t position = first_block + count - 1 - node->bstart;
 	int status;
 
 	/* if truncation was not on a block boundary, rehash this block */
 	if (context->partial) {
-		status = update_leaf(node, block, position, user);
+		status = update_leaf_range(node, first_block, count, user);
 		if (status)
 			return status;
 	}
 
 	/* zero node hashes for any blocks after this one */
-	return zero_hashes(node->node, position + 1, 0, context);
+	return zero_hashes(node->node, node->offset, context->k_leaf,
+			position + 1, 0, context);
+}
+
+/* write the zero block digest for each new block in the leaf node */
+static int grow_leaf_range(const struct merkle_state *node,
+		uint64_t first_block, uint8_t count, void *user)
+{
+	const struct grow_state *grow = (const struct grow_state*)user;
+	const struct merkle_context *context = grow->context;
+	uint8_t position = first_block - node->bstart;
+	uint64_t write_offset = context->hash_size *
+		(node->offset + position);
+	uint8_t i;
+
+	if (context->verbose)
+		printf("blocks %lu-%lu zero hashes written to node %lu.%u "
+				"at offset %lu\n", first_block, first_block + count - 1,
+				node->node, position, write_offset);
+
+	for (i = 0; i < count; i++)
+		memcpy(context->node_buffer + i * context->hash_size,
+				grow->zeroes[0], context->hash_size);
+
+	return write_hash(context, write_offset,
+			context->node_buffer, count * context->hash_size);
+}
+
+/* write the precomputed digest for child nodes that are entirely new
+ * and full of zeroes, or rehash those that are not */
+static int grow_node(const struct merkle_state *node,
+		uint8_t depth, void *user)
+{
+	const struct grow_state *grow = (const struct grow_state*)user;
+	const struct merkle_context *context = grow->context;
+	uint64_t write_offset = context->hash_size *
+		(node->parent_offset + node->position);
+
+	if (node->bstart < grow->old_total_blocks ||
+			node->bend - node->bstart < node->cleaves *
+			merkle_width(node, context->k_leaf, context->k))
+		return update_node(node, depth, grow->context);
+
+	if (context->verbose)
+		printf("%*snode %lu zero hash written to "
+				"node %lu.%u at offset %lu\n",
+				2*depth, "", node->node, node->parent,
+				node->position, write_offset);
+
+	return write_hash(context, write_offset,
+			(unsigned char*)grow->zeroes[depth], context->hash_size);
+}
+
+static int grow_node_range(const struct merkle_state *nodes,
+		uint8_t count, uint8_t depth, void *user)
+{
+	uint8_t i;
+	int status;
+
+	for (i = 0; i < count; i++) {
+		status = grow_node(&nodes[i], depth, user);
+		if (status)
+			return status;
+	}
+	return 0;
+}
+
+/* rehash the root node and truncate the hash file */
+static int grow_root(const struct merkle_state *node,
+		uint8_t depth, void *user)
+{
+	const struct grow_state *grow = (const struct grow_state*)user;
+	return truncate_root(node, depth, grow->context);
+}
+
+/* rehash the blocks of a leaf, and zero the digests past the last
+ * block, which a tree of another size may have left there */
+static int rebuild_leaf_range(const struct merkle_state *node,
+		uint64_t first_block, uint8_t count, void *user)
+{
+	const struct rebuild_state *rebuild =
+		(const struct rebuild_state*)user;
+	const struct merkle_context *context = rebuild->context;
+	int status;
+
+	status = update_leaf_range(node, first_block, count,
+			rebuild->context);
+	if (status)
+		return status;
+
+	return zero_hashes(node->node, node->offset, context->k_leaf,
+			node->bend - node->bstart, 0, context);
+}
+
+/* rehash the nodes into their parent, and zero the parent's digests
+ * past the last node of the tree */
+static int rebuild_node_range(const struct merkle_state *nodes,
+		uint8_t count, uint8_t depth, void *user)
+{
+	const struct rebuild_state *rebuild =
+		(const struct rebuild_state*)user;
+	const struct merkle_state *node = &nodes[count-1];
+	int status;
+
+	status = update_node_range(nodes, count, depth, rebuild->context);
+	if (status || node->bend < rebuild->total_blocks)
+		return status;
+
+	return zero_hashes(node->parent, node->parent_offset,
+			rebuild->context->k, node->position + 1, depth,
+			rebuild->context);
+}
+
+static int rebuild_root(const struct merkle_state *node,
+		uint8_t depth, void *user)
+{
+	const struct rebuild_state *rebuild =
+		(const struct rebuild_state*)user;
+	return truncate_root(node, depth, rebuild->context);
+}
+
+/* a change in size moves every node of the blocked layout, so rehash
+ * the whole tree in its new place */
+static int rebuild(struct merkle_context *context,
+		uint64_t total_blocks)
+{
+	struct rebuild_state rebuild = {
+		context,
+		total_blocks
+	};
+	struct merkle_range_visitor visitor = {
+		rebuild_leaf_range,
+		rebuild_node_range,
+		rebuild_root,
+		&rebuild
+	};
+
+	if (context->verbose)
+		printf("rebuilding the tree over %lu blocks\n", total_blocks);
+	return journal_finish(context, merkle_visit_ranges(&visitor, context,
+				0, total_blocks - 1, total_blocks));
+}
+
+/* move the pending run of digests to its new place */
+static int relocate_flush(struct relocate_state *relocate)
+{
+	const struct merkle_context *context = relocate->context;
+	size_t length = relocate->length * context->hash_size;
+	int status;
+
+	if (relocate->length == 0)
+		return 0;
+	relocate->length = 0;
+
+	status = read_hash(context, relocate->from * context->hash_size,
+			relocate->buffer, length);
+	if (status)
+		return status;
+	return write_hash(context, relocate->to * context->hash_size,
+			relocate->buffer, length);
+}
+
+/* add a run of digests that's contiguous in both layouts, merging it
+ * with the pending run when they're adjacent in both. runs come in
+ * the order they're moved, and each is at most a group, which fits
+ * in a page */
+static int relocate_run(struct relocate_state *relocate,
+		uint64_t from, uint64_t to, uint64_t length)
+{
+	uint64_t limit = RELOCATE_BUFFER / relocate->context->hash_size;
+	int status;
+
+	if (relocate->length && relocate->length + length <= limit) {
+		if (!relocate->grow && from == relocate->from + relocate->length &&
+				to == relocate->to + relocate->length) {
+			relocate->length += length;
+			return 0;
+		}
+		if (relocate->grow && from + length == relocate->from &&
+				to + length == relocate->to) {
+			relocate->from = from;
+			relocate->to = to;
+			relocate->length += length;
+			return 0;
+		}
+	}
+
+	status = relocate_flush(relocate);
+	/* digests that stay in place aren't read at all */
+	if (from != to) {
+		relocate->from = from;
+		relocate->to = to;
+		relocate->length = length;
+	}
+	return status;
+}
+
+/* add the nodes in [first, end) at the given depth, which are in the
+ * same group of the old layout, split where their groups in the new
+ * layout change */
+static int relocate_nodes(struct relocate_state *relocate,
+		const struct merkle_layout *from, const struct merkle_layout *to,
+		uint8_t depth, uint64_t first, uint64_t end)
+{
+	uint64_t per_group = to->levels[depth-1].per_group;
+	uint8_t width = depth == 1 ? from->k_leaf : from->k;
+	uint64_t i, next;
+	int status;
+
+	if (relocate->grow) {
+		for (i = end; i > first; i = next) {
+			next = (i - 1) / per_group * per_group;
+			if (next < first)
+				next = first;
+			status = relocate_run(relocate,
+					layout_blocked_offset(from, depth, next),
+					layout_blocked_offset(to, depth, next),
+					(i - next) * width);
+			if (status)
+				return status;
+		}
+		return 0;
+	}
+
+	for (i = first; i < end; i = next) {
+		next = (i / per_group + 1) * per_group;
+		if (next > end)
+			next = end;
+		status = relocate_run(relocate,
+				layout_blocked_offset(from, depth, i),
+				layout_blocked_offset(to, depth, i),
+				(next - i) * width);
+		if (status)
+			return status;
+	}
+	return 0;
+}
+
+/* move the digests of the nodes that the old and new trees share from
+ * their places in the old blocked layout to those in the new one, and
+ * zero the digests past the end of the new tree. a node keeps its
+ * depth and its index among the nodes at that depth, and its digests
+ * only change on the path over the last block, which the caller
+ * rehashes. when the tree grows, every node moves toward the end of
+ * the file, and toward its start when the tree shrinks, so the runs
+ * are moved in that order from the far end, like memmove() */
+static int relocate(struct merkle_context *context,
+		uint64_t old_total_blocks, uint64_t new_total_blocks)
+{
+	struct merkle_layout from, to;
+	struct relocate_state relocate;
+	const struct layout_level *level;
+	unsigned char root[SHA_DIGEST_LENGTH];
+	uint64_t bands, b, band, groups, g, group, first, end, children;
+	uint8_t lo, hi, j, d, depth, width;
+	int status;
+
+	merkle_layout_init(&from, context->k_leaf, context->k,
+			context->hash_size, 1, old_total_blocks);
+	merkle_layout_init(&to, context->k_leaf, context->k,
+			context->hash_size, 1, new_total_blocks);
+
+	relocate.context = context;
+	relocate.grow = new_total_blocks > old_total_blocks;
+	relocate.length = 0;
+	relocate.buffer = (unsigned char*)malloc(RELOCATE_BUFFER);
+	if (relocate.buffer == NULL)
+		return errno;
+
+	/* a deeper tree keeps the old root checksum in a new node, whose
+	 * place may still hold the digests of other nodes */
+	if (to.depth > from.depth) {
+		status = read_hash(context, context->hash_size *
+				merkle_root_offset(context->k_leaf, context->k,
+					from.levels[0].nodes),
+				root, context->hash_size);
+		if (status)
+			goto out_free;
+	}
+
+	if (context->verbose)
+		printf("moving the tree over %lu blocks to the layout "
+				"for %lu blocks\n", old_total_blocks,
+				new_total_blocks);
+
+	/* visit the old layout in order of offset, or in reverse: the
+	 * bands from the leaves up, the groups of each band, and the
+	 * levels of each group from the top down */
+	depth = from.depth < to.depth ? from.depth : to.depth;
+	bands = (from.depth + from.band - 1) / from.band;
+	for (b = 0; b < bands; b++) {
+		band = relocate.grow ? bands - 1 - b : b;
+		lo = band * from.band + 1;
+		hi = lo + from.band - 1;
+		if (hi > from.depth)
+			hi = from.depth;
+
+		groups = from.levels[hi-1].nodes;
+		for (g = 0; g < groups; g++) {
+			group = relocate.grow ? groups - 1 - g : g;
+
+			for (j = 0; j <= hi - lo; j++) {
+				d = relocate.grow ? lo + j : hi - j;
+				if (d > depth)
+					continue;
+
+				/* only the nodes in both trees */
+				level = &from.levels[d-1];
+				first = group * level->per_group;
+				end = first + level->per_group;
+				if (end > level->nodes)
+					end = level->nodes;
+				if (end > to.levels[d-1].nodes)
+					end = to.levels[d-1].nodes;
+				if (first >= end)
+					continue;
+
+				status = relocate_nodes(&relocate, &from, &to,
+						d, first, end);
+				if (status)
+					goto out_free;
+			}
+		}
+	}
+	status = relocate_flush(&relocate);
+	if (status)
+		goto out_free;
+
+	if (to.depth > from.depth) {
+		status = write_hash(context, context->hash_size *
+				layout_blocked_offset(&to, from.depth + 1, 0),
+				root, context->hash_size);
+		if (status)
+			goto out_free;
+	}
+
+	/* the last node at each depth may have digests past the end,
+	 * where the old layout had other nodes */
+	memset(relocate.buffer, 0, context->node_size);
+	for (depth = 1; depth <= to.depth; depth++) {
+		level = &to.levels[depth-1];
+		width = depth == 1 ? context->k_leaf : context->k;
+		children = depth == 1 ? new_total_blocks :
+			to.levels[depth-2].nodes;
+		first = children - (level->nodes - 1) * width;
+		if (first == width)
+			continue;
+
+		status = write_hash(context, context->hash_size *
+				(layout_blocked_offset(&to, depth,
+					level->nodes - 1) + first),
+				relocate.buffer, context->hash_size * (width - first));
+		if (status)
+			goto out_free;
+	}
+out_free:
+	free(relocate.buffer);
+	return status;
 }
@@ -1,17 +1,32 @@
+#define _GNU_SOURCE /* for F_OFD_SETLKW */
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 
 #include <openssl/sha.h>
 
 #include "merkle.h"
+#include "chunk.h"
+#include "journal.h"
+#include "map.h"
+#include "probes.h"
 #include "update.h"
 #include "visitor.h"
 
 
-static int update_root(const struct merkle_state *node,
-		uint8_t depth, void *user);
-
+void merkle_context_detach(struct merkle_context *context)
+{
+	context->journal = NULL;
+	context->map = NULL;
+	context->window = NULL;
+	context->dirty = NULL;
+	context->chunks = NULL;
+	context->stack = NULL;
+	context->partial = 0;
+	context->concurrent = 0;
+}
 
 /* update the hashes for dirty blocks in the given range,
  * along with all associated ancestors */
@@ -19,125 +34,361 @@ int merkle_update(struct merkle_context *context,
 		uint64_t from_block, uint64_t to_block,
 		uint64_t total_blocks)
 {
-	struct merkle_visitor visitor = {
-		update_leaf,
-		update_node,
+	struct merkle_range_visitor visitor = {
+		update_leaf_range,
+		update_node_range,
+		update_root,
+		context
+	};
+	struct merkle_level_visitor level_visitor = {
+		update_leaves,
+		update_nodes,
+		update_root,
+		context
+	};
+	int status;
+
+	if (context->levels)
+		status = merkle_visit_levels(&level_visitor, context,
+				from_block, to_block, total_blocks);
+	else
+		status = merkle_visit_ranges(&visitor, context,
+				from_block, to_block, total_blocks);
+	return journal_finish(context, status);
+}
+
+/* update the hashes for the given block ranges in a single traversal */
+int merkle_update_ranges(struct merkle_context *context,
+		const struct merkle_range *ranges, uint64_t count,
+		uint64_t total_blocks)
+{
+	struct merkle_range_visitor visitor = {
+		update_leaf_range,
+		update_node_range,
 		update_root,
 		context
 	};
-	return merkle_visit(&visitor, context->k,
-			from_block, to_block, total_blocks);
+	int status = merkle_visit_multi(&visitor, context,
+			ranges, count, total_blocks);
+	return journal_finish(context, status);
 }
 
 
 /* write the root checksum and truncate the hash file */
-static int update_root(const struct merkle_state *node,
+int update_root(const struct merkle_state *node,
 		uint8_t depth, void *user)
 {
 	const struct merkle_context *context =
 		(const struct merkle_context*)user;
 	uint64_t truncate_offset = context->hash_size *
-		(node->parent * context->k + 1);
+		(node->parent_offset + 1);
 	int status;
 
 	/* write the root checksum */
 	status = update_node(node, depth, user);
 	if (status)
 		return status;
+	MERKLE_PROBE(root, node->node, node->parent_offset);
 
 	/* truncate the hash file directly after the root checksum */
-	if (ftruncate(context->fd_out, truncate_offset) == -1) {
-		status = errno;
-		fprintf(stderr, "ftruncate(%lu) failed with error %u\n",
-				truncate_offset, status);
+	status = truncate_hash(context, truncate_offset);
+	if (status)
 		return status;
-	}
 
 	if (context->verbose)
 		printf("truncated hash file at %lu\n", truncate_offset);
 	return 0;
 }
 
+/* take an exclusive lock on the digests of a node of the hash file at
+ * the given offset, waiting for any other process that holds it. locks
+ * are always taken on the children before their parent, so they can't
+ * deadlock */
+static int lock_node(const struct merkle_context *context, uint64_t node,
+		uint64_t offset, uint8_t width)
+{
+	struct flock lock;
+	int status;
+
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = offset * context->hash_size;
+	lock.l_len = width * context->hash_size;
+
+	if (fcntl(context->fd_out, F_OFD_SETLKW, &lock) == -1) {
+		status = errno;
+		fprintf(stderr, "fcntl(F_OFD_SETLKW) of node %lu failed "
+				"with error %d\n", node, status);
+		return status;
+	}
+	return 0;
+}
+
+/* release every node lock held on the hash file */
+static void unlock_nodes(const struct merkle_context *context)
+{
+	struct flock lock;
+
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_UNLCK;
+	lock.l_whence = SEEK_SET;
+	fcntl(context->fd_out, F_OFD_SETLK, &lock);
+}
+
 /* read a node and write its hash to the parent */
 int update_node(const struct merkle_state *node,
 		uint8_t depth, void *user)
+{
+	return update_node_range(node, 1, depth, user);
+}
+
+/* read a run of sibling nodes, and write their hashes to the parent
+ * with a single write. for concurrent updates, the nodes are locked
+ * until their hashes are in the parent, so that another writer can't
+ * change a node and write its new hash before we write the old one */
+int update_node_range(const struct merkle_state *nodes,
+		uint8_t count, uint8_t depth, void *user)
 {
 	const struct merkle_context *context =
 		(const struct merkle_context*)user;
-	uint64_t read_offset = context->hash_size * node->node * context->k;
 	uint64_t write_offset = context->hash_size *
-		(node->parent * context->k + node->position);
+		(nodes[0].parent_offset + nodes[0].position);
+	unsigned char digests[UINT8_MAX * SHA_DIGEST_LENGTH];
 	unsigned char digest[SHA_DIGEST_LENGTH];
+	uint8_t width = merkle_width(&nodes[0], context->k_leaf, context->k);
+	size_t size = width * context->hash_size;
+	uint64_t read_offset;
 	SHA_CTX hash;
+	uint8_t i;
 	int status;
 
-	if (context->verbose)
-		printf("%*snode %lu at %lu hash written to "
-				"node %lu.%u at offset %lu\n",
-				2*depth, "", node->node, read_offset,
-				node->parent, node->position, write_offset);
-
-	/* read the hashes from the child node */
-	status = read_at(context->fd_out, read_offset,
-			context->node_buffer, context->node_size);
-	if (status)
-		return status;
+	for (i = 0; i < count; i++) {
+		read_offset = context->hash_size * nodes[i].offset;
 
-	SHA1_Init(&hash);
-	SHA1_Update(&hash, context->node_buffer, context->node_size);
-	SHA1_Final(digest, &hash);
+		if (context->verbose)
+			printf("%*snode %lu at %lu hash written to "
+					"node %lu.%u at offset %lu\n",
+					2*depth, "", nodes[i].node, read_offset,
+					nodes[i].parent, nodes[i].position,
+					write_offset + i * context->hash_size);
+
+		if (context->concurrent) {
+			status = lock_node(context, nodes[i].node,
+					nodes[i].offset, width);
+			if (status)
+				goto out_unlock;
+		}
+
+		/* read the hashes from the child node */
+		status = read_hash(context, read_offset,
+				context->node_buffer, size);
+		if (status)
+			goto out_unlock;
+
+		SHA1_Init(&hash);
+		SHA1_Update(&hash, context->node_buffer, size);
+		SHA1_Final(digest, &hash);
+		memcpy(digests + i * context->hash_size,
+				digest, context->hash_size);
+	}
+
+	if (context->concurrent) {
+		status = lock_node(context, nodes[0].parent,
+				nodes[0].parent_offset, context->k);
+		if (status)
+			goto out_unlock;
+	}
 
-	/* write the hash to the parent node */
-	return write_at(context->fd_out, write_offset,
-			digest, context->hash_size);
+	/* write the hashes to the parent node */
+	status = write_hash(context, write_offset,
+			digests, count * context->hash_size);
+out_unlock:
+	if (context->concurrent)
+		unlock_nodes(context);
+	return status;
 }
 
 /* read a block and write its hash to the given leaf node */
 int update_leaf(const struct merkle_state *node, uint64_t block,
 		uint8_t position, void *user)
+{
+	return update_leaf_range(node, block, 1, user);
+}
+
+/* read a run of blocks with a single read, and write their hashes to
+ * the given leaf node with a single write */
+int update_leaf_range(const struct merkle_state *node,
+		uint64_t first_block, uint8_t count, void *user)
 {
 	const struct merkle_context *context =
 		(const struct merkle_context*)user;
-	uint64_t read_offset = block * context->block_size;
+	uint8_t position = first_block - node->bstart;
 	uint64_t write_offset = context->hash_size *
-		(node->node * context->k + position);
-	unsigned char digest[SHA_DIGEST_LENGTH];
-	SHA_CTX hash;
+		(node->offset + position);
+	uint8_t i;
 	int status;
 
 	if (context->verbose)
-		printf("block %lu hash written to node %lu.%u "
-				"at offset %lu\n", block, node->node,
-				position, write_offset);
+		for (i = 0; i < count; i++)
+			printf("block %lu hash written to node %lu.%u "
+					"at offset %lu\n", first_block + i,
+					node->node, position + i,
+					write_offset + i * context->hash_size);
 
-	/* read the contents of the block */
-	status = read_at(context->fd_in, read_offset,
-			context->block_buffer, context->block_size);
+	status = hash_blocks(context, first_block, count,
+			context->node_buffer);
 	if (status)
 		return status;
 
-	SHA1_Init(&hash);
-	SHA1_Update(&hash, context->block_buffer, context->block_size);
-	SHA1_Final(digest, &hash);
+	if (context->concurrent) {
+		status = lock_node(context, node->node, node->offset,
+				context->k_leaf);
+		if (status)
+			return status;
+	}
+
+	/* write the hashes to the leaf node */
+	status = write_hash(context, write_offset,
+			context->node_buffer, count * context->hash_size);
+
+	if (context->concurrent)
+		unlock_nodes(context);
+	return status;
+}
+
+/* level visitor callbacks. the nodes under each parent are written
+ * to it as a run, and each leaf's blocks as one range */
+int update_nodes(const struct merkle_state *nodes, uint64_t count,
+		uint8_t depth, void *user)
+{
+	uint64_t i;
+	uint8_t run;
+	int status;
+
+	for (i = 0; i < count; i += run) {
+		run = merkle_sibling_run(&nodes[i], count - i);
+		status = update_node_range(&nodes[i], run, depth, user);
+		if (status)
+			return status;
+	}
+	return 0;
+}
+
+int update_leaves(const struct merkle_state *nodes, uint64_t count,
+		uint64_t from_block, uint64_t to_block, void *user)
+{
+	uint64_t i, start, end;
+	int status;
 
-	/* write the hash to the leaf node */
-	return write_at(context->fd_out, write_offset,
-			digest, context->hash_size);
+	for (i = 0; i < count; i++) {
+		start = nodes[i].bstart > from_block ?
+			nodes[i].bstart : from_block;
+		end = nodes[i].bend < to_block + 1 ?
+			nodes[i].bend : to_block + 1;
+
+		status = update_leaf_range(&nodes[i], start,
+				end - start, user);
+		if (status)
+			return status;
+	}
+	return 0;
 }
 
 
-/* common functions for file i/o */
+/* hash a run of blocks of the input file into hash_size digests. the
+ * blocks are read into the block buffer with a single read, or hashed
+ * in place when the input file is mapped */
+static int hash_run(const struct merkle_context *context,
+		uint64_t first_block, uint8_t count, unsigned char *digests)
+{
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	const unsigned char *data;
+	size_t length;
+	SHA_CTX hash;
+	uint8_t i;
+	int status;
+
+	if (context->chunks) {
+		/* each chunk has its own length */
+		for (i = 0; i < count; i++) {
+			status = chunk_read(context, first_block + i, &length);
+			if (status)
+				return status;
+
+			SHA1_Init(&hash);
+			SHA1_Update(&hash, context->block_buffer, length);
+			SHA1_Final(digest, &hash);
+			memcpy(digests + i * context->hash_size,
+					digest, context->hash_size);
+		}
+		return 0;
+	}
+
+	if (context->window == NULL) {
+		/* read the contents of the blocks */
+		status = read_at(context->fd_in,
+				first_block * context->block_size,
+				context->block_buffer, count * context->block_size);
+		if (status)
+			return status;
+
+		for (i = 0; i < count; i++) {
+			SHA1_Init(&hash);
+			SHA1_Update(&hash, context->block_buffer +
+					i * context->block_size, context->block_size);
+			SHA1_Final(digest, &hash);
+			memcpy(digests + i * context->hash_size,
+					digest, context->hash_size);
+		}
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		status = map_block(context, first_block + i, &data, &length);
+		if (status)
+			return status;
+
+		SHA1_Init(&hash);
+		SHA1_Update(&hash, data, length);
+		if (length < context->block_size) {
+			/* hash zeroes in place of the bytes past the end of
+			 * the file, as read_at() would */
+			memset(context->block_buffer, 0,
+					context->block_size - length);
+			SHA1_Update(&hash, context->block_buffer,
+					context->block_size - length);
+		}
+		SHA1_Final(digest, &hash);
+		memcpy(digests + i * context->hash_size,
+				digest, context->hash_size);
+	}
+	return 0;
+}
+
+int hash_blocks(const struct merkle_context *context, uint64_t first_block,
+		uint8_t count, unsigned char *digests)
+{
+	int status;
+
+	MERKLE_PROBE(hash__start, first_block, count);
+	status = hash_run(context, first_block, count, digests);
+	MERKLE_PROBE(hash__done, first_block, count, status);
+	return status;
+}
+
+
+/* common functions for file i/o. these don't move the file offset,
+ * so threads may share a descriptor */
 int read_at(int fd, off_t offset, unsigned char *buffer, size_t length)
 {
 	ssize_t bytes;
-	if (lseek(fd, offset, SEEK_SET) == -1) {
-		fprintf(stderr, "lseek(%lu) failed with error %d\n",
-				offset, errno);
-		return errno;
-	}
-	bytes = read(fd, buffer, length);
+	MERKLE_PROBE(read__start, fd, offset, length);
+	bytes = pread(fd, buffer, length, offset);
+	MERKLE_PROBE(read__done, fd, offset, bytes);
 	if (bytes == -1) {
-		fprintf(stderr, "read() failed with error %d\n", errno);
+		fprintf(stderr, "pread(%lu) failed with error %d\n",
+				offset, errno);
 		return errno;
 	}
 	/* zero-fill the remaining bytes */
@@ -149,20 +400,63 @@ int read_at(int fd, off_t offset, unsigned char *buffer, size_t length)
 int write_at(int fd, off_t offset, unsigned char *buffer, size_t length)
 {
 	ssize_t bytes;
-	if (lseek(fd, offset, SEEK_SET) == -1) {
-		fprintf(stderr, "lseek(%lu) failed with error %d\n",
-				offset, errno);
-		return errno;
-	}
-	while (length) {
-		bytes = write(fd, buffer, length);
+	size_t done = 0;
+	int status;
+
+	MERKLE_PROBE(write__start, fd, offset, length);
+	while (done < length) {
+		bytes = pwrite(fd, buffer + done, length - done,
+				offset + done);
 		if (bytes == -1) {
-			fprintf(stderr, "write() failed with error %d\n",
-					errno);
-			return errno;
+			status = errno;
+			fprintf(stderr, "pwrite(%lu) failed with error %d\n",
+					offset + done, status);
+			MERKLE_PROBE(write__done, fd, offset, status);
+			return status;
 		}
-		length -= bytes;
-		buffer += bytes;
+		done += bytes;
+	}
+	MERKLE_PROBE(write__done, fd, offset, 0);
+	return 0;
+}
+
+/* hash file i/o, which goes through the journal when one is open,
+ * or the memory mapping when the hash file is mapped */
+int read_hash(const struct merkle_context *context, off_t offset,
+		unsigned char *buffer, size_t length)
+{
+	if (context->journal)
+		return journal_read(context, offset, buffer, length);
+	if (context->map)
+		return map_read(context, offset, buffer, length);
+	return read_at(context->fd_out, offset, buffer, length);
+}
+
+int write_hash(const struct merkle_context *context, off_t offset,
+		unsigned char *buffer, size_t length)
+{
+	if (context->journal)
+		return journal_write(context, offset, buffer, length);
+	if (context->map)
+		return map_write(context, offset, buffer, length);
+	return write_at(context->fd_out, offset, buffer, length);
+}
+
+int truncate_hash(const struct merkle_context *context, off_t length)
+{
+	int status;
+
+	MERKLE_PROBE(truncate, length);
+	if (context->journal)
+		return journal_truncate(context, length);
+	if (context->map)
+		return map_truncate(context, length);
+
+	if (ftruncate(context->fd_out, length) == -1) {
+		status = errno;
+		fprintf(stderr, "ftruncate(%lu) failed with error %d\n",
+				length, status);
+		return status;
 	}
 	return 0;
 }
@@ -1,9 +1,14 @@
 #ifndef COHORT_MERKLE_UPDATE_H
 #define COHORT_MERKLE_UPDATE_H
 
+#include <sys/types.h>
+#include <stddef.h>
 #include <stdint.h>
 
 
+/* from merkle.h */
+struct merkle_context;
+
 /* from visitor.h */
 struct merkle_state;
 
@@ -12,9 +17,35 @@ int update_leaf(const struct merkle_state *node, uint64_t block,
 		uint8_t position, void *user);
 int update_node(const struct merkle_state *node,
 		uint8_t depth, void *user);
+int update_root(const struct merkle_state *node,
+		uint8_t depth, void *user);
+
+/* range visitor callbacks for update */
+int update_leaf_range(const struct merkle_state *node,
+		uint64_t first_block, uint8_t count, void *user);
+int update_node_range(const struct merkle_state *nodes,
+		uint8_t count, uint8_t depth, void *user);
+
+/* level visitor callbacks for update */
+int update_leaves(const struct merkle_state *nodes, uint64_t count,
+		uint64_t from_block, uint64_t to_block, void *user);
+int update_nodes(const struct merkle_state *nodes, uint64_t count,
+		uint8_t depth, void *user);
+
+/* hash a run of blocks of the input file into hash_size digests, for
+ * internal use by verify */
+int hash_blocks(const struct merkle_context *context, uint64_t first_block,
+		uint8_t count, unsigned char *digests);
 
 /* common functions for file i/o */
 int read_at(int fd, off_t offset, unsigned char *buffer, size_t length);
 int write_at(int fd, off_t offset, unsigned char *buffer, size_t length);
 
+/* hash file i/o through context.fd_out or the journal */
+int read_hash(const struct merkle_context *context, off_t offset,
+		unsigned char *buffer, size_t length);
+int write_hash(const struct merkle_context *context, off_t offset,
+		unsigned char *buffer, size_t length);
+int truncate_hash(const struct merkle_context *context, off_t length);
+
 #endif /* COHORT_MERKLE_UPDATE_H */
@@ -10,10 +10,16 @@
 #include "visitor.h"
 
 
-static int verify_leaf(const struct merkle_state *node, uint64_t block,
-		uint8_t position, void *user);
+static int verify_leaf_range(const struct merkle_state *node,
+		uint64_t first_block, uint8_t count, void *user);
+static int verify_node_range(const struct merkle_state *nodes,
+		uint8_t count, uint8_t depth, void *user);
 static int verify_node(const struct merkle_state *node,
 		uint8_t depth, void *user);
+static int verify_leaves(const struct merkle_state *nodes, uint64_t count,
+		uint64_t from_block, uint64_t to_block, void *user);
+static int verify_nodes(const struct merkle_state *nodes, uint64_t count,
+		uint8_t depth, void *user);
 
 
 /* verify the checksums of all blocks in the given range,
@@ -21,13 +27,23 @@ static int verify_node(const struct merkle_state *node,
 int merkle_verify(struct merkle_context *context,
 		uint64_t from_block, uint64_t to_block, uint64_t maxblocks)
 {
-	struct merkle_visitor visitor = {
-		verify_leaf,
+	struct merkle_range_visitor visitor = {
+		verify_leaf_range,
+		verify_node_range,
 		verify_node,
+		context
+	};
+	struct merkle_level_visitor level_visitor = {
+		verify_leaves,
+		verify_nodes,
 		verify_node,
 		context
 	};
-	return merkle_visit(&visitor, context->k,
+
+	if (context->levels)
+		return merkle_visit_levels(&level_visitor, context,
+				from_block, to_block, maxblocks);
+	return merkle_visit_ranges(&visitor, context,
 			from_block, to_block, maxblocks);
 }
 
@@ -35,18 +51,23 @@ int merkle_verify(struct merkle_context *context,
 static int verify_node(const struct merkle_state *node,
 		uint8_t depth, void *user)
 {
-	const struct merkle_context *context =
-		(const struct merkle_context*)user;
-	uint64_t read_offset = context->hash_size * node->node * context->k;
-	uint64_t write_offset = context->hash_size *
-		(node->parent * context->k + node->position);
-	unsigned char digest[SHA_DIGEST_LENGTH] = { 0 };
+	return verify_node_range(node, 1, depth, user);
+}
+
+/* read a node, check that its digests past its last child are zeroes,
+ * and compute its hash */
+static int hash_node(const struct merkle_state *node, uint8_t depth,
+		const struct merkle_context *context, unsigned char *digest)
+{
+	uint64_t read_offset = context->hash_size * node->offset;
+	uint8_t width = merkle_width(node, context->k_leaf, context->k);
+	unsigned char zeroes[SHA_DIGEST_LENGTH] = { 0 };
 	SHA_CTX hash;
 	int status;
 
 	/* read the hashes from the child node */
-	status = read_at(context->fd_out, read_offset,
-			context->node_buffer, context->node_size);
+	status = read_hash(context, read_offset,
+			context->node_buffer, width * context->hash_size);
 	if (status)
 		return status;
 
@@ -56,11 +77,11 @@ static int verify_node(const struct merkle_state *node,
 	uint64_t blocks = node->bend - node->bstart;
 	uint8_t i = blocks / node->cleaves +
 		(blocks % node->cleaves ? 1 : 0);
-	for (; i < context->k; i++) {
+	for (; i < width; i++) {
 		const unsigned char *buffer = context->node_buffer +
 			i * context->hash_size;
 
-		if (memcmp(digest, buffer, context->hash_size)) {
+		if (memcmp(zeroes, buffer, context->hash_size)) {
 			fprintf(stderr, "%*snode %lu.%u at offset %lu expected "
 					"zeroes\n", 2*depth, "", node->node, i,
 					read_offset + i * context->hash_size);
@@ -75,72 +96,142 @@ static int verify_node(const struct merkle_state *node,
 
 	/* compute the node hash */
 	SHA1_Init(&hash);
-	SHA1_Update(&hash, context->node_buffer, context->node_size);
+	SHA1_Update(&hash, context->node_buffer, width * context->hash_size);
 	SHA1_Final(digest, &hash);
+	return 0;
+}
+
+/* read a run of sibling nodes, and compare their hashes with the
+ * digests read from the parent with a single read */
+static int verify_node_range(const struct merkle_state *nodes,
+		uint8_t count, uint8_t depth, void *user)
+{
+	const struct merkle_context *context =
+		(const struct merkle_context*)user;
+	uint64_t read_offset, write_offset = context->hash_size *
+		(nodes[0].parent_offset + nodes[0].position);
+	unsigned char digests[UINT8_MAX * SHA_DIGEST_LENGTH];
+	unsigned char expected[UINT8_MAX * SHA_DIGEST_LENGTH];
+	uint64_t offset;
+	uint8_t i;
+	int status;
+
+	for (i = 0; i < count; i++) {
+		status = hash_node(&nodes[i], depth, context,
+				digests + i * context->hash_size);
+		if (status)
+			return status;
+	}
 
-	/* read the expected node hash from its parent */
-	status = read_at(context->fd_out, write_offset,
-			context->node_buffer, context->hash_size);
+	/* read the expected node hashes from their parent */
+	status = read_hash(context, write_offset,
+			expected, count * context->hash_size);
 	if (status)
 		return status;
 
-	/* compare the node hash with its expected parent hash */
-	if (memcmp(digest, context->node_buffer, context->hash_size)) {
-		fprintf(stderr, "%*snode %lu at %lu hash does not match "
-				"node %lu.%u at offset %lu\n",
-				2*depth, "", node->node, read_offset,
-				node->parent, node->position, write_offset);
-		return -1;
-	}
+	/* compare each node hash with its expected parent hash */
+	for (i = 0; i < count; i++) {
+		read_offset = context->hash_size * nodes[i].offset;
+		offset = write_offset + i * context->hash_size;
+
+		if (memcmp(digests + i * context->hash_size,
+					expected + i * context->hash_size,
+					context->hash_size)) {
+			fprintf(stderr, "%*snode %lu at %lu hash does not match "
+					"node %lu.%u at offset %lu\n",
+					2*depth, "", nodes[i].node, read_offset,
+					nodes[i].parent, nodes[i].position, offset);
+			return -1;
+		}
 
-	if (context->verbose)
-		printf("%*snode %lu at %lu hash matches "
-				"node %lu.%u at offset %lu\n",
-				2*depth, "", node->node, read_offset,
-				node->parent, node->position, write_offset);
+		if (context->verbose)
+			printf("%*snode %lu at %lu hash matches "
+					"node %lu.%u at offset %lu\n",
+					2*depth, "", nodes[i].node, read_offset,
+					nodes[i].parent, nodes[i].position, offset);
+	}
 	return 0;
 }
 
-/* read a block and compare its hash with the given node */
-static int verify_leaf(const struct merkle_state *node, uint64_t block,
-		uint8_t position, void *user)
+/* read a run of blocks and compare their hashes with the given node */
+static int verify_leaf_range(const struct merkle_state *node,
+		uint64_t first_block, uint8_t count, void *user)
 {
 	const struct merkle_context *context =
 		(const struct merkle_context*)user;
-	uint64_t read_offset = block * context->block_size;
-	uint64_t write_offset = context->hash_size *
-		(node->node * context->k + position);
-	unsigned char digest[SHA_DIGEST_LENGTH];
-	SHA_CTX hash;
+	uint8_t position = first_block - node->bstart;
+	uint64_t read_offset = context->hash_size *
+		(node->offset + position);
+	unsigned char digests[UINT8_MAX * SHA_DIGEST_LENGTH];
+	uint64_t offset;
+	uint8_t i;
 	int status;
 
-	/* read the contents of the block */
-	status = read_at(context->fd_in, read_offset,
-			context->block_buffer, context->block_size);
+	/* compute the block hashes */
+	status = hash_blocks(context, first_block, count, digests);
 	if (status)
 		return status;
 
-	/* compute the block hash */
-	SHA1_Init(&hash);
-	SHA1_Update(&hash, context->block_buffer, context->block_size);
-	SHA1_Final(digest, &hash);
-
-	/* read the expected block hash from the leaf node */
-	status = read_at(context->fd_out, write_offset,
-			context->node_buffer, context->hash_size);
+	/* read the expected block hashes from the leaf node */
+	status = read_hash(context, read_offset,
+			context->node_buffer, count * context->hash_size);
 	if (status)
 		return status;
 
-	/* compare the block hash with its expected leaf hash */
-	if (memcmp(digest, context->node_buffer, context->hash_size)) {
-		fprintf(stderr, "block %lu hash does not match "
-				"node %lu.%u at offset %lu\n",
-				block, node->node, position, write_offset);
-		return -1;
+	/* compare each block hash with its expected leaf hash */
+	for (i = 0; i < count; i++) {
+		offset = read_offset + i * context->hash_size;
+
+		if (memcmp(digests + i * context->hash_size,
+					context->node_buffer + i * context->hash_size,
+					context->hash_size)) {
+			fprintf(stderr, "block %lu hash does not match "
+					"node %lu.%u at offset %lu\n", first_block + i,
+					node->node, position + i, offset);
+			return -1;
+		}
+
+		if (context->verbose)
+			printf("block %lu hash matches node %lu.%u at offset %lu\n",
+					first_block + i, node->node, position + i, offset);
 	}
+	return 0;
+}
 
-	if (context->verbose)
-		printf("block %lu hash matches node %lu.%u at offset %lu\n",
-				block, node->node, position, write_offset);
+/* level visitor callbacks. the nodes under each parent are compared
+ * with it as a run, and each leaf's blocks as one range */
+static int verify_nodes(const struct merkle_state *nodes, uint64_t count,
+		uint8_t depth, void *user)
+{
+	uint64_t i;
+	uint8_t run;
+	int status;
+
+	for (i = 0; i < count; i += run) {
+		run = merkle_sibling_run(&nodes[i], count - i);
+		status = verify_node_range(&nodes[i], run, depth, user);
+		if (status)
+			return status;
+	}
+	return 0;
+}
+
+static int verify_leaves(const struct merkle_state *nodes, uint64_t count,
+		uint64_t from_block, uint64_t to_block, void *user)
+{
+	uint64_t i, start, end;
+	int status;
+
+	for (i = 0; i < count; i++) {
+		start = nodes[i].bstart > from_block ?
+			nodes[i].bstart : from_block;
+		end = nodes[i].bend < to_block + 1 ?
+			nodes[i].bend : to_block + 1;
+
+		status = verify_leaf_range(&nodes[i], start,
+				end - start, user);
+		if (status)
+			return status;
+	}
 	return 0;
 }
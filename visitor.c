@@ -1,23 +1,30 @@
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
+#include "merkle.h"
 #include "visitor.h"
 #include "tree.h"
+#include "probes.h"
 
 
-/* find the leaf node index that corresponds to the given block */
-static uint64_t find_leaf(struct merkle_state *stack,
-		uint8_t k, uint64_t block, uint64_t depth)
+/* find the index of the node at the given depth that holds the given
+ * block, starting from the root node at stack[maxdepth-1]. the node's
+ * parent and position are left in stack[depth-1] */
+static uint64_t find_node(struct merkle_state *stack,
+		const struct merkle_layout *layout, uint64_t block,
+		uint64_t maxdepth, uint64_t depth)
 {
 	struct merkle_state *node, *child;
 
 	/* start traversal at the root node */
 	for (;;) {
-		node = &stack[depth-1];
-		if (depth == 1) /* found the leaf node */
+		node = &stack[maxdepth-1];
+		if (maxdepth == depth) /* found the node */
 			return node->node;
 
-		child = &stack[depth-2];
+		child = &stack[maxdepth-2];
 		child->parent = node->node;
 
 		/* choose the child that contains this block */
@@ -25,48 +32,135 @@ static uint64_t find_leaf(struct merkle_state *stack,
 		child->bstart = node->bstart + child->position * node->cleaves;
 		child->node = merkle_child(child->parent,
 				child->position, node->cnodes, child->cnodes);
-		depth--;
+		merkle_set_offset(child, layout, maxdepth - 1);
+		child->parent_offset = node->offset;
+		maxdepth--;
 	}
 }
 
+/* find the leaf node index that corresponds to the given block */
+static inline uint64_t find_leaf(struct merkle_state *stack,
+		const struct merkle_layout *layout, uint64_t block,
+		uint64_t depth)
+{
+	return find_node(stack, layout, block, depth, 1);
+}
+
+/* maximum number of nodes passed to each merkle_level_visitor call */
+#define LEVEL_BATCH 1024
+
 #define min(a,b) ((a)<(b)?(a):(b))
 #define max(a,b) ((a)>(b)?(a):(b))
 
-/* returns nonzero when the node intersects the given block bounds */
-static inline int node_in_bounds(const struct merkle_state *node,
-		uint64_t from, uint64_t to)
+/* returns nonzero when the node intersects one of the block ranges,
+ * after skipping the ranges at ranges[*current] that end before the
+ * node. nodes are checked in block order, so those ranges can't
+ * intersect any of the nodes that follow */
+static int node_in_ranges(const struct merkle_state *node,
+		const struct merkle_range *ranges, uint64_t count,
+		uint64_t *current)
 {
-	return max(node->bstart, from) < min(node->bend, to + 1);
+	while (*current < count && ranges[*current].to_block < node->bstart)
+		(*current)++;
+	return *current < count && ranges[*current].from_block < node->bend;
 }
 
-/* visit all nodes associated with blocks in given range */
-int merkle_visit(const struct merkle_visitor *visitor, uint8_t k,
-		uint64_t from_block, uint64_t to_block,
-		uint64_t total_blocks)
+/* advance to the next child of the node that intersects the given
+ * block ranges, remembering our progress so we can traverse a single
+ * child, instead of having to push them all to the stack at once.
+ * returns nonzero if there was another child in range */
+static int next_child(struct merkle_state *node, struct merkle_state *child,
+		uint8_t k, const struct merkle_range *ranges, uint64_t count,
+		uint64_t *current)
 {
-	uint64_t i, leaves;
-	struct merkle_state *stack, *node, *child;
-	uint8_t depth, maxdepth;
+	while (node->progress < k) {
+		child->position = node->progress++;
+
+		/* calculate which blocks are under this child */
+		child->bstart = node->bstart + child->position * node->cleaves;
+		child->bend = min(child->bstart + node->cleaves, node->bend);
+		if (child->bstart >= child->bend)
+			return 0;
+
+		if (node_in_ranges(child, ranges, count, current))
+			return 1;
+	}
+	return 0;
+}
+
+/* visit the blocks of a leaf node in each range that intersects it,
+ * starting with ranges[current] */
+static int visit_leaf(const struct merkle_range_visitor *visitor,
+		const struct merkle_state *node,
+		const struct merkle_range *ranges, uint64_t count,
+		uint64_t current)
+{
+	uint64_t first, end;
 	int status;
 
+	for (; current < count && ranges[current].from_block < node->bend;
+			current++) {
+		first = max(node->bstart, ranges[current].from_block);
+		end = min(node->bend, ranges[current].to_block + 1);
+
+		MERKLE_PROBE(leaf__visit, node->node, node->offset,
+				first, end - first);
+		status = visitor->visit_leaf_range(node, first,
+				end - first, visitor->user);
+		if (status)
+			return status;
+	}
+	return 0;
+}
+
+int merkle_stack_init(struct merkle_stack *cache,
+		const struct merkle_context *context, uint64_t total_blocks,
+		uint64_t count)
+{
+	struct merkle_layout *layout = &cache->layout;
+	uint8_t k_leaf = context->k_leaf, k = context->k;
+	uint64_t i, leaves;
+	struct merkle_state *stack, *node;
+	uint8_t maxdepth, width;
+
+	if (cache->states && layout->total_blocks == total_blocks &&
+			layout->k_leaf == k_leaf && layout->k == k &&
+			layout->blocked == context->blocked &&
+			cache->hash_size == context->hash_size)
+		goto out_nodes;
+
 	/* calculate the depth required to hold total_blocks */
-	leaves = total_blocks / k + (total_blocks % k ? 1 : 0);
+	leaves = total_blocks / k_leaf + (total_blocks % k_leaf ? 1 : 0);
 	maxdepth = merkle_depth(k, leaves);
 
 	/* allocate the state stack, whose size is bounded by maxdepth */
-	stack = (struct merkle_state*)malloc(maxdepth *
-			sizeof(struct merkle_state));
-	if (stack == NULL)
-		return errno;
+	layout->total_blocks = 0;
+	if (cache->states == NULL || cache->maxdepth != maxdepth) {
+		free(cache->states);
+		cache->states = (struct merkle_state*)malloc(maxdepth *
+				sizeof(struct merkle_state));
+		if (cache->states == NULL)
+			return errno;
+		cache->maxdepth = maxdepth;
+	}
+	stack = cache->states;
 
-	/* precalculate cnodes and cleaves */
+	/* precalculate cnodes and cleaves. cnodes is always smaller than
+	 * cleaves, so neither overflows as long as cleaves fits in 64 bits */
 	stack[0].cnodes = 0;
 	stack[0].cleaves = 1;
 	for (i = 1; i < maxdepth; i++) {
+		width = i == 1 ? k_leaf : k;
+		if (stack[i-1].cleaves > UINT64_MAX / width)
+			return EOVERFLOW;
 		stack[i].cnodes = stack[i-1].cnodes * k + 1;
-		stack[i].cleaves = stack[i-1].cleaves * k;
+		stack[i].cleaves = stack[i-1].cleaves * width;
 	}
 
+	merkle_layout_init(layout, k_leaf, k, context->hash_size,
+			context->blocked, total_blocks);
+	cache->hash_size = context->hash_size;
+
 	/* initialize the root node */
 	node = &stack[maxdepth-1];
 	node->node = stack[maxdepth-1].cnodes;
@@ -74,84 +168,418 @@ int merkle_visit(const struct merkle_visitor *visitor, uint8_t k,
 	node->bend = total_blocks;
 	node->position = 0;
 	node->progress = 0;
+	merkle_set_offset(node, layout, maxdepth);
 
-	/* the root's parent is the last leaf node + 1 */
-	node->parent = find_leaf(stack, k, total_blocks - 1, maxdepth) + 1;
+	/* the root's parent is the last leaf node + 1, where the root
+	 * checksum follows the digests of every node */
+	node->parent = find_leaf(stack, layout, total_blocks - 1,
+			maxdepth) + 1;
+	node->parent_offset = merkle_offset(k_leaf, k, node->parent, leaves);
+
+	cache->root = *node;
+out_nodes:
+	/* a traversal leaves its progress in the root node */
+	cache->states[cache->maxdepth-1] = cache->root;
+
+	if (cache->capacity < count) {
+		free(cache->nodes);
+		cache->capacity = 0;
+		cache->nodes = (struct merkle_state*)malloc(count *
+				sizeof(struct merkle_state));
+		if (cache->nodes == NULL)
+			return errno;
+		cache->capacity = count;
+	}
+	return 0;
+}
+
+void merkle_stack_free(struct merkle_stack *cache)
+{
+	free(cache->states);
+	free(cache->nodes);
+	memset(cache, 0, sizeof(*cache));
+}
+
+/* start reading the nodes on the path from the root to the leaf of
+ * each range within a single leaf, and the range's blocks, before the
+ * traversal needs them. the traversal reads each node after its
+ * children, so a cold path would otherwise wait for a read at every
+ * level. larger ranges read their nodes in file order, where the
+ * kernel's readahead already helps */
+static void prefetch_paths(const struct merkle_context *context,
+		struct merkle_stack *cache, const struct merkle_range *ranges,
+		uint64_t count)
+{
+	/* the last node prefetched at each depth, since nearby ranges
+	 * share their upper nodes */
+	uint64_t last[LAYOUT_MAX_DEPTH];
+	struct merkle_state *node;
+	uint64_t i, start, end, page = UINT64_MAX;
+	uint8_t depth, width;
+
+	memset(last, 0xff, sizeof(last));
+	for (i = 0; i < count; i++) {
+		if (ranges[i].from_block / context->k_leaf !=
+				ranges[i].to_block / context->k_leaf)
+			continue;
+
+		if (context->chunks == NULL)
+			posix_fadvise(context->fd_in,
+					ranges[i].from_block * context->block_size,
+					(ranges[i].to_block - ranges[i].from_block + 1) *
+					context->block_size, POSIX_FADV_WILLNEED);
+
+		/* fill in the stack from the root down to the leaf */
+		find_leaf(cache->states, &cache->layout, ranges[i].from_block,
+				cache->maxdepth);
+		for (depth = cache->maxdepth; depth > 0; depth--) {
+			node = &cache->states[depth-1];
+			if (node->offset == last[depth-1])
+				continue;
+			last[depth-1] = node->offset;
+
+			/* nodes in the page of the last one are on their way */
+			width = merkle_width(node, context->k_leaf, context->k);
+			start = node->offset * context->hash_size;
+			end = start + width * context->hash_size - 1;
+			if (start / LAYOUT_PAGE_SIZE == page &&
+					end / LAYOUT_PAGE_SIZE == page)
+				continue;
+			page = end / LAYOUT_PAGE_SIZE;
+
+			MERKLE_PROBE(prefetch, node->node, node->offset, width);
+			posix_fadvise(context->fd_out, start, end - start + 1,
+					POSIX_FADV_WILLNEED);
+		}
+	}
+
+	/* and the root checksum, which verify compares with the root */
+	if (last[cache->maxdepth-1] != UINT64_MAX)
+		posix_fadvise(context->fd_out, cache->root.parent_offset *
+				context->hash_size, context->hash_size,
+				POSIX_FADV_WILLNEED);
+}
+
+/* visit all nodes associated with blocks in the given ranges */
+int merkle_visit_multi(const struct merkle_range_visitor *visitor,
+		const struct merkle_context *context,
+		const struct merkle_range *ranges, uint64_t count,
+		uint64_t total_blocks)
+{
+	struct merkle_stack local, *cache = context->stack;
+	const struct merkle_layout *layout;
+	uint8_t k = context->k;
+	struct merkle_state *stack, *leaves, *node, *child;
+	uint64_t i, end, current = 0;
+	uint8_t depth, maxdepth, nleaves;
+	int status;
+
+	if (total_blocks == 0 || count == 0)
+		return EINVAL;
+
+	/* the ranges must be sorted and disjoint */
+	for (i = 0; i < count; i++)
+		if (ranges[i].from_block > ranges[i].to_block ||
+				(i && ranges[i].from_block <= ranges[i-1].to_block))
+			return EINVAL;
+
+	MERKLE_PROBE(visit__start, ranges[0].from_block,
+			ranges[count-1].to_block, total_blocks);
+
+	/* without a stack to reuse, this traversal gets its own */
+	if (cache == NULL) {
+		memset(&local, 0, sizeof(local));
+		cache = &local;
+	}
+
+	/* the leaves under a single node are visited together */
+	status = merkle_stack_init(cache, context, total_blocks, k);
+	if (status)
+		goto out_free;
+	prefetch_paths(context, cache, ranges, count);
+	layout = &cache->layout;
+	stack = cache->states;
+	maxdepth = cache->maxdepth;
+	leaves = cache->nodes;
 
 	/* start traversal at the root node */
 	depth = maxdepth;
 	while (depth <= maxdepth) {
 		node = &stack[depth-1];
 
-		/* base case: visit each requested file block of the leaf node */
 		if (depth == 1) {
-			uint64_t end = min(node->bend, to_block + 1);
-			for (i = max(node->bstart, from_block); i < end; i++) {
-				status = visitor->visit_leaf(node, i,
-						i - node->bstart, visitor->user);
+			/* base case: visit the requested blocks of a root
+			 * node that is also the only leaf */
+			node_in_ranges(node, ranges, count, &current);
+			status = visit_leaf(visitor, node, ranges, count, current);
+			if (status)
+				goto out_free;
+		} else if (depth == 2) {
+			/* visit the requested blocks of each leaf under this
+			 * node, then visit the leaves as a run of children */
+			for (nleaves = 0; next_child(node, &leaves[nleaves], k,
+						ranges, count, &current); nleaves++) {
+				child = &leaves[nleaves];
+				child->parent = node->node;
+				child->node = merkle_child(child->parent,
+						child->position, node->cnodes,
+						stack[0].cnodes);
+				child->cnodes = stack[0].cnodes;
+				child->cleaves = stack[0].cleaves;
+				child->progress = 0;
+				merkle_set_offset(child, layout, 1);
+				child->parent_offset = node->offset;
+
+				status = visit_leaf(visitor, child,
+						ranges, count, current);
 				if (status)
 					goto out_free;
 			}
 
-			/* traverse back up to parent node */
-			depth++;
-			continue;
+			/* leaves separated by a gap between ranges are
+			 * visited as separate runs */
+			for (i = 0; i < nleaves; i = end) {
+				for (end = i + 1; end < nleaves &&
+						leaves[end].position ==
+						leaves[end-1].position + 1; end++)
+					;
+				MERKLE_PROBE(node__visit, leaves[i].node,
+						leaves[i].offset, 1, end - i);
+				status = visitor->visit_node_range(&leaves[i],
+						end - i, 1, visitor->user);
+				if (status)
+					goto out_free;
+			}
+		} else {
+			child = &stack[depth-2];
+			if (next_child(node, child, k, ranges, count, &current)) {
+				/* traverse down to child node */
+				child->parent = node->node;
+				child->node = merkle_child(child->parent,
+						child->position, node->cnodes, child->cnodes);
+				child->progress = 0;
+				merkle_set_offset(child, layout, depth - 1);
+				child->parent_offset = node->offset;
+				depth--;
+				MERKLE_PROBE(node__push, child->node, depth);
+				continue;
+			}
 		}
 
-		child = &stack[depth-2];
-		child->parent = node->node;
-		child->progress = 0;
+		/* all children have been traversed. traverse back up to
+		 * the parent node, and visit this node as its child. this
+		 * way each child is visited as soon as its subtree is done,
+		 * so every subtree to the left of it is complete */
+		if (++depth > maxdepth)
+			break;
+		MERKLE_PROBE(node__pop, node->node, depth - 1);
 
-		if (node->progress == k) {
-			/* all children have been traversed */
-			for (child->position = 0; child->position < k; child->position++) {
-				/* calculate which blocks are under this child */
-				child->bstart = node->bstart + child->position * node->cleaves;
-				child->bend = min(child->bstart + node->cleaves, node->bend);
+		MERKLE_PROBE(node__visit, node->node, node->offset,
+				depth - 1, 1);
+		status = visitor->visit_node_range(node, 1,
+				depth-1, visitor->user);
+		if (status)
+			goto out_free;
+	}
 
-				/* visit children in the requested range */
-				if (!node_in_bounds(child, from_block, to_block))
-					continue;
+	/* visit root node */
+	status = visitor->visit_root(node, depth, visitor->user);
+out_free:
+	if (cache == &local)
+		merkle_stack_free(&local);
+	MERKLE_PROBE(visit__done, ranges[0].from_block,
+			ranges[count-1].to_block, status);
+	return status;
+}
 
-				child->node = merkle_child(child->parent,
-						child->position, node->cnodes, child->cnodes);
+/* visit all nodes associated with blocks in given range */
+int merkle_visit_ranges(const struct merkle_range_visitor *visitor,
+		const struct merkle_context *context, uint64_t from_block,
+		uint64_t to_block, uint64_t total_blocks)
+{
+	struct merkle_range range = { from_block, to_block };
+	return merkle_visit_multi(visitor, context, &range, 1,
+			total_blocks);
+}
 
-				status = visitor->visit_node(child,
-						depth-1, visitor->user);
-				if (status)
-					goto out_free;
-			}
 
-			/* traverse back up to parent node */
-			depth++;
-			continue;
+/* adapters from the range callbacks to the per-block and per-node
+ * callbacks of a merkle_visitor */
+static int adapt_leaf_range(const struct merkle_state *node,
+		uint64_t first_block, uint8_t count, void *user)
+{
+	const struct merkle_visitor *visitor =
+		(const struct merkle_visitor*)user;
+	uint64_t block;
+	int status;
+
+	for (block = first_block; block < first_block + count; block++) {
+		status = visitor->visit_leaf(node, block,
+				block - node->bstart, visitor->user);
+		if (status)
+			return status;
+	}
+	return 0;
+}
+
+static int adapt_node_range(const struct merkle_state *nodes,
+		uint8_t count, uint8_t depth, void *user)
+{
+	const struct merkle_visitor *visitor =
+		(const struct merkle_visitor*)user;
+	uint8_t i;
+	int status;
+
+	for (i = 0; i < count; i++) {
+		status = visitor->visit_node(&nodes[i], depth, visitor->user);
+		if (status)
+			return status;
+	}
+	return 0;
+}
+
+static int adapt_root(const struct merkle_state *node,
+		uint8_t depth, void *user)
+{
+	const struct merkle_visitor *visitor =
+		(const struct merkle_visitor*)user;
+	return visitor->visit_root(node, depth, visitor->user);
+}
+
+/* visit all nodes associated with blocks in given range, one block
+ * or node at a time */
+int merkle_visit(const struct merkle_visitor *visitor,
+		const struct merkle_context *context, uint64_t from_block,
+		uint64_t to_block, uint64_t total_blocks)
+{
+	struct merkle_range_visitor adapter = {
+		adapt_leaf_range,
+		adapt_node_range,
+		adapt_root,
+		(void*)visitor
+	};
+	return merkle_visit_ranges(&adapter, context,
+			from_block, to_block, total_blocks);
+}
+
+/* fill in the states of count sibling nodes at the given depth,
+ * starting with the node at index first within that level */
+static void fill_level(struct merkle_state *stack,
+		const struct merkle_layout *layout, uint8_t maxdepth,
+		uint8_t depth, uint64_t first, uint64_t count,
+		uint64_t total_blocks, struct merkle_state *nodes)
+{
+	uint8_t k_leaf = layout->k_leaf, k = layout->k;
+	const struct merkle_state *level = &stack[depth-1];
+	/* blocks under each node */
+	uint64_t span = level->cleaves * (depth == 1 ? k_leaf : k);
+	struct merkle_state *node;
+	uint64_t i;
+
+	for (i = 0; i < count; i++) {
+		node = &nodes[i];
+		node->bstart = (first + i) * span;
+		node->bend = min(node->bstart + span, total_blocks);
+		node->cnodes = level->cnodes;
+		node->cleaves = level->cleaves;
+		/* all children have been processed */
+		node->progress = depth == 1 ? k_leaf : k;
+
+		if (i == 0 || (first + i) % k == 0) {
+			/* search from the root for the first node under
+			 * each parent */
+			node->node = find_node(stack, layout, node->bstart,
+					maxdepth, depth);
+			node->parent = stack[depth-1].parent;
+			node->position = stack[depth-1].position;
+			node->offset = stack[depth-1].offset;
+			node->parent_offset = stack[depth-1].parent_offset;
+		} else {
+			/* later siblings follow from the same parent */
+			node->parent = nodes[i-1].parent;
+			node->position = nodes[i-1].position + 1;
+			node->node = merkle_child(node->parent, node->position,
+					stack[depth].cnodes, level->cnodes);
+			merkle_set_offset(node, layout, depth);
+			node->parent_offset = nodes[i-1].parent_offset;
 		}
+	}
+}
 
-		/* consider each child node. remember our progress
-		 * so we can traverse a single child, instead of having
-		 * to push them all to the stack at once */
-		while (node->progress < k)
-		{
-			child->position = node->progress++;
+/* visit all nodes associated with blocks in given range, one level
+ * at a time from the leaves up, in batches of sibling nodes */
+int merkle_visit_levels(const struct merkle_level_visitor *visitor,
+		const struct merkle_context *context, uint64_t from_block,
+		uint64_t to_block, uint64_t total_blocks)
+{
+	struct merkle_stack local, *cache = context->stack;
+	struct merkle_range range = { from_block, to_block };
+	uint8_t k_leaf = context->k_leaf, k = context->k;
+	struct merkle_state *stack, *nodes;
+	uint64_t span, first, last, count;
+	uint8_t depth, maxdepth;
+	int status;
 
-			/* calculate which blocks are under this child */
-			child->bstart = node->bstart + child->position * node->cleaves;
-			child->bend = min(child->bstart + node->cleaves, node->bend);
+	if (total_blocks == 0 || from_block > to_block)
+		return EINVAL;
 
-			if (!node_in_bounds(child, from_block, to_block))
-				continue;
+	MERKLE_PROBE(visit__start, from_block, to_block, total_blocks);
+	if (cache == NULL) {
+		memset(&local, 0, sizeof(local));
+		cache = &local;
+	}
 
-			/* traverse down to child node */
-			child->node = merkle_child(child->parent,
-					child->position, node->cnodes, child->cnodes);
-			depth--;
-			break;
+	status = merkle_stack_init(cache, context, total_blocks, LEVEL_BATCH);
+	if (status)
+		goto out_free;
+	prefetch_paths(context, cache, &range, 1);
+	stack = cache->states;
+	maxdepth = cache->maxdepth;
+	nodes = cache->nodes;
+
+	for (depth = 1; depth < maxdepth; depth++) {
+		/* the nodes of a level that intersect the range are
+		 * contiguous, in block order */
+		span = stack[depth-1].cleaves * (depth == 1 ? k_leaf : k);
+		first = from_block / span;
+		last = to_block / span;
+
+		for (; first <= last; first += count) {
+			count = min(last - first + 1, LEVEL_BATCH);
+			fill_level(stack, &cache->layout, maxdepth, depth, first,
+					count, total_blocks, nodes);
+
+			MERKLE_PROBE(node__visit, nodes[0].node, nodes[0].offset,
+					depth, count);
+			if (depth == 1) {
+				status = visitor->visit_leaves(nodes, count,
+						from_block, to_block, visitor->user);
+				if (status)
+					goto out_free;
+			}
+
+			status = visitor->visit_nodes(nodes, count,
+					depth, visitor->user);
+			if (status)
+				goto out_free;
 		}
 	}
 
+	/* a root with no children above the leaves holds the blocks */
+	if (maxdepth == 1) {
+		status = visitor->visit_leaves(&stack[0], 1,
+				from_block, to_block, visitor->user);
+		if (status)
+			goto out_free;
+	}
+
 	/* visit root node */
-	status = visitor->visit_root(node, depth, visitor->user);
+	stack[maxdepth-1].progress = maxdepth == 1 ? k_leaf : k;
+	status = visitor->visit_root(&stack[maxdepth-1], maxdepth + 1,
+			visitor->user);
 out_free:
-	free(stack);
+	if (cache == &local)
+		merkle_stack_free(&local);
+	MERKLE_PROBE(visit__done, from_block, to_block, status);
 	return status;
 }
@@ -3,6 +3,13 @@
 
 #include <stdint.h>
 
+#include "layout.h"
+#include "tree.h"
+
+
+/* from merkle.h */
+struct merkle_context;
+struct merkle_range;
 
 /* node state passed to merkle_visitor callbacks */
 struct merkle_state
@@ -10,11 +17,86 @@ struct merkle_state
 	uint64_t node, parent; /* index of the node and its parent */
 	uint64_t bstart, bend; /* bounds of all blocks under this node */
 	uint64_t cnodes; /* number of nodes under each child */
-	uint64_t cleaves; /* number of leaves under each child */
+	uint64_t cleaves; /* number of blocks under each child */
+	/* offsets of the node's digests and its parent's digests in the
+	 * hash file, counted in digests */
+	uint64_t offset, parent_offset;
 	uint8_t progress; /* number of children processed [0, k] */
 	uint8_t position; /* child's position under parent node [0, k-1] */
 };
 
+/* return the number of children of the node, which are blocks for a
+ * leaf and nodes otherwise */
+static inline uint8_t merkle_width(const struct merkle_state *node,
+		uint8_t k_leaf, uint8_t k)
+{
+	return node->cnodes ? k : k_leaf;
+}
+
+/* return the number of nodes at the start of a batch of siblings from
+ * merkle_visit_levels() that share the first node's parent, so that
+ * their digests can be read or written in the parent at once */
+static inline uint8_t merkle_sibling_run(const struct merkle_state *nodes,
+		uint64_t count)
+{
+	uint64_t i;
+
+	for (i = 1; i < count && nodes[i].parent == nodes[0].parent; i++)
+		;
+	return i;
+}
+
+/* set the offset of the digests of the node at the given depth. in
+ * the blocked layout, it follows from the node's index within its
+ * level. otherwise it follows from the node's index, its first block,
+ * and the shape of its subtree. nodes are numbered before their
+ * children, so the leaves numbered before a node are those left of its
+ * first block. the exception is the left edge of the tree, whose nodes
+ * are numbered after their first child's subtree, so that the tree can
+ * grow a new root without renumbering */
+static inline void merkle_set_offset(struct merkle_state *node,
+		const struct merkle_layout *layout, uint8_t depth)
+{
+	uint8_t k_leaf = layout->k_leaf;
+	uint64_t first;
+
+	if (layout->blocked) {
+		node->offset = layout_blocked_offset(layout, depth,
+				node->bstart / (node->cleaves *
+					merkle_width(node, k_leaf, layout->k)));
+		return;
+	}
+	first = node->node == node->cnodes ? node->cleaves : node->bstart;
+	node->offset = merkle_offset(k_leaf, layout->k, node->node,
+			first / k_leaf);
+}
+
+/* traversal state kept between traversals of the same tree, so that
+ * each one doesn't allocate its stack and recompute the cnodes, cleaves
+ * and layout of every level. a zeroed stack is empty, and traversals
+ * with no stack in their context use a stack of their own */
+struct merkle_stack
+{
+	struct merkle_state *states; /* one for each level */
+	struct merkle_state *nodes; /* runs of sibling nodes */
+	uint64_t capacity; /* number of states in nodes */
+	struct merkle_state root; /* root node before any traversal */
+	struct merkle_layout layout; /* or total_blocks 0 if not computed */
+	uint8_t hash_size;
+	uint8_t maxdepth; /* number of states in states */
+};
+
+/* prepare the state stack for a tree of total_blocks, with room for
+ * count sibling nodes, and initialize the root node at the top of the
+ * stack. a stack kept from an earlier traversal of a tree with the same
+ * shape keeps its allocations and its cnodes and cleaves table */
+int merkle_stack_init(struct merkle_stack *cache,
+		const struct merkle_context *context, uint64_t total_blocks,
+		uint64_t count);
+
+/* free the allocations of the stack, leaving it empty */
+void merkle_stack_free(struct merkle_stack *cache);
+
 /* visitor interface */
 struct merkle_visitor
 {
@@ -29,11 +111,67 @@ struct merkle_visitor
 	void *user; /* user data passed to each callback */
 };
 
+/* visitor interface for runs of blocks and nodes, which lets each
+ * callback read and hash a leaf's worth of blocks at once */
+struct merkle_range_visitor
+{
+	/* visit count blocks from first_block, all under the given leaf */
+	int (*visit_leaf_range)(const struct merkle_state *node,
+			uint64_t first_block, uint8_t count, void *user);
+	/* visit count sibling nodes in order, as children of their
+	 * parent, once each of their subtrees is complete */
+	int (*visit_node_range)(const struct merkle_state *nodes,
+			uint8_t count, uint8_t depth, void *user);
+	int (*visit_root)(const struct merkle_state *node,
+			uint8_t depth, void *user);
+
+	void *user; /* user data passed to each callback */
+};
+
+/* level-order visitor interface, whose callbacks take arrays of
+ * sibling node states in block order */
+struct merkle_level_visitor
+{
+	/* visit the blocks in [from_block, to_block] under each leaf */
+	int (*visit_leaves)(const struct merkle_state *nodes, uint64_t count,
+			uint64_t from_block, uint64_t to_block, void *user);
+	/* visit the nodes at the given depth as children of their
+	 * parents, after every node at lower depths */
+	int (*visit_nodes)(const struct merkle_state *nodes, uint64_t count,
+			uint8_t depth, void *user);
+	int (*visit_root)(const struct merkle_state *node,
+			uint8_t depth, void *user);
+
+	void *user; /* user data passed to each callback */
+};
+
 /* perform a depth-first postorder traversal of the tree, ignoring
  * nodes that aren't in the requested block range. total_blocks is
  * required to locate the root node */
-int merkle_visit(const struct merkle_visitor *visitor, uint8_t k,
-		uint64_t from_block, uint64_t to_block,
+int merkle_visit(const struct merkle_visitor *visitor,
+		const struct merkle_context *context, uint64_t from_block,
+		uint64_t to_block, uint64_t total_blocks);
+
+/* perform the same traversal as merkle_visit(), but visit the blocks
+ * of each leaf as one range, and the leaves under each node as one
+ * run of children. merkle_visit() is an adapter over this one */
+int merkle_visit_ranges(const struct merkle_range_visitor *visitor,
+		const struct merkle_context *context, uint64_t from_block,
+		uint64_t to_block, uint64_t total_blocks);
+
+/* perform the same traversal as merkle_visit_ranges(), over each of
+ * the given block ranges at once. the ranges must be sorted and must
+ * not overlap. leaves under the same node that are separated by a gap
+ * between ranges are visited as separate runs */
+int merkle_visit_multi(const struct merkle_range_visitor *visitor,
+		const struct merkle_context *context,
+		const struct merkle_range *ranges, uint64_t count,
 		uint64_t total_blocks);
 
+/* visit the same nodes as merkle_visit(), but a level at a time from
+ * the leaves up, in batches of sibling nodes from each level */
+int merkle_visit_levels(const struct merkle_level_visitor *visitor,
+		const struct merkle_context *context, uint64_t from_block,
+		uint64_t to_block, uint64_t total_blocks);
+
 #endif /* COHORT_MERKLE_VISITOR_H */
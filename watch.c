@@ -0,0 +1,276 @@
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "merkle.h"
+#include "fingerprint.h"
+#include "journal.h"
+#include "update.h"
+
+
+/* milliseconds without modify events before the file is scanned, or
+ * since the first event when the events don't stop */
+#define WATCH_SETTLE 200
+#define WATCH_MAX_DELAY 2000
+
+/* milliseconds between mtime and size checks when there are no events,
+ * which catch writes through a mapping that inotify doesn't report */
+#define WATCH_INTERVAL 60000
+
+/* state kept between scans of the input file */
+struct watch_state {
+	struct merkle_context *context;
+	uint64_t *fingerprints; /* of each leaf's region of the file */
+	struct merkle_range *ranges; /* changed ranges of each scan */
+	uint64_t leaves; /* number of fingerprints */
+	uint64_t total_blocks; /* as of the last scan */
+	struct stat stat; /* as of the last scan */
+};
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* returns nonzero if the input file has no links left */
+static int input_unlinked(const struct merkle_context *context)
+{
+	struct stat stat;
+	return fstat(context->fd_in, &stat) == 0 && stat.st_nlink == 0;
+}
+
+/* resize the fingerprint and range arrays for the given leaf count */
+static int watch_resize(struct watch_state *watch, uint64_t leaves)
+{
+	void *fingerprints, *ranges;
+
+	fingerprints = realloc(watch->fingerprints, leaves * sizeof(uint64_t));
+	if (fingerprints == NULL)
+		return errno;
+	watch->fingerprints = (uint64_t*)fingerprints;
+
+	ranges = realloc(watch->ranges, leaves * sizeof(struct merkle_range));
+	if (ranges == NULL)
+		return errno;
+	watch->ranges = (struct merkle_range*)ranges;
+	return 0;
+}
+
+/* fingerprint each leaf's region of the input file, and update the
+ * hashes of the regions whose fingerprints changed since the last
+ * scan. unless forced, the scan is skipped when the file's size and
+ * mtime are the same as they were */
+static int watch_scan(struct watch_state *watch, int force)
+{
+	struct merkle_context *context = watch->context;
+	size_t region = context->k_leaf * context->block_size;
+	uint64_t total_blocks, leaves, i, first, last, count = 0;
+	uint64_t old_leaves = watch->leaves;
+	struct stat stat;
+	uint64_t value;
+	int status;
+
+	if (fstat(context->fd_in, &stat) == -1) {
+		status = errno;
+		fprintf(stderr, "watch: fstat() of input file "
+				"failed with %d\n", status);
+		return status;
+	}
+
+	if (!force && stat.st_size == watch->stat.st_size &&
+			stat.st_mtim.tv_sec == watch->stat.st_mtim.tv_sec &&
+			stat.st_mtim.tv_nsec == watch->stat.st_mtim.tv_nsec)
+		return 0;
+
+	total_blocks = stat.st_size / context->block_size +
+		(stat.st_size % context->block_size ? 1 : 0);
+	if (total_blocks == 0) {
+		if (context->verbose)
+			printf("input file is empty, waiting for blocks\n");
+
+		/* the next scan writes a whole new tree, which mustn't
+		 * find the digests of this one past its end */
+		if (watch->total_blocks) {
+			status = journal_finish(context,
+					truncate_hash(context, 0));
+			if (status)
+				return status;
+		}
+		watch->stat = stat;
+		watch->total_blocks = 0;
+		watch->leaves = 0;
+		return 0;
+	}
+	leaves = total_blocks / context->k_leaf +
+		(total_blocks % context->k_leaf ? 1 : 0);
+
+	status = watch_resize(watch, leaves);
+	if (status)
+		return status;
+
+	/* bring the tree to the new size first, rehashing the new last
+	 * block of a truncated file. the blocks it assumes are zeroes
+	 * when growing are in the new leaves, which the scan updates */
+	if (watch->total_blocks && total_blocks != watch->total_blocks) {
+		context->partial = 1;
+		status = merkle_resize(context, watch->total_blocks,
+				total_blocks);
+		if (status)
+			return status;
+		if (context->verbose)
+			printf("resized tree from %lu to %lu blocks\n",
+					watch->total_blocks, total_blocks);
+	} else if (watch->total_blocks == 0)
+		old_leaves = 0; /* no tree yet, so every leaf is new */
+
+	for (i = 0; i < leaves; i++) {
+		status = read_at(context->fd_in, i * region,
+				context->block_buffer, region);
+		if (status)
+			return status;
+
+		value = fingerprint(context->block_buffer, region);
+		if (i < old_leaves && value == watch->fingerprints[i])
+			continue;
+		watch->fingerprints[i] = value;
+
+		/* merge the blocks of adjacent changed leaves */
+		first = i * context->k_leaf;
+		last = first + context->k_leaf - 1;
+		if (last >= total_blocks)
+			last = total_blocks - 1;
+
+		if (count && watch->ranges[count-1].to_block + 1 == first) {
+			watch->ranges[count-1].to_block = last;
+		} else {
+			watch->ranges[count].from_block = first;
+			watch->ranges[count].to_block = last;
+			count++;
+		}
+	}
+
+	watch->stat = stat;
+	watch->total_blocks = total_blocks;
+	watch->leaves = leaves;
+
+	if (count == 0)
+		return 0;
+
+	status = merkle_update_ranges(context, watch->ranges, count,
+			total_blocks);
+	if (status)
+		return status;
+
+	if (context->verbose)
+		printf("updated %lu changed ranges of %lu blocks\n",
+				count, total_blocks);
+	return 0;
+}
+
+/* watch the input file for changes, and update the hash tree over
+ * the regions that changed */
+int merkle_watch(struct merkle_context *context, const char *path)
+{
+	struct watch_state watch;
+	char events[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	struct pollfd poll_fd;
+	uint64_t first_event = 0;
+	ssize_t bytes;
+	char *next;
+	int fd, ready, status;
+
+	memset(&watch, 0, sizeof(watch));
+	watch.context = context;
+
+	fd = inotify_init1(IN_CLOEXEC);
+	if (fd == -1) {
+		status = errno;
+		fprintf(stderr, "watch: inotify_init1() failed with %d\n", status);
+		return status;
+	}
+
+	if (inotify_add_watch(fd, path, IN_MODIFY | IN_CLOSE_WRITE |
+				IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) == -1) {
+		status = errno;
+		fprintf(stderr, "watch: inotify_add_watch('%s') failed "
+				"with %d\n", path, status);
+		goto out;
+	}
+
+	/* start with a full update, which records every fingerprint */
+	status = watch_scan(&watch, 1);
+	if (status)
+		goto out;
+
+	if (context->verbose)
+		printf("watching '%s' for changes\n", path);
+
+	poll_fd.fd = fd;
+	poll_fd.events = POLLIN;
+	for (;;) {
+		/* wait for the events to settle before scanning */
+		ready = poll(&poll_fd, 1, first_event ?
+				WATCH_SETTLE : WATCH_INTERVAL);
+		if (ready == -1) {
+			if (errno == EINTR)
+				continue;
+			status = errno;
+			fprintf(stderr, "watch: poll() failed with %d\n", status);
+			goto out;
+		}
+
+		if (ready == 0 || (first_event &&
+					now_ms() - first_event >= WATCH_MAX_DELAY)) {
+			/* without events, only scan if the file changed */
+			status = watch_scan(&watch, first_event != 0);
+			if (status)
+				goto out;
+			first_event = 0;
+			if (ready == 0)
+				continue;
+		}
+
+		bytes = read(fd, events, sizeof(events));
+		if (bytes == -1) {
+			if (errno == EINTR)
+				continue;
+			status = errno;
+			fprintf(stderr, "watch: read() failed with %d\n", status);
+			goto out;
+		}
+
+		for (next = events; next < events + bytes;
+				next += sizeof(*event) + event->len) {
+			event = (const struct inotify_event*)next;
+
+			/* our open descriptor keeps the inode from being
+			 * deleted, so an unlink only shows up as a change
+			 * to the link count */
+			if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF |
+						IN_IGNORED)) || ((event->mask & IN_ATTRIB) &&
+						input_unlinked(context))) {
+				printf("input file '%s' was removed\n", path);
+				status = 0;
+				goto out;
+			}
+			if ((event->mask & IN_ATTRIB) == 0 && first_event == 0)
+				first_event = now_ms();
+		}
+	}
+out:
+	close(fd);
+	free(watch.fingerprints);
+	free(watch.ranges);
+	return status;
+}